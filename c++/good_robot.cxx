@@ -4,18 +4,60 @@ Toy robot game.
 
 Synopsis:
 
+    good_robot [ --async-output[=<megabytes>] ] [ --drop-output ]
+               [ --parallel-parse ] [ --check ]
+               [ --strip=<strip>/<strips> --peers=<host>:<port>,... ]
+               [ --replicate-to=<host>:<port> [ --replicate-batch=<lines> ] ]
+               [ --follow=<port> ]
+               [ --serve=[<host>:]<port> [ --lane-weights=<interactive>,<bulk> ]
+                   [ --session-budget=<lines>,<bytes> ]
+                   [ --server-budget=<lines>,<bytes> ] ]
+               [ <input-file> ... ]
+
     Accepts commands (from stdin or named input files):
         table <xmin> <ymin> <xmax> <ymax>
         create <new-robot-name>
+        destroy <robot-name>
         [ <robot-name>: ] place <x> <y> <direction>
         [ <robot-name>: ] move
         [ <robot-name>: ] left
         [ <robot-name>: ] right
         [ <robot-name>: ] report
         [ <robot-name>: ] remove
+        [ <robot-name>: ] behave wander | forward <steps> | stop
+        tick [ <count> ]
+        [ <robot-name>: ] speed <cells-per-second>
+        run [ <time> ]
+        continuous on | off
+        [ <robot-name>: ] velocity <vx> <vy>
+        begin
+        commit
+        abort
+        group <group-name> <robot-name> [ <robot-name> ... ]
+        ungroup <group-name> [ <robot-name> ... ]
+        export <file-name>
+        heatmap on | off | export <file-name> | top [ <count> ] | rejected [ <count> ]
+        trace <robot-name> [ <from-step> [ <to-step> ] ]
+        contention [ <count> ]
+        constraints
+        zone [ <zone-name> speed | heading | capacity <xmin> <ymin> <xmax> <ymax> <limit> ]
+        zone <zone-name> remove
+        room <room-name> <xmin> <ymin> <xmax> <ymax>
+        room <room-name> portal <x> <y> <room-name> <x> <y>
+        room <room-name> place <robot-name> <x> <y> <direction>
+        rooms [ step [ <count> ] ]
+        fleet step [ <count> ]
+        session [ <session-id> ] interactive | bulk
+        lanes
         quit
         help
 
+    Wherever "<robot-name>:" can go, "<group-name>:" or a robot name pattern
+    (such as "dock3-*:") can go instead.
+
+    Any command but quit and run can be prefixed by a timestamp, in
+    milliseconds, as in "@t=1500 Arthur: move".
+
     Commands are case-insensitive. Robot names are case-sensitive.
 
     Arguments (for "table" and "place") can be comma- or space-delimited.
@@ -32,6 +74,150 @@ Synopsis:
     itself outside the boundaries. Please don't do this as it upsets the
     Robot's world view :-)
 
+    behave gives a robot a Behaviour which runs a step every tick: "wander"
+    moves until blocked and then turns right, "forward" moves the given
+    number of steps, "stop" cancels it. tick runs the given number of ticks
+    (default 1).
+
+    Timestamped commands are not run as they are read but queued for their
+    time. Reading a later timestamp, "run <time>", "run", quit or the end of
+    the input carries out everything due before then, commands with the same
+    timestamp together in the order they were read. A robot with a speed
+    (default 0, meaning instantaneous) takes 1000/speed ms to carry out a
+    timestamped move, and its later timestamped commands wait for it.
+
+    In continuous mode robots also have real-valued positions and a velocity,
+    in cells per second, and glide along as the clock moves on, stopping dead
+    when they bump into one another or the table edge. Robots are discs one
+    cell across, and a robot's x and y are those of its nearest cell.
+
+    begin opens a transaction: place/move/left/right/remove commands are then
+    held back until commit, which carries them all out if the positions they
+    leave everyone in are all acceptable and none of them otherwise, or abort,
+    which drops them. Only where robots end up matters, so robots can swap
+    places. Robots not on the table are left alone, as ever. Other commands
+    go ahead straight away.
+
+    group creates a group of robots, or adds robots to an existing one, and
+    "<group-name>: <command>" acts on just those robots. ungroup takes robots
+    out of a group or, given none, does away with the group. Group names
+    cannot be robot names.
+
+    In a robot name pattern, * stands for any run of characters and ? for any
+    single character, and the command acts on every robot whose name matches.
+    Robot names cannot contain either. destroy does away with a robot
+    altogether (but not during a transaction).
+
+    export writes a report line for every robot to a file, in the background:
+    it works from a snapshot of the robots as they were when it was given,
+    while later commands go ahead.
+
+    heatmap on starts counting how often robots go into each cell, and how
+    often they are turned back trying to move into it; off stops, and forgets
+    the counts. heatmap export writes the counts to a binary file, and
+    heatmap top and heatmap rejected list the busiest cells (default 10) by
+    visits and by rejected moves. Not in concurrent mode.
+
+    Every robot's path is recorded a step at a time, a step being a move, a
+    turn or anything else which changes where it is or which way it faces.
+    trace lists where the robot was after each step from the given one
+    (default 0, as created) to the given one (default the latest).
+
+    contention says how many moves have been turned back and why (the table
+    edge, a robot in the way or anything else), and lists the cells most
+    moved into in vain and the robots most held up by others, as counted
+    (approximately, but without locking) in count-min sketches.
+
+    Moves are checked against each Constraint (the table edge, the robots
+    in the way) in an order which every 1024 checks is worked out again so
+    that those saying no most often for their cost go first. A Constraint
+    with an extent isn't asked about cells outside it. constraints lists
+    them in the order they're asked in, with how often they've been asked
+    and have said no.
+
+    zone makes a rectangle of the table (as for table) which robots may only
+    move into at no more than the given speed (so not at all without one),
+    or not facing the given way, or no more than the given number at a time.
+    A zone of the same name is replaced. zone on its own lists the zones.
+    Not capacity zones in concurrent mode.
+
+    Rooms are apart from the table, each with its own bounds, and a robot
+    placed in one (from off the table) moves, turns and reports there as
+    it would on the table, until placed back on the table or removed. A
+    robot moving onto a portal cell comes out at the other end, in
+    whichever room, once the cell there is free. rooms step has the robots
+    in every room wander for that many steps (default 1), each room on a
+    thread of its own which waits only for the rooms it shares portals
+    with; rooms on its own lists the rooms and who's in them.
+
+    A report covering many robots is formatted in chunks split across a pool
+    of worker threads, and the chunks written out in order.
+
+    An input file can be compressed with the lz4 command-line tool (but not
+    with -BD). It's decoded as it goes, here rather than by the LZ4 library,
+    batches of blocks being decoded on worker threads ahead of the parser.
+
+    With --parallel-parse, input is parsed a window at a time, in chunks on
+    all the worker threads, short of looking up robot and group names, which
+    is done in order as each command comes to be carried out.
+
+    Input files are read a block at a time. Line ends and words are found,
+    and commands lower-cased, with SSE2 or AVX2 instructions, whichever the
+    processor has.
+
+    With --check, input is only parsed, in parallel, and the names in it
+    looked up, keeping track of the robots and groups it would create and do
+    away with. Nothing is carried out; each error is reported with the line
+    it's on, and the exit status is 1 if there are any.
+
+    With --async-output, output is written by a thread of its own, so
+    commands go ahead while a slow pipe drains. Up to the given number of
+    megabytes (default 64) can be waiting to be written; beyond that
+    good_robot waits for the writer or, with --drop-output, throws output
+    away and says at the end how much.
+
+    fleet step moves every robot on the table at once, the given number of
+    times (default 1): forward if the cell in front is on the table, was
+    empty, isn't wanted by a robot with a lower id and the Constraints
+    allow it, otherwise turning right. Not with capacity zones, nor in a
+    transaction. With --strip and --peers, each of several processes
+    reading the same input steps only the robots in its own strip of rows,
+    trading the robots in the two rows by each border, and those crossing,
+    with the processes either side after every step, and the robots the
+    steps changed with all of them when another command comes along.
+
+    With --replicate-to, commands that change anything are sent, in
+    batches, to a follower started with --follow, which carries them out
+    on a replica without a word. When the leader stops, the follower takes
+    over straight away with its own input.
+
+    With --serve, clients connect over TCP and send commands, getting back
+    what they write, while the input is the console. Each session has a
+    queue of its own in the interactive or bulk lane (see session), and
+    the executor takes a line at a time from the lanes by weight, so bulk
+    loads don't hold up interactive commands; lanes says how long each
+    lane's lines have waited. The server listens on 127.0.0.1 unless
+    --serve names another address (0.0.0.0 for all of them), as there's
+    no authentication. Clients may only create, command and report on
+    robots, and look at trace, contention, constraints, session and
+    lanes; the rest, such as table, destroy, export and heatmap, is for
+    the console's input alone. Only the console puts a session in the
+    interactive lane, by its id as lanes gives it; a client can only put
+    itself in the bulk lane.
+
+    Each session's queue, and all of them together, are limited in lines
+    and bytes (--session-budget, --server-budget). A session at a limit
+    isn't read from until there's room again, which holds its client up
+    rather than dropping it. lanes also says how long each session has been
+    held up.
+
+    Everything but main is in good_robot_engine.cxx, whose Engine class takes
+    batches of typed Ops from programs linking with it, without going through
+    the command language; see good_robot_engine.hxx. In concurrent mode
+    several threads can submit at once, robots claiming cells with a
+    compare-and-swap. Other threads can pin a snapshot of the robots and read
+    it at leisure.
+
 Flow:
 
 (1) main loop:
@@ -44,7 +230,10 @@ Flow:
         elsif create
             create-robot
                 register-as-command-listener
-                register-as-constrainer
+        elsif begin/commit/abort
+            open/carry-out/drop-transaction
+        elsif transaction-open and robot-command
+            hold-back-command
         else
             broadcast-command-to-all-listeners
                 listeners.each
@@ -58,6 +247,7 @@ Flow:
         check-this-proposal
     if ok
         do it
+            update-occupancy
     endif
 
 Classes:
@@ -77,7 +267,9 @@ Classes:
     Robot: implementation of GameObject, which responds to Commands
             while observing Constraints
 
-    RobotFactory: constructs Robots
+    RobotFactory: constructs and destroys Robots
+
+    RadixTree: compact trie of robot names, for lookup by name or pattern
 
     Table: implementation of GameObject, which responds to (very few) Commands
            and provides a constraint-request verdict
@@ -92,311 +284,264 @@ Classes:
     Constraint: checks proposed moves etc; constructed by GameObject in order
                 to relay constraint-verdict requests to the GameObject
 
-    ConstraintFactory: constructs Constraints
+    ConstraintFactory: constructs Constraints and keeps them in the order
+                       they're best asked in
 
-    Tokeniser: DIY stand-in to handle comma and whitespace (because
-               istringstream parsing only handles whitespace)
+    Zones: speed limits, forbidden headings and capacities for rectangles of
+           the table, indexed by band of rows
 
-    Various Exception classes.
-*/
+    Rooms: rooms apart from the table, joined by portals, each run on a
+           thread of its own
 
-#include <fstream>
-#include <iostream>
-#include <map>
-#include <set>
-#include <string>
-#include <sstream>
-#include <stdexcept>
-#include <vector>
+    SocketLink: a TCP connection to another good_robot process, holding the
+                next strip of the table or replicating
 
-using namespace std;
+    Fleet: steps of every robot on the table at once, shared among processes
+           by strips of rows
 
-#include "my_scoped_ptr.hxx"
-using namespace scoping;
+    Replication: sends carried-out commands to a follower process, or
+                 follows a leader until it stops and then takes over
 
-enum Direction { Invalid, North, East, South, West };
-static bool validDirection ( Direction direction );
-static string directionAsString ( Direction direction );
-static Direction directionFromString ( const string & str );
-static void help();
-static string lowerCaseString ( const string & str );
+    Server: takes command lines from clients over TCP, queued by session
+            within budgets, and shares the executor between the interactive
+            and bulk lanes by weight
 
-//////////////////////////////////////////////////////////////////////////////
+    Occupancy: index of which robot is in which cell, and the Constraint which
+               keeps robots from sharing
 
-class CommandStream
-{
-    public:
-        CommandStream ( const char * fileName );
-        CommandStream ( FILE * stream );
-        ~CommandStream();
-        bool getCommand ( string & command ) const;
-    private:
-        FILE * m_stream;
-};
+    Transaction: robot commands held back between begin and commit
 
-//////////////////////////////////////////////////////////////////////////////
+    Group: a named set of robots, held as an array of robot ids
 
-class GameObject;   // forward declaration
+    GroupFactory: constructs and destroys Groups
 
-class Command
-{
-    public:
-        string name() const;
-        string qualifiers() const;
-        GameObject * gameObject() const;
-    private:
-        Command
-        (   const string & name,
-            const string & qualifers,
-            GameObject * gameObject = 0
-        );
-        string m_name;
-        string m_qualifiers;
-        GameObject * m_gameObject;
-    friend class CommandFactory;
-};
+    Behaviour: a robot's cooperative routine, written as sequential code
+               which suspends itself once per tick
 
-//////////////////////////////////////////////////////////////////////////////
+    Scheduler: resumes all live Behaviours once per tick
 
-class CommandFactory
-{
-    public:
-        static CommandFactory * singleton();
-        void checkValidCommand ( const string & command ) const;
-        const vector<string> & validCommands() const;
-        void setValidCommands ( const vector<string> & commands );
-        Command * createCommand ( const string & commandString ) const;
-    private:
-        vector<string> m_validCommands;
-};
+    FramePool: fixed-size slot allocator for Behaviour frames
 
-//////////////////////////////////////////////////////////////////////////////
-// This is what a GameObject registers with the Broadcaster in order to
-// receive Commands.
-
-typedef void (GameObject::*GameObjectResponder) ( const Command & command );
-
-//////////////////////////////////////////////////////////////////////////////
+    TimingWheel: hierarchical timing wheel holding timestamped Commands
 
-class CommandListener
-{
-    public:
-        CommandListener ( GameObject * object, GameObjectResponder responder );
-        GameObject * object() const;
-        virtual void inform ( const Command & command );
-    private:
-        GameObject * m_object;
-        GameObjectResponder m_responder;
-};
+    Timeline: the simulation clock, which fires the TimingWheel's batches
 
-//////////////////////////////////////////////////////////////////////////////
+    ContinuousWorld: moves robots with velocities between clock ticks, finding
+                     collisions by sweep-and-prune
 
-class GameObject
-{
-    public:
-        virtual void respond ( const Command & command ) = 0;
-        virtual bool constraintDecider
-        (   GameObject * object,
-            int xpos,
-            int ypos,
-            Direction direction,
-            bool onTable
-        );
-        virtual string name();
-        virtual int xpos();
-        virtual int ypos();
-        virtual Direction direction();
-        virtual bool onTable();
-    protected:
-        GameObject ( const string & name );
-        string m_name;
-        int m_xpos;
-        int m_ypos;
-        Direction m_direction;
-        bool m_onTable;
-};
+    Tokeniser: DIY stand-in to handle comma and whitespace (because
+               istringstream parsing only handles whitespace)
 
-//////////////////////////////////////////////////////////////////////////////
-// This is what a GameObject registers with the corresponding Constraint in
-// order for the Constraint to give a verdict.
+    Engine: typed batch interface for programs linking with the engine
 
-typedef bool (GameObject::*ConstraintDecider)
-    ( GameObject * object, int xpos, int ypos, Direction direction, bool onTable );
+    CellGrid: the table as atomic words, one per cell, for concurrent mode
 
-//////////////////////////////////////////////////////////////////////////////
+    Snapshot: every robot's state as of some point between commands
 
-class Robot : public GameObject
-{
-    public:
-        void respond ( const Command & command );
-        void place ( int xpos, int ypos, Direction direction );
-        void move();
-        void left();
-        void right();
-        void report();
-        void remove();
-        static Robot * find ( const string & robotName );
-        bool constraintDecider
-        (   GameObject * object,
-            int xpos,
-            int ypos,
-            Direction direction,
-            bool onTable
-        );
-
-    private:
-        Robot ( const string & name );
-    friend class RobotFactory;
-};
+    Snapshots: publishes Snapshots, pins them for readers, and reclaims them
+               when the last reader is done
 
-//////////////////////////////////////////////////////////////////////////////
+    Queries: background threads writing out Snapshots for export
 
-class RobotFactory
-{
-    public:
-        static RobotFactory * singleton();
-        Robot * createRobot ( const string & robotName );
-        const map< string, Robot* > & robots() const;
-    private:
-        map< string, Robot* > m_robots;
-};
+    WorkerPool: a fixed set of threads which share out numbered tasks
 
-//////////////////////////////////////////////////////////////////////////////
-// Just to constrain objects to remain within the table limits.
+    ReportWriter: collects a broadcast's report lines and formats them on the
+                  WorkerPool
 
-class Table : public GameObject
-{
-    public:
-        static void setTable ( int xmin, int ymin, int xmax, int ymax );
-        void respond ( const Command & command );
-        void report();
-        bool constraintDecider
-        (   GameObject * object,
-            int xpos,
-            int ypos,
-            Direction direction,
-            bool onTable
-        );
-        int xmin();
-        int ymin();
-        int xmax();
-        int ymax();
-    private:
-        Table ( int xmin, int ymin, int xmax, int ymax );
-        int m_xmin;
-        int m_ymin;
-        int m_xmax;
-        int m_ymax;
-};
+    AsyncOutput: writes cout and cerr from a thread of its own
 
-//////////////////////////////////////////////////////////////////////////////
+    CompressedInput: reads and decodes LZ4-compressed input ahead of
+                     CommandStream
 
-class Interpreter
-{
-    public:
-        Interpreter ( CommandStream & commandStream );
-        void run();
-    private:
-        CommandStream & m_commandStream;
-};
+    SymbolicCommand: a command line parsed up to the point of looking up names
 
-//////////////////////////////////////////////////////////////////////////////
-// Interpreter(s) submit(s) stuff on to singleton Broadcaster which broadcasts
-// to all Listeners. That's not going to scale well for enormous games, is it?
+    ParallelParser: parses windows of input into SymbolicCommands on the
+                    WorkerPool
 
-class Broadcaster
-{
-    public:
-        static Broadcaster * singleton();
-        void createCommandListener
-        (   GameObject * object,
-            GameObjectResponder responder
-        );
-        void broadcast ( const Command & command );
-    private:
-        static Broadcaster * m_broadcaster;
-        vector< CommandListener* > m_commandListeners;
-};
+    Heatmap: saturating per-cell counts of visits and rejected moves, in
+             tiles made as needed
 
-//////////////////////////////////////////////////////////////////////////////
+    Trajectory: a robot's recorded path, two bits a step with keyframes
 
-class Constraint
-{
-    public:
-        static bool acceptable
-        (   GameObject * object,
-            int xpos,
-            int ypos,
-            Direction direction,
-            bool onTable
-        );
-    private:
-        Constraint
-        (   GameObject * object,
-            ConstraintDecider decider
-        );
-        GameObject * m_object;
-        ConstraintDecider m_decider;
-    friend class ConstraintFactory;
-};
+    CountMinSketch: approximate counts of many keys in fixed space, with a
+                    heap of the keys counted most
 
-//////////////////////////////////////////////////////////////////////////////
+    Contention: counts of why moves are turned back, and where, and by whom
 
-class ConstraintFactory
-{
-    public:
-        static ConstraintFactory * singleton();
-        Constraint * createConstraint
-        (   GameObject * object,
-            ConstraintDecider decider
-        );
-        const set< Constraint* > & constraints() const;
-    private:
-        set< Constraint* > m_constraints;
-};
+    Checker: looks names up in parsed input without carrying anything out,
+             for --check
 
-//////////////////////////////////////////////////////////////////////////////
+    Scanner: finds line ends and tokens, and lower-cases, with whichever of
+             SSE2 and AVX2 the processor has
 
-class Tokeniser
-{
-    public:
-        Tokeniser ( const string & stringToParse, const string & separators );
-        string nextToken();
-    private:
-        string m_stringToParse;
-        string m_separators;
-        size_t m_currentPosition;
-};
+    Various Exception classes.
+*/
 
-//////////////////////////////////////////////////////////////////////////////
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
 
-class InvalidCommandException : public exception
-{
-    public:
-        InvalidCommandException ( const string & message )
-          : exception ( message.c_str() ) {}
-};
+#include "good_robot_engine.hxx"
 
-class InvalidDirectionException : public exception
-{
-    public:
-        InvalidDirectionException
-        (   const string & directionString,
-            const string & message
-        ) : exception ( message.c_str() ), m_directionString ( directionString ) {}
-        const string & directionString() const { return m_directionString; }
-    private:
-        string m_directionString;
-};
+#include "my_scoped_ptr.hxx"
+using namespace scoping;
 
 //////////////////////////////////////////////////////////////////////////////
 
 extern int main ( int argc, char ** argv )
 {
+    // Out here so that everything, errors included, is written out by the
+    // time main returns.
+    scoped_ptr< AsyncOutput > asyncOutput;
     try
     {
+        // Options, then input files.
+        vector< string > fileNames;
+        size_t outputCap = 0;       // megabytes; 0 for writing as we go
+        bool dropOutput = false;
+        bool parallelParse = false;
+        bool check = false;
+        size_t strip = 0;
+        size_t strips = 1;
+        vector< string > peers;
+        string follower;            // host:port, if replicating
+        size_t batchSize = 256;     // lines
+        int leaderPort = 0;         // if following
+        int serverPort = 0;         // if serving
+        string serverHost ( "127.0.0.1" );
+        for ( int inx = 1; inx < argc; ++inx )
+        {
+            string arg ( argv[inx] );
+            if ( arg == "--async-output" )
+            {
+                outputCap = 64;
+            }
+            else if ( arg.compare ( 0, 15, "--async-output=" ) == 0 )
+            {
+                outputCap = strtoul ( arg.c_str() + 15, 0, 10 );
+                if ( outputCap == 0 )
+                {
+                    throw exception ( ( "Invalid output memory cap in " + arg ).c_str() );
+                }
+            }
+            else if ( arg == "--drop-output" )
+            {
+                dropOutput = true;
+            }
+            else if ( arg == "--parallel-parse" )
+            {
+                parallelParse = true;
+            }
+            else if ( arg == "--check" )
+            {
+                check = true;
+            }
+            else if ( arg.compare ( 0, 8, "--strip=" ) == 0 )
+            {
+                char * slash = 0;
+                strip = strtoul ( arg.c_str() + 8, &slash, 10 );
+                strips = ( *slash == '/' ) ? strtoul ( slash + 1, 0, 10 ) : 0;
+                if ( strips == 0 || strip >= strips )
+                {
+                    throw exception ( ( "Invalid strip in " + arg + " (expected <strip>/<strips>, from 0)" ).c_str() );
+                }
+            }
+            else if ( arg.compare ( 0, 8, "--peers=" ) == 0 )
+            {
+                Tokeniser tokeniser ( arg.substr ( 8 ), "," );
+                for ( string peer ( tokeniser.nextToken() ); ! peer.empty(); peer = tokeniser.nextToken() )
+                {
+                    peers.push_back ( peer );
+                }
+            }
+            else if ( arg.compare ( 0, 15, "--replicate-to=" ) == 0 )
+            {
+                follower = arg.substr ( 15 );
+            }
+            else if ( arg.compare ( 0, 18, "--replicate-batch=" ) == 0 )
+            {
+                batchSize = strtoul ( arg.c_str() + 18, 0, 10 );
+                if ( batchSize == 0 )
+                {
+                    throw exception ( ( "Invalid batch size in " + arg ).c_str() );
+                }
+            }
+            else if ( arg.compare ( 0, 9, "--follow=" ) == 0 )
+            {
+                leaderPort = atoi ( arg.c_str() + 9 );
+                if ( leaderPort <= 0 )
+                {
+                    throw exception ( ( "Invalid port in " + arg ).c_str() );
+                }
+            }
+            else if ( arg.compare ( 0, 8, "--serve=" ) == 0 )
+            {
+                string address ( arg.substr ( 8 ) );
+                size_t colon = address.rfind ( ':' );
+                if ( colon != string::npos )
+                {
+                    serverHost = address.substr ( 0, colon );
+                }
+                serverPort = atoi ( address.c_str() + ( colon == string::npos ? 0 : colon + 1 ) );
+                if ( serverPort <= 0 || serverHost.empty() )
+                {
+                    throw exception ( ( "Invalid port in " + arg ).c_str() );
+                }
+            }
+            else if ( arg.compare ( 0, 15, "--lane-weights=" ) == 0 )
+            {
+                char * comma = 0;
+                unsigned long interactive = strtoul ( arg.c_str() + 15, &comma, 10 );
+                unsigned long bulk = ( *comma == ',' ) ? strtoul ( comma + 1, 0, 10 ) : 0;
+                if ( interactive == 0 || bulk == 0 )
+                {
+                    throw exception ( ( "Invalid lane weights in " + arg + " (expected <interactive>,<bulk>)" ).c_str() );
+                }
+                Server::singleton()->setWeights ( interactive, bulk );
+            }
+            else if ( arg.compare ( 0, 17, "--session-budget=" ) == 0 )
+            {
+                char * comma = 0;
+                unsigned long lines = strtoul ( arg.c_str() + 17, &comma, 10 );
+                unsigned long bytes = ( *comma == ',' ) ? strtoul ( comma + 1, 0, 10 ) : 0;
+                if ( lines == 0 || bytes == 0 )
+                {
+                    throw exception ( ( "Invalid budget in " + arg + " (expected <lines>,<bytes>)" ).c_str() );
+                }
+                Server::singleton()->setSessionBudget ( lines, bytes );
+            }
+            else if ( arg.compare ( 0, 16, "--server-budget=" ) == 0 )
+            {
+                char * comma = 0;
+                unsigned long lines = strtoul ( arg.c_str() + 16, &comma, 10 );
+                unsigned long bytes = ( *comma == ',' ) ? strtoul ( comma + 1, 0, 10 ) : 0;
+                if ( lines == 0 || bytes == 0 )
+                {
+                    throw exception ( ( "Invalid budget in " + arg + " (expected <lines>,<bytes>)" ).c_str() );
+                }
+                Server::singleton()->setServerBudget ( lines, bytes );
+            }
+            else if ( arg.compare ( 0, 2, "--" ) == 0 )
+            {
+                throw exception ( ( "Unknown option " + arg ).c_str() );
+            }
+            else
+            {
+                fileNames.push_back ( arg );
+            }
+        }
+        if ( leaderPort != 0 && ! follower.empty() )
+        {
+            throw exception ( "Cannot both follow and replicate" );
+        }
+        if ( outputCap != 0 )
+        {
+            asyncOutput = new AsyncOutput ( outputCap * 1024 * 1024, dropOutput );
+        }
+
         vector<string> validCommands;
         validCommands.push_back ( "create" );
+        validCommands.push_back ( "destroy" );
         validCommands.push_back ( "table" );
         validCommands.push_back ( "place" );
         validCommands.push_back ( "move" );
@@ -404,32 +549,96 @@ extern int main ( int argc, char ** argv )
         validCommands.push_back ( "right" );
         validCommands.push_back ( "report" );
         validCommands.push_back ( "remove" );
+        validCommands.push_back ( "behave" );
+        validCommands.push_back ( "tick" );
+        validCommands.push_back ( "speed" );
+        validCommands.push_back ( "run" );
+        validCommands.push_back ( "continuous" );
+        validCommands.push_back ( "velocity" );
+        validCommands.push_back ( "begin" );
+        validCommands.push_back ( "commit" );
+        validCommands.push_back ( "abort" );
+        validCommands.push_back ( "group" );
+        validCommands.push_back ( "ungroup" );
+        validCommands.push_back ( "export" );
+        validCommands.push_back ( "heatmap" );
+        validCommands.push_back ( "trace" );
+        validCommands.push_back ( "contention" );
+        validCommands.push_back ( "constraints" );
+        validCommands.push_back ( "zone" );
+        validCommands.push_back ( "room" );
+        validCommands.push_back ( "rooms" );
+        validCommands.push_back ( "fleet" );
+        validCommands.push_back ( "session" );
+        validCommands.push_back ( "lanes" );
         validCommands.push_back ( "help" );
         validCommands.push_back ( "quit" );
         CommandFactory::singleton()->setValidCommands ( validCommands );
         Table::setTable ( 0, 0, 10, 10 );
         RobotFactory::singleton()->createRobot ( "Robbie" );
         RobotFactory::singleton()->createRobot ( "Arthur" );
+        if ( strips > 1 && ! check )
+        {
+            Fleet::singleton()->distribute ( strip, strips, peers );
+        }
+
+        // Just say what's wrong with the input, if asked.
+        if ( check )
+        {
+            Checker checker;
+            size_t errors = 0;
+            if ( ! fileNames.empty() )
+            {
+                for ( size_t inx = 0; inx < fileNames.size(); ++inx )
+                {
+                    CommandStream commandStream ( fileNames[inx].c_str() );
+                    errors += checker.check ( commandStream, fileNames[inx] );
+                }
+            }
+            else
+            {
+                CommandStream commandStream ( stdin );
+                errors += checker.check ( commandStream, "stdin" );
+            }
+            cout << errors << ( errors == 1 ? " error" : " errors" ) << endl;
+            return errors == 0 ? 0 : 1;
+        }
+
+        // A follower only starts on its own input once the leader's gone,
+        // and a leader's follower has to be there from the start.
+        if ( leaderPort != 0 )
+        {
+            Replication::singleton()->follow ( leaderPort );
+        }
+        if ( ! follower.empty() )
+        {
+            Replication::singleton()->lead ( follower, batchSize );
+        }
 
         // Be kind and emit help message first.
         help();
 
         // Read from supplied files or else stdin.
-        if ( argc > 1 )
+        if ( serverPort != 0 )
+        {
+            Server::singleton()->serve ( serverHost, serverPort, fileNames );
+        }
+        else if ( ! fileNames.empty() )
         {
-            for ( int inx = 1; inx < argc; ++inx )
+            for ( size_t inx = 0; inx < fileNames.size(); ++inx )
             {
-                CommandStream commandStream ( argv[inx] );
-                Interpreter interpreter ( commandStream );
+                CommandStream commandStream ( fileNames[inx].c_str() );
+                Interpreter interpreter ( commandStream, parallelParse );
                 interpreter.run();
             }
         }
         else
         {
             CommandStream commandStream ( stdin );
-            Interpreter interpreter ( commandStream );
+            Interpreter interpreter ( commandStream, parallelParse );
             interpreter.run();
         }
+        Replication::singleton()->finish();
     }
     catch ( const string & error )
     {
@@ -453,802 +662,3 @@ extern int main ( int argc, char ** argv )
     }
     return 0;
 }
-
-//////////////////////////////////////////////////////////////////////////////
-
-CommandStream::CommandStream ( const char * fileName )
- : m_stream ( 0 )
-{
-    m_stream = fopen ( fileName, "r" );
-    if ( m_stream == 0 )
-    {
-        stringstream errorStream;
-        errorStream << "Failed to open file "
-                    << fileName << " for reading";
-        throw exception ( errorStream.str().c_str() );
-    }
-}
-
-CommandStream::CommandStream ( FILE * stream )
-  : m_stream ( stream )
-{
-}
-
-CommandStream::~CommandStream()
-{
-    if ( m_stream != 0 )
-    {
-        fclose ( m_stream );
-    }
-}
-
-bool CommandStream::getCommand ( string & command ) const
-{
-    for (;;)    // loop until we read a non-blank line or EOF
-    {
-        // Hideous but I can't get the STL equivalent to handle file streams
-        // and cin equally transparently.
-        char buffer[1024];
-        if ( fgets ( buffer, 1024, m_stream ) == 0 &&
-             feof ( m_stream ) != 0 )
-        {
-            return false;
-        }
-        command = buffer;
-        // Trim trailing newline.
-        command.resize ( command.length()-1 );
-        if ( ! command.empty() )
-        {
-            return true;
-        }
-        // else content-free line so try for the next one
-    }
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Command::Command
-(   const string & name,
-    const string & qualifiers,
-    GameObject * gameObject
-)
-  : m_name ( name ), m_qualifiers ( qualifiers ),
-    m_gameObject ( gameObject )
-{
-}
-
-string Command::name() const
-{
-    return m_name;
-}
-
-string Command::qualifiers() const
-{
-    return m_qualifiers;
-}
-
-GameObject * Command::gameObject() const
-{
-    return m_gameObject;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-CommandFactory * CommandFactory::singleton()
-{
-    static CommandFactory * factory = 0;
-    if ( factory == 0 )
-    {
-        factory = new CommandFactory;
-    }
-    return factory;
-}
-
-Command * CommandFactory::createCommand ( const string & commandString ) const
-{
-    // Shame this only splits on whitespace; we would like to split on ":"
-    // too.
-    istringstream parser ( commandString );
-    string verb;
-    parser >> verb;
-
-    // First see if this is "<known-robot-name>:".
-    // The manipulation here is easier in C++11.
-    Robot * knownRobot = 0;
-    if ( verb[verb.length()-1] == ':' )
-    {
-        knownRobot = Robot::find ( verb.substr(0,verb.length()-1) );
-        if ( knownRobot != 0 )
-        {
-            // Move on to actual verb.
-            parser >> verb;
-        }
-        // else verb ends with a colon which I imagine will fail quite soon.
-    }
-
-    string lcVerb ( lowerCaseString ( verb ) );
-    checkValidCommand ( lcVerb );
-
-    // Store the rest of the command for later command-dependent parsing.
-    string restOfString;
-    getline ( parser, restOfString );
-    return new Command ( lcVerb, restOfString, knownRobot );
-}
-
-void CommandFactory::setValidCommands ( const vector<string> & commands )
-{
-    m_validCommands = commands;
-}
-
-const vector<string> & CommandFactory::validCommands() const
-{
-    return m_validCommands;
-}
-
-void CommandFactory::checkValidCommand ( const string & command ) const
-{
-    for ( vector<string>::const_iterator iter = m_validCommands.begin();
-          iter != m_validCommands.end(); ++iter
-        )
-    {
-        if ( *iter == command )
-        {
-            return;
-        }
-    }
-    throw InvalidCommandException ( command.c_str() );
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-CommandListener::CommandListener
-(   GameObject * object,
-    GameObjectResponder responder
-) : m_object ( object ), m_responder ( responder )
-{
-}
-
-GameObject * CommandListener::object() const
-{
-    return m_object;
-}
-
-void CommandListener::inform ( const Command & command )
-{
-    (m_object->*m_responder) ( command );
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-GameObject::GameObject ( const string & name )
- : m_name ( name ),
-   m_xpos ( 0 ),            // }
-   m_ypos ( 0 ),            // } but irrelevant since not on table
-   m_direction ( Invalid ), // }
-   m_onTable ( false )
-{
-    // It would be tempting to put these here, but that would preclude derived
-    // classes from choosing *not* to respond and/or constrain.
-    // Broadcaster::singleton()->createCommandListener ( this, GameObject::respond );
-    // ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider );
-}
-
-string GameObject::name()
-{
-    return m_name;
-}
-
-int GameObject::xpos()
-{
-    return m_xpos;
-}
-
-int GameObject::ypos()
-{
-    return m_ypos;
-}
-
-Direction GameObject::direction()
-{
-    return m_direction;
-}
-
-bool GameObject::onTable()
-{
-    return m_onTable;
-}
-
-// Is the proposed placement of the given object acceptable to me?
-bool GameObject::constraintDecider
-(   GameObject * object,
-    int xpos,
-    int ypos,
-    Direction direction,
-    bool onTable
-)
-{
-    return true;    // notional GameObject doesn't care
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Robot::Robot ( const string & name )
- : GameObject ( name )
-{
-    // This had better all be single-threaded, otherwise someone might
-    // broadcast a command to (or ask for a constraint-verdict from) this
-    // not-yet-fully-formed Robot.
-    Broadcaster::singleton()->createCommandListener ( this, GameObject::respond );
-    ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider );
-}
-
-void Robot::respond ( const Command & command )
-{
-    const string & commandName ( command.name() );
-
-    // Hmmm... could have a map of command-name-to-method... although only if
-    // all the relevant methods have the same signature. This would be so much
-    // easier in Ruby, as I could just use send().
-    if ( commandName == "place" )
-    {
-        // DIY parsing to handle comma and whitespace.
-        Tokeniser tokeniser ( command.qualifiers(), ", " );
-        string newXposToken = tokeniser.nextToken();
-        string newYposToken = tokeniser.nextToken();
-        string newDirectionToken = tokeniser.nextToken();
-
-        // Got tokens, now convert them.
-        int newXpos = atoi ( newXposToken.c_str() );
-        int newYpos = atoi ( newYposToken.c_str() );
-        Direction newDirection ( directionFromString ( newDirectionToken ) );
-        if ( newDirection == Invalid )
-        {
-            throw InvalidDirectionException ( newDirectionToken, "place" );
-        }
-        place ( newXpos, newYpos, newDirection );
-    }
-    else if ( commandName == "move" )
-    {
-        move();
-    }
-    else if ( commandName == "left" )
-    {
-        left();
-    }
-    else if ( commandName == "right" )
-    {
-        right();
-    }
-    else if ( commandName == "report" )
-    {
-        report();
-    }
-    else if ( commandName == "remove" )
-    {
-        remove();
-    }
-}
-
-// Return named robot or 0.
-Robot * Robot::find ( const string & robotName )
-{
-    const map< string, Robot* > & robots = RobotFactory::singleton()->robots();
-    map< string, Robot* >::const_iterator iter = robots.find ( robotName );
-    return ( iter == robots.end() ) ? 0 : iter->second;
-}
-
-// How best to report failures etc?
-
-void Robot::place ( int xpos, int ypos, Direction direction )
-{
-    if ( Constraint::acceptable ( this, xpos, ypos, direction, true ) )
-    {
-        m_xpos = xpos;
-        m_ypos = ypos;
-        m_direction = direction;
-        m_onTable = true;
-    }
-    else
-    {
-        cout << "Ignoring attempt to place robot " << m_name << " in invalid position" << endl;
-    }
-}
-
-void Robot::move()
-{
-    if ( ! m_onTable )
-    {
-        cout << "Robot " << m_name << " is not on the table" << endl;
-        return;
-    }
-
-    int newXpos = m_xpos;
-    int newYpos = m_ypos;
-
-    switch ( m_direction )
-    {
-        case North:
-        {
-            ++newYpos;
-            break;
-        }
-        case West:
-        {
-            --newXpos;
-            break;
-        }
-        case South:
-        {
-            --newYpos;
-            break;
-        }
-        case East:
-        {
-            ++newXpos;
-            break;
-        }
-        case Invalid:
-        {
-            cout << "Attempt to move robot " << m_name << " without placing it first" << endl;
-            break;
-        }
-        default:    // impossible, it's an enum
-        {
-            throw exception ( "impossible enum value" );
-            break;
-        }
-    }
-
-    if ( Constraint::acceptable ( this, newXpos, newYpos, m_direction, true ) )
-    {
-        m_xpos = newXpos;
-        m_ypos = newYpos;
-    }
-    else
-    {
-        cout << "Ignoring attempt to move robot " << m_name << " to invalid position" << endl;
-    }
-}
-
-void Robot::left()
-{
-    if ( ! m_onTable )
-    {
-        cout << "Robot " << m_name << " is not on the table" << endl;
-        return;
-    }
-
-    m_direction = ( m_direction == North ) ? West :
-                  ( m_direction == West )  ? South :
-                  ( m_direction == South ) ? East :
-                  ( m_direction == East )  ? North :
-                                             Invalid;
-}
-
-void Robot::right()
-{
-    if ( ! m_onTable )
-    {
-        cout << "Robot " << m_name << " is not on the table" << endl;
-        return;
-    }
-
-    m_direction = ( m_direction == North ) ? East :
-                  ( m_direction == East )  ? South :
-                  ( m_direction == South ) ? West :
-                  ( m_direction == West )  ? North :
-                                             Invalid;
-}
-
-void Robot::report()
-{
-    if ( m_onTable )
-    {
-        cout << "Robot " << m_name << " is at x = " << m_xpos
-             << ", y = " << m_ypos
-             << ", facing " << directionAsString(m_direction) << endl;
-    }
-    else
-    {
-        cout << "Robot " << m_name << " is not on the table" << endl;
-    }
-}
-
-void Robot::remove()
-{
-    m_onTable = false;
-    m_direction = Invalid;  // for good measure
-}
-
-// Is the proposed placement of the given object acceptable to me?
-bool Robot::constraintDecider
-(   GameObject * object,
-    int xpos,
-    int ypos,
-    Direction direction,
-    bool onTable
-)
-{
-    // If I'm being asked about myself then I don't care.
-    // If I'm not on the table or it's not on the table then I don't care.
-    // If I am on the table, then I only care about not being in the same
-    // place.
-    return ( this == object ) || ( ! m_onTable ) || ( ! onTable ) ||
-           ( m_xpos != xpos ) || ( m_ypos != ypos );
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-RobotFactory * RobotFactory::singleton()
-{
-    static RobotFactory * factory = 0;
-    if ( factory == 0 )
-    {
-        factory = new RobotFactory;
-    }
-    return factory;
-}
-
-Robot * RobotFactory::createRobot ( const string & robotName )
-{
-    if ( Robot::find ( robotName ) != 0 )
-    {
-        stringstream errorStream;
-        errorStream << "Robot " << robotName << " already exists";
-        throw exception ( errorStream.str().c_str() );
-    }
-    Robot * robot = new Robot ( robotName );
-    m_robots.insert ( pair< string, Robot* > ( robotName, robot ) );
-    return robot;
-}
-
-const map< string, Robot* > & RobotFactory::robots() const
-{
-    return m_robots;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Table::Table ( int xmin, int ymin, int xmax, int ymax )
- : GameObject ( "Table" ),
-   m_xmin ( xmin ), m_ymin ( ymin ), m_xmax ( xmax ), m_ymax ( ymax )
-{
-    Broadcaster::singleton()->createCommandListener ( this, GameObject::respond );
-    ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider );
-}
-
-void Table::setTable ( int xmin, int ymin, int xmax, int ymax )
-{
-    if ( xmin >= xmax || ymin >= ymax )
-    {
-        stringstream errorStream;
-        errorStream << "Invalid table limits [ ( " << xmin << ", " << ymin << " ), ( " << xmax << ", " << ymax << " ) ]";
-        throw exception ( errorStream.str().c_str() );
-    }
-    static Table * table = 0;
-    if ( table == 0 )
-    {
-        table = new Table ( xmin, ymin, xmax, ymax );
-    }
-    else
-    {
-        table->m_xmin = xmin;
-        table->m_ymin = ymin;
-        table->m_xmax = xmax;
-        table->m_ymax = ymax;
-    }
-}
-
-void Table::respond ( const Command & command )
-{
-    const string & commandName ( command.name() );
-
-    if ( commandName == "report" )
-    {
-        report();
-    }
-    else if ( commandName == "table" )
-    {
-        // DIY parsing to handle comma and whitespace.
-        Tokeniser tokeniser ( command.qualifiers(), ", " );
-        string newXminToken = tokeniser.nextToken();
-        string newYminToken = tokeniser.nextToken();
-        string newXmaxToken = tokeniser.nextToken();
-        string newYmaxToken = tokeniser.nextToken();
-
-        // Got tokens, now convert them.
-        int newXmin = atoi ( newXminToken.c_str() );
-        int newYmin = atoi ( newYminToken.c_str() );
-        int newXmax = atoi ( newXmaxToken.c_str() );
-        int newYmax = atoi ( newYmaxToken.c_str() );
-        setTable ( newXmin, newYmin, newXmax, newYmax );
-    }
-}
-
-void Table::report()
-{
-    cout << "Table limits are: [ ( " << m_xmin << ", " << m_ymin << " ), ( "
-         << m_xmax << ", " << m_ymax << " ) ]" << endl;
-}
-
-bool Table::constraintDecider
-(   GameObject * object,
-    int xpos,
-    int ypos,
-    Direction direction,
-    bool onTable
-)
-{
-    // It's ok if it's the table itself or if it's not on the table or if it's
-    // within the table boundaries.
-    return object == this ||
-           ( ! onTable ) ||
-           ( m_xmin <= xpos && xpos < m_xmax &&
-             m_ymin <= ypos && ypos < m_ymax
-           );
-}
-
-int Table::xmin()
-{
-    return m_xmin;
-}
-
-int Table::ymin()
-{
-    return m_ymin;
-}
-
-int Table::xmax()
-{
-    return m_xmax;
-}
-
-int Table::ymax()
-{
-    return m_ymax;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Interpreter::Interpreter ( CommandStream & commandStream )
-  : m_commandStream ( commandStream )
-{
-}
-
-void Interpreter::run()
-{
-    string commandString;
-    while ( m_commandStream.getCommand ( commandString ) )
-    {
-        try
-        {
-            Command * command =
-                CommandFactory::singleton()->createCommand ( commandString );
-            scoped_ptr<Command> freeCommand ( command );
-            // Now this switching is ugly...
-            if ( command->name() == "create" )
-            {
-                string newObjectName;
-                istringstream parser ( command->qualifiers() );
-                parser >> newObjectName;
-                RobotFactory::singleton()->createRobot ( newObjectName );
-            }
-            else if ( command->name() == "help" )
-            {
-                help();
-            }
-            else if ( command->name() == "quit" )
-            {
-                return;
-            }
-            else
-            {
-                Broadcaster::singleton()->broadcast ( *command );
-            }
-        }
-        catch ( const string & error )
-        {
-            cerr << "Exception: " << error << endl;
-        }
-        catch ( const char * error )
-        {
-            cerr << "Exception: " << error << endl;
-        }
-        catch ( const InvalidCommandException & error )
-        {
-            cerr << "Invalid command: " << error.what() << endl;
-            help();
-        }
-        catch ( const InvalidDirectionException & error )
-        {
-            cerr << "Invalid direction " << error.directionString() << " for " << error.what() << endl;
-        }
-        catch ( const exception & error )
-        {
-            cerr << "Caught exception: " << error.what() << endl;
-        }
-        catch ( ... )
-        {
-            cerr << "Failed to create or run command \"" << commandString << "\"" << endl;
-        }
-    }
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Broadcaster * Broadcaster::singleton()
-{
-    static Broadcaster * broadcaster = 0;
-    if ( broadcaster == 0 )
-    {
-        broadcaster = new Broadcaster;
-    }
-    return broadcaster;
-}
-
-// For completeness, ought to have remove as well.
-void Broadcaster::createCommandListener
-(   GameObject * object,
-    GameObjectResponder responder
-)
-{
-    m_commandListeners.push_back ( new CommandListener ( object, responder ) );
-}
-
-void Broadcaster::broadcast ( const Command & command )
-{
-    GameObject * gameObject = command.gameObject();
-    for ( vector< CommandListener* >::iterator iter = m_commandListeners.begin();
-          iter != m_commandListeners.end(); ++iter )
-    {
-        // Broadcast to all listeners or just the one that the Command
-        // specifies.
-        if ( gameObject == 0 || gameObject == (*iter)->object() )
-        {
-            (*iter)->inform ( command );
-        }
-    }
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Constraint::Constraint ( GameObject * object, ConstraintDecider decider )
-  : m_object ( object ), m_decider ( decider )
-{
-}
-
-bool Constraint::acceptable
-(   GameObject * object,
-    int xpos,
-    int ypos,
-    Direction direction,
-    bool onTable
-)
-{
-    // Check sane direction.
-    if ( ! validDirection ( direction ) )
-    {
-        return false;
-    }
-
-    // Check against all the registered Constraints.
-    const set< Constraint* > constraints = ConstraintFactory::singleton()->constraints();
-    for ( set< Constraint* >::const_iterator iter = constraints.begin();
-          iter != constraints.end(); ++iter
-        )
-    {
-        GameObject * constrainerObject = (*iter)->m_object;
-        ConstraintDecider decider = (*iter)->m_decider;
-        if ( ! (constrainerObject->*decider) ( object, xpos, ypos, direction, onTable ) )
-        {
-            return false;
-        }
-    }
-
-    // Looks good, then.
-    return true;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-ConstraintFactory * ConstraintFactory::singleton()
-{
-    static ConstraintFactory * factory = 0;
-    if ( factory == 0 )
-    {
-        factory = new ConstraintFactory;
-    }
-    return factory;
-}
-
-Constraint * ConstraintFactory::createConstraint
-(   GameObject * object,
-    ConstraintDecider decider
-)
-{
-    Constraint * constraint = new Constraint ( object, decider );
-    m_constraints.insert ( constraint );
-    return constraint;
-}
-
-const set< Constraint* > & ConstraintFactory::constraints() const
-{
-    return m_constraints;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-
-Tokeniser::Tokeniser ( const string & stringToParse, const string & separators )
-  : m_stringToParse ( stringToParse ),
-    m_separators ( separators ),
-    m_currentPosition ( 0 )
-{
-}
-
-string Tokeniser::nextToken()
-{
-    size_t nextTokenStart = m_stringToParse.find_first_not_of ( m_separators, m_currentPosition );
-    if ( nextTokenStart == string::npos )
-    {
-        return "";  // to signal EOS
-    }
-    m_currentPosition = m_stringToParse.find_first_of ( m_separators, nextTokenStart+1 );
-    return m_currentPosition == string::npos ?
-           m_stringToParse.substr ( nextTokenStart ) :
-           m_stringToParse.substr ( nextTokenStart, m_currentPosition-nextTokenStart );
-}
-
-//////////////////////////////////////////////////////////////////////////////
-// Direction utilities.
-
-static bool validDirection ( Direction direction )
-{
-    return direction == North || direction == West ||
-           direction == South || direction == East;
-}
-
-static string directionAsString ( Direction direction )
-{
-    return ( direction == North ) ? "North" :
-           ( direction == West )  ? "West" :
-           ( direction == South ) ? "South" :
-           ( direction == East )  ? "East" :
-                                    "Invalid";
-}
-
-static Direction directionFromString ( const string & str )
-{
-    string lcString ( lowerCaseString ( str ) );
-    return ( lcString == "n" || lcString == "north" ) ? North :
-           ( lcString == "w" || lcString == "west" )  ? West :
-           ( lcString == "s" || lcString == "south" ) ? South :
-           ( lcString == "e" || lcString == "east" )  ? East :
-                                                        Invalid;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-// Some helpers.
-
-// Should have map of name-to-function really.
-static void help()
-{
-    cerr << "Valid commands are:" << endl;
-    const vector<string> & validCommands = CommandFactory::singleton()->validCommands();
-    for ( vector<string>::const_iterator iter = validCommands.begin();
-          iter != validCommands.end(); ++iter
-        )
-    {
-        cerr << *iter << endl;
-    }
-}
-
-// string.tolower by steam. Ugh.
-static string lowerCaseString ( const string & str )
-{
-    string lcStr;
-    for ( const char * chPtr = str.c_str(); *chPtr != '\0'; ++chPtr )
-    {
-        lcStr.push_back ( tolower( *chPtr ) );
-    }
-    return lcStr;
-}
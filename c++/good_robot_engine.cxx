@@ -0,0 +1,8734 @@
+// Implementation of the robot engine declared in good_robot_engine.hxx.
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#if defined ( _M_X64 ) || defined ( _M_IX86 ) || defined ( __x86_64__ ) || defined ( __i386__ )
+#define SCANNER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__ (( target ( "sse2" ) ))
+#define TARGET_AVX2 __attribute__ (( target ( "avx2" ) ))
+#endif
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment ( lib, "ws2_32.lib" )
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "good_robot_engine.hxx"
+
+#include "my_scoped_ptr.hxx"
+using namespace scoping;
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Index of the lowest set bit of a non-zero word.
+static int lowestSetBit ( unsigned long long word )
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64 ( &index, word );
+    return static_cast< int > ( index );
+#else
+    return __builtin_ctzll ( word );
+#endif
+}
+
+Scanner::Level Scanner::level()
+{
+    static const Level detected = detect();
+    return detected;
+}
+
+Scanner::Level Scanner::detect()
+{
+#if defined ( SCANNER_X86 ) && defined ( _MSC_VER )
+    int info[4];
+    __cpuid ( info, 0 );
+    int highest = info[0];
+    __cpuid ( info, 1 );
+    bool sse2 = ( info[3] & ( 1 << 26 ) ) != 0;
+    bool avx = ( info[2] & ( 1 << 27 ) ) != 0 &&        // OS saves the registers
+               ( info[2] & ( 1 << 28 ) ) != 0 &&
+               ( _xgetbv ( 0 ) & 6 ) == 6;
+    bool avx2 = false;
+    if ( avx && highest >= 7 )
+    {
+        __cpuidex ( info, 7, 0 );
+        avx2 = ( info[1] & ( 1 << 5 ) ) != 0;
+    }
+    return avx2 ? AVX2 : sse2 ? SSE2 : Bytewise;
+#elif defined ( SCANNER_X86 )
+    __builtin_cpu_init();
+    return __builtin_cpu_supports ( "avx2" ) ? AVX2 :
+           __builtin_cpu_supports ( "sse2" ) ? SSE2 :
+                                               Bytewise;
+#else
+    return Bytewise;
+#endif
+}
+
+// Which of size (up to 64) bytes are separators, a bit each, with the bits
+// beyond size set too.
+static unsigned long long separatorMask
+(   const char * data,
+    size_t size,
+    const char * separators,
+    size_t separatorCount
+)
+{
+    unsigned long long mask = 0;
+    for ( size_t inx = 0; inx < size; ++inx )
+    {
+        if ( memchr ( separators, data[inx], separatorCount ) != 0 )
+        {
+            mask |= 1ULL << inx;
+        }
+    }
+    return size < 64 ? mask | ( ~0ULL << size ) : mask;
+}
+
+#ifdef SCANNER_X86
+
+TARGET_SSE2 static unsigned long long separatorMaskSSE2
+(   const char * data,
+    const char * separators,
+    size_t separatorCount
+)
+{
+    unsigned long long mask = 0;
+    for ( int part = 0; part < 4; ++part )
+    {
+        __m128i bytes = _mm_loadu_si128 ( reinterpret_cast< const __m128i * > ( data + 16 * part ) );
+        __m128i matches = _mm_setzero_si128();
+        for ( size_t inx = 0; inx < separatorCount; ++inx )
+        {
+            matches = _mm_or_si128 ( matches, _mm_cmpeq_epi8 ( bytes, _mm_set1_epi8 ( separators[inx] ) ) );
+        }
+        mask |= (unsigned long long) (unsigned) _mm_movemask_epi8 ( matches ) << ( 16 * part );
+    }
+    return mask;
+}
+
+TARGET_AVX2 static unsigned long long separatorMaskAVX2
+(   const char * data,
+    const char * separators,
+    size_t separatorCount
+)
+{
+    __m256i low = _mm256_loadu_si256 ( reinterpret_cast< const __m256i * > ( data ) );
+    __m256i high = _mm256_loadu_si256 ( reinterpret_cast< const __m256i * > ( data + 32 ) );
+    __m256i lowMatches = _mm256_setzero_si256();
+    __m256i highMatches = _mm256_setzero_si256();
+    for ( size_t inx = 0; inx < separatorCount; ++inx )
+    {
+        __m256i separator = _mm256_set1_epi8 ( separators[inx] );
+        lowMatches = _mm256_or_si256 ( lowMatches, _mm256_cmpeq_epi8 ( low, separator ) );
+        highMatches = _mm256_or_si256 ( highMatches, _mm256_cmpeq_epi8 ( high, separator ) );
+    }
+    return (unsigned long long) (unsigned) _mm256_movemask_epi8 ( lowMatches ) |
+           (unsigned long long) (unsigned) _mm256_movemask_epi8 ( highMatches ) << 32;
+}
+
+TARGET_SSE2 static const char * findSSE2 ( const char * start, const char * end, char byte )
+{
+    __m128i wanted = _mm_set1_epi8 ( byte );
+    for ( ; end - start >= 16; start += 16 )
+    {
+        __m128i bytes = _mm_loadu_si128 ( reinterpret_cast< const __m128i * > ( start ) );
+        unsigned mask = (unsigned) _mm_movemask_epi8 ( _mm_cmpeq_epi8 ( bytes, wanted ) );
+        if ( mask != 0 )
+        {
+            return start + lowestSetBit ( mask );
+        }
+    }
+    for ( ; start < end && *start != byte; ++start )
+    {
+    }
+    return start;
+}
+
+TARGET_AVX2 static const char * findAVX2 ( const char * start, const char * end, char byte )
+{
+    __m256i wanted = _mm256_set1_epi8 ( byte );
+    for ( ; end - start >= 32; start += 32 )
+    {
+        __m256i bytes = _mm256_loadu_si256 ( reinterpret_cast< const __m256i * > ( start ) );
+        unsigned mask = (unsigned) _mm256_movemask_epi8 ( _mm256_cmpeq_epi8 ( bytes, wanted ) );
+        if ( mask != 0 )
+        {
+            return start + lowestSetBit ( mask );
+        }
+    }
+    return findSSE2 ( start, end, byte );
+}
+
+// Bytes between 'A' and 'Z' (compared signed, so nothing above 127 counts)
+// get 0x20 added.
+TARGET_SSE2 static void lowerCaseSSE2 ( char * data, size_t size )
+{
+    const __m128i beforeA = _mm_set1_epi8 ( 'A' - 1 );
+    const __m128i afterZ = _mm_set1_epi8 ( 'Z' + 1 );
+    const __m128i difference = _mm_set1_epi8 ( 'a' - 'A' );
+    for ( ; size >= 16; data += 16, size -= 16 )
+    {
+        __m128i bytes = _mm_loadu_si128 ( reinterpret_cast< const __m128i * > ( data ) );
+        __m128i upper = _mm_and_si128 ( _mm_cmpgt_epi8 ( bytes, beforeA ), _mm_cmplt_epi8 ( bytes, afterZ ) );
+        bytes = _mm_add_epi8 ( bytes, _mm_and_si128 ( upper, difference ) );
+        _mm_storeu_si128 ( reinterpret_cast< __m128i * > ( data ), bytes );
+    }
+    for ( ; size != 0; ++data, --size )
+    {
+        *data = char ( tolower ( *data ) );
+    }
+}
+
+TARGET_AVX2 static void lowerCaseAVX2 ( char * data, size_t size )
+{
+    const __m256i beforeA = _mm256_set1_epi8 ( 'A' - 1 );
+    const __m256i afterZ = _mm256_set1_epi8 ( 'Z' + 1 );
+    const __m256i difference = _mm256_set1_epi8 ( 'a' - 'A' );
+    for ( ; size >= 32; data += 32, size -= 32 )
+    {
+        __m256i bytes = _mm256_loadu_si256 ( reinterpret_cast< const __m256i * > ( data ) );
+        __m256i upper = _mm256_and_si256 ( _mm256_cmpgt_epi8 ( bytes, beforeA ), _mm256_cmpgt_epi8 ( afterZ, bytes ) );
+        bytes = _mm256_add_epi8 ( bytes, _mm256_and_si256 ( upper, difference ) );
+        _mm256_storeu_si256 ( reinterpret_cast< __m256i * > ( data ), bytes );
+    }
+    lowerCaseSSE2 ( data, size );
+}
+
+#endif // SCANNER_X86
+
+const char * Scanner::find ( const char * start, const char * end, char byte )
+{
+#ifdef SCANNER_X86
+    switch ( level() )
+    {
+        case AVX2:
+            return findAVX2 ( start, end, byte );
+        case SSE2:
+            return findSSE2 ( start, end, byte );
+        default:
+            break;
+    }
+#endif
+    const char * found = static_cast< const char * > ( memchr ( start, byte, end - start ) );
+    return found == 0 ? end : found;
+}
+
+// A 64-byte stretch at a time: a bit per byte for whether it's in a token,
+// and a token starts or ends wherever that bit differs from the one before.
+size_t Scanner::tokens
+(   const char * data,
+    size_t size,
+    const char * separators,
+    size_t * offsets,
+    size_t maxTokens
+)
+{
+    size_t separatorCount = strlen ( separators );
+    Level scanLevel = separatorCount <= 8 ? level() : Bytewise;
+    size_t found = 0;
+    unsigned long long inToken = 0;
+    for ( size_t base = 0; base < size && found < 2 * maxTokens; base += 64 )
+    {
+        size_t stretch = min ( size - base, size_t ( 64 ) );
+        unsigned long long separatorBits;
+#ifdef SCANNER_X86
+        if ( stretch == 64 && scanLevel == AVX2 )
+        {
+            separatorBits = separatorMaskAVX2 ( data + base, separators, separatorCount );
+        }
+        else if ( stretch == 64 && scanLevel == SSE2 )
+        {
+            separatorBits = separatorMaskSSE2 ( data + base, separators, separatorCount );
+        }
+        else
+#endif
+        {
+            separatorBits = separatorMask ( data + base, stretch, separators, separatorCount );
+        }
+        unsigned long long tokenBits = ~separatorBits;
+        unsigned long long edges = tokenBits ^ ( ( tokenBits << 1 ) | inToken );
+        for ( ; edges != 0 && found < 2 * maxTokens; edges &= edges - 1 )
+        {
+            offsets[found++] = base + lowestSetBit ( edges );
+        }
+        inToken = tokenBits >> 63;
+    }
+    if ( found % 2 != 0 )
+    {
+        offsets[found++] = size;    // ran on to the end
+    }
+    return found / 2;
+}
+
+void Scanner::lowerCase ( char * data, size_t size )
+{
+#ifdef SCANNER_X86
+    switch ( level() )
+    {
+        case AVX2:
+            lowerCaseAVX2 ( data, size );
+            return;
+        case SSE2:
+            lowerCaseSSE2 ( data, size );
+            return;
+        default:
+            break;
+    }
+#endif
+    for ( ; size != 0; ++data, --size )
+    {
+        *data = char ( tolower ( *data ) );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+CommandStream::CommandStream ( const char * fileName )
+ : m_stream ( 0 ),
+   m_blockwise ( true ),
+   m_compressed ( 0 ),
+   m_block ( 0 ),
+   m_blockSize ( 0 ),
+   m_blockPosition ( 0 )
+{
+    m_stream = fopen ( fileName, "r" );
+    if ( m_stream != 0 && CompressedInput::recognise ( m_stream ) )
+    {
+        // It's binary, so start again in binary mode.
+        m_stream = freopen ( fileName, "rb", m_stream );
+        if ( m_stream != 0 )
+        {
+            CompressedInput::recognise ( m_stream );
+            try
+            {
+                m_compressed = new CompressedInput ( m_stream );
+            }
+            catch ( ... )
+            {
+                fclose ( m_stream );
+                throw;
+            }
+        }
+    }
+    if ( m_stream == 0 )
+    {
+        stringstream errorStream;
+        errorStream << "Failed to open file "
+                    << fileName << " for reading";
+        throw exception ( errorStream.str().c_str() );
+    }
+    if ( m_compressed == 0 )
+    {
+        m_readBuffer.resize ( 64 * 1024 );
+    }
+}
+
+// Not blockwise, so that typing at it gets answers a line at a time.
+CommandStream::CommandStream ( FILE * stream )
+  : m_stream ( stream ),
+    m_blockwise ( false ),
+    m_compressed ( 0 ),
+    m_block ( 0 ),
+    m_blockSize ( 0 ),
+    m_blockPosition ( 0 )
+{
+}
+
+CommandStream::~CommandStream()
+{
+    delete m_compressed;
+    if ( m_stream != 0 )
+    {
+        fclose ( m_stream );
+    }
+}
+
+bool CommandStream::getCommand ( string & command )
+{
+    if ( m_blockwise )
+    {
+        return getBlockCommand ( command );
+    }
+    for (;;)    // loop until we read a non-blank line or EOF
+    {
+        // Hideous but I can't get the STL equivalent to handle file streams
+        // and cin equally transparently.
+        char buffer[1024];
+        if ( fgets ( buffer, 1024, m_stream ) == 0 &&
+             feof ( m_stream ) != 0 )
+        {
+            return false;
+        }
+        command = buffer;
+        // Trim trailing newline.
+        command.resize ( command.length()-1 );
+        if ( ! command.empty() )
+        {
+            return true;
+        }
+        // else content-free line so try for the next one
+    }
+}
+
+// The next block, decoded or read straight from the file; false at the end.
+bool CommandStream::nextBlock()
+{
+    m_blockPosition = 0;
+    if ( m_compressed != 0 )
+    {
+        if ( m_compressed->nextBlock ( m_block, m_blockSize ) )
+        {
+            return true;
+        }
+    }
+    else
+    {
+        m_blockSize = fread ( &m_readBuffer[0], 1, m_readBuffer.size(), m_stream );
+        m_block = &m_readBuffer[0];
+        if ( m_blockSize != 0 )
+        {
+            return true;
+        }
+    }
+    m_blockSize = 0;
+    return false;
+}
+
+// Lines can run on from one block into the next. Read in binary mode, they
+// can also end with a carriage return, which goes too.
+bool CommandStream::getBlockCommand ( string & command )
+{
+    command.clear();
+    for (;;)
+    {
+        if ( m_blockPosition == m_blockSize )
+        {
+            if ( ! nextBlock() )
+            {
+                return ! command.empty();     // a last line with no newline
+            }
+            continue;
+        }
+        const char * start = m_block + m_blockPosition;
+        const char * end = m_block + m_blockSize;
+        const char * newline = Scanner::find ( start, end, '\n' );
+        if ( newline == end )
+        {
+            command.append ( start, end );
+            m_blockPosition = m_blockSize;
+            continue;
+        }
+        command.append ( start, newline );
+        m_blockPosition = newline + 1 - m_block;
+        if ( ! command.empty() && command[command.length()-1] == '\r' )
+        {
+            command.resize ( command.length()-1 );
+        }
+        if ( ! command.empty() )
+        {
+            return true;
+        }
+    }
+}
+
+size_t CommandStream::read ( char * buffer, size_t size )
+{
+    if ( ! m_blockwise )
+    {
+        return fread ( buffer, 1, size, m_stream );
+    }
+    size_t done = 0;
+    while ( done < size )
+    {
+        if ( m_blockPosition == m_blockSize )
+        {
+            if ( ! nextBlock() )
+            {
+                break;
+            }
+            continue;
+        }
+        size_t part = min ( size - done, m_blockSize - m_blockPosition );
+        memcpy ( buffer + done, m_block + m_blockPosition, part );
+        m_blockPosition += part;
+        done += part;
+    }
+    return done;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static const unsigned long lz4Magic = 0x184D2204;
+
+CompressedInput::Batch::Batch()
+  : size ( 0 ),
+    maxBlockSize ( 0 ),
+    ready ( false ),
+    last ( false )
+{
+}
+
+bool CompressedInput::recognise ( FILE * stream )
+{
+    unsigned char start[4];
+    if ( fread ( start, 1, 4, stream ) == 4 &&
+         ( start[0] | start[1] << 8 | start[2] << 16 | (unsigned long) start[3] << 24 ) == lz4Magic
+       )
+    {
+        return true;
+    }
+    rewind ( stream );
+    return false;
+}
+
+CompressedInput::CompressedInput ( FILE * stream )
+  : m_stream ( stream ),
+    m_maxBlockSize ( 0 ),
+    m_blockChecksums ( false ),
+    m_contentChecksum ( false ),
+    m_stopping ( false ),
+    m_parsing ( 0 ),
+    m_nextBlock ( 0 ),
+    m_reader ( 0 )
+{
+    string error ( readDescriptor() );
+    if ( ! error.empty() )
+    {
+        throw exception ( error.c_str() );
+    }
+    m_reader = new thread ( read, this );
+}
+
+CompressedInput::~CompressedInput()
+{
+    {
+        lock_guard< mutex > lock ( m_mutex );
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+    m_reader->join();
+    delete m_reader;
+}
+
+bool CompressedInput::nextBlock ( const char * & data, size_t & size )
+{
+    unique_lock< mutex > lock ( m_mutex );
+    for ( ;; )
+    {
+        Batch & batch = m_batches[m_parsing];
+        while ( ! batch.ready )
+        {
+            m_changed.wait ( lock );
+        }
+        if ( m_nextBlock < batch.size )
+        {
+            if ( batch.corrupt[m_nextBlock] )
+            {
+                throw exception ( "Corrupt block in compressed input" );
+            }
+            data = &batch.decoded[m_nextBlock][0];
+            size = batch.decodedSize[m_nextBlock];
+            ++m_nextBlock;
+            return true;
+        }
+        if ( ! batch.error.empty() )
+        {
+            throw exception ( batch.error.c_str() );
+        }
+        if ( batch.last )
+        {
+            return false;
+        }
+        // Give this batch back to the reader and go on to the next.
+        batch.ready = false;
+        m_parsing = ( m_parsing + 1 ) % batches;
+        m_nextBlock = 0;
+        m_changed.notify_all();
+    }
+}
+
+// The reader thread: fills batches in turn, as the parser gives them back.
+void CompressedInput::read ( CompressedInput * input )
+{
+    size_t blocks = WorkerPool::singleton()->size();
+    for ( size_t inx = 0; ; inx = ( inx + 1 ) % batches )
+    {
+        Batch & batch = input->m_batches[inx];
+        {
+            unique_lock< mutex > lock ( input->m_mutex );
+            while ( batch.ready && ! input->m_stopping )
+            {
+                input->m_changed.wait ( lock );
+            }
+            if ( input->m_stopping )
+            {
+                return;
+            }
+        }
+        input->fill ( batch, blocks );
+        WorkerPool::singleton()->run ( batch.size, decode, &batch );
+        {
+            lock_guard< mutex > lock ( input->m_mutex );
+            batch.ready = true;
+        }
+        input->m_changed.notify_all();
+        if ( batch.last || ! batch.error.empty() )
+        {
+            return;
+        }
+    }
+}
+
+// Read up to the given number of blocks, going on into any frames after
+// this one.
+void CompressedInput::fill ( Batch & batch, size_t blocks )
+{
+    batch.size = 0;
+    batch.maxBlockSize = m_maxBlockSize;
+    batch.last = false;
+    batch.error.clear();
+    batch.compressed.resize ( blocks );
+    batch.stored.resize ( blocks );
+    batch.decoded.resize ( blocks );
+    batch.decodedSize.resize ( blocks );
+    batch.corrupt.resize ( blocks );
+    while ( batch.size < blocks )
+    {
+        unsigned long word;
+        if ( ! readWord ( word ) )
+        {
+            batch.error = "Compressed input is truncated";
+            return;
+        }
+        if ( word == 0 )    // end of frame
+        {
+            if ( ( m_contentChecksum && ! skip ( 4 ) ) )
+            {
+                batch.error = "Compressed input is truncated";
+                return;
+            }
+            if ( ! readWord ( word ) )
+            {
+                batch.last = true;
+                return;
+            }
+            while ( ( word & 0xFFFFFFF0 ) == 0x184D2A50 )   // skippable frame
+            {
+                unsigned long length;
+                if ( ! readWord ( length ) || ! skip ( length ) )
+                {
+                    batch.error = "Compressed input is truncated";
+                    return;
+                }
+                if ( ! readWord ( word ) )
+                {
+                    batch.last = true;
+                    return;
+                }
+            }
+            batch.error = ( word == lz4Magic ) ? readDescriptor() : "Compressed input has junk after the end";
+            if ( ! batch.error.empty() )
+            {
+                return;
+            }
+            batch.maxBlockSize = max ( batch.maxBlockSize, m_maxBlockSize );
+            continue;
+        }
+        size_t size = word & 0x7FFFFFFF;
+        if ( size > m_maxBlockSize )
+        {
+            batch.error = "Compressed input has an oversized block";
+            return;
+        }
+        string & compressed = batch.compressed[batch.size];
+        compressed.resize ( size );
+        if ( ( size != 0 && fread ( &compressed[0], 1, size, m_stream ) != size ) ||
+             ( m_blockChecksums && ! skip ( 4 ) )
+           )
+        {
+            batch.error = "Compressed input is truncated";
+            return;
+        }
+        batch.stored[batch.size] = ( word & 0x80000000 ) != 0;
+        ++batch.size;
+    }
+}
+
+// What follows the magic number at the start of a frame. Returns what's
+// wrong with it, if anything.
+string CompressedInput::readDescriptor()
+{
+    int flags = fgetc ( m_stream );
+    int blockDescriptor = fgetc ( m_stream );
+    if ( flags == EOF || blockDescriptor == EOF )
+    {
+        return "Compressed input is truncated";
+    }
+    if ( ( flags >> 6 ) != 1 )
+    {
+        return "Compressed input is in an unknown version of LZ4";
+    }
+    if ( ( flags & 0x20 ) == 0 )
+    {
+        return "Compressed input has linked blocks (don't use lz4 -BD)";
+    }
+    if ( ( flags & 0x01 ) != 0 )
+    {
+        return "Compressed input needs a dictionary";
+    }
+    int sizeCode = ( blockDescriptor >> 4 ) & 7;
+    if ( sizeCode < 4 )
+    {
+        return "Compressed input has an unknown block size";
+    }
+    m_maxBlockSize = size_t ( 1 ) << ( 8 + 2 * sizeCode );
+    m_blockChecksums = ( flags & 0x10 ) != 0;
+    m_contentChecksum = ( flags & 0x04 ) != 0;
+    // Content size, if given, and header checksum.
+    if ( ! skip ( ( ( flags & 0x08 ) != 0 ? 8 : 0 ) + 1 ) )
+    {
+        return "Compressed input is truncated";
+    }
+    return "";
+}
+
+// Little-endian.
+bool CompressedInput::readWord ( unsigned long & word )
+{
+    unsigned char bytes[4];
+    if ( fread ( bytes, 1, 4, m_stream ) != 4 )
+    {
+        return false;
+    }
+    word = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned long) bytes[3] << 24;
+    return true;
+}
+
+bool CompressedInput::skip ( size_t bytes )
+{
+    for ( ; bytes != 0; --bytes )
+    {
+        if ( fgetc ( m_stream ) == EOF )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CompressedInput::decode ( size_t block, void * context )
+{
+    Batch * batch = static_cast< Batch * > ( context );
+    vector< char > & decoded = batch->decoded[block];
+    if ( decoded.size() < batch->maxBlockSize )
+    {
+        decoded.resize ( batch->maxBlockSize );
+    }
+    const string & compressed = batch->compressed[block];
+    if ( batch->stored[block] )
+    {
+        copy ( compressed.begin(), compressed.end(), decoded.begin() );
+        batch->decodedSize[block] = compressed.size();
+        batch->corrupt[block] = false;
+        return;
+    }
+    batch->decodedSize[block] = batch->maxBlockSize;
+    batch->corrupt[block] = ! decodeBlock ( compressed, decoded, batch->decodedSize[block] );
+}
+
+// One LZ4 block: a run of sequences, each some literal bytes and then a
+// match (an offset back into what's been decoded so far and a length, of at
+// least 4), except the last, which is only literals. decodedSize is the room
+// there is on the way in and how much was used on the way out. False if the
+// block doesn't make sense.
+bool CompressedInput::decodeBlock
+(   const string & compressed,
+    vector< char > & decoded,
+    size_t & decodedSize
+)
+{
+    const unsigned char * in = reinterpret_cast< const unsigned char * > ( compressed.data() );
+    const unsigned char * inEnd = in + compressed.size();
+    char * out = &decoded[0];
+    char * outStart = out;
+    char * outEnd = out + decodedSize;
+    while ( in < inEnd )
+    {
+        unsigned token = *in++;
+        size_t literals = token >> 4;
+        if ( literals == 15 )
+        {
+            unsigned more;
+            do
+            {
+                if ( in == inEnd )
+                {
+                    return false;
+                }
+                more = *in++;
+                literals += more;
+            } while ( more == 255 );
+        }
+        if ( size_t ( inEnd - in ) < literals || size_t ( outEnd - out ) < literals )
+        {
+            return false;
+        }
+        memcpy ( out, in, literals );
+        in += literals;
+        out += literals;
+        if ( in == inEnd )
+        {
+            break;      // the last sequence
+        }
+
+        if ( inEnd - in < 2 )
+        {
+            return false;
+        }
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t length = token & 15;
+        if ( length == 15 )
+        {
+            unsigned more;
+            do
+            {
+                if ( in == inEnd )
+                {
+                    return false;
+                }
+                more = *in++;
+                length += more;
+            } while ( more == 255 );
+        }
+        length += 4;
+        if ( offset == 0 || size_t ( out - outStart ) < offset || size_t ( outEnd - out ) < length )
+        {
+            return false;
+        }
+        const char * match = out - offset;
+        if ( offset >= length )
+        {
+            memcpy ( out, match, length );
+            out += length;
+        }
+        else
+        {
+            // Overlapping: the match repeats what it's copying as it goes.
+            for ( size_t inx = 0; inx < length; ++inx )
+            {
+                *out++ = *match++;
+            }
+        }
+    }
+    decodedSize = out - outStart;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Command::Command
+(   const string & name,
+    const string & qualifiers,
+    GameObject * gameObject
+)
+  : m_name ( name ), m_qualifiers ( qualifiers ),
+    m_gameObject ( gameObject ), m_group ( 0 ),
+    m_timed ( false ), m_time ( 0 ), m_deferred ( false )
+{
+}
+
+string Command::name() const
+{
+    return m_name;
+}
+
+string Command::qualifiers() const
+{
+    return m_qualifiers;
+}
+
+GameObject * Command::gameObject() const
+{
+    return m_gameObject;
+}
+
+const Group * Command::group() const
+{
+    return m_group;
+}
+
+const string & Command::selector() const
+{
+    return m_selector;
+}
+
+bool Command::timed() const
+{
+    return m_timed;
+}
+
+SimTime Command::time() const
+{
+    return m_time;
+}
+
+bool Command::deferred() const
+{
+    return m_deferred;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+CommandFactory * CommandFactory::singleton()
+{
+    static CommandFactory * factory = 0;
+    if ( factory == 0 )
+    {
+        factory = new CommandFactory;
+    }
+    return factory;
+}
+
+Command * CommandFactory::createCommand ( const string & commandString ) const
+{
+    SymbolicCommand parsed;
+    parseCommand ( commandString, parsed );
+    return resolveCommand ( parsed );
+}
+
+// The way "parser >> word" on an istringstream would go, given the command
+// line's whitespace-separated words: once a word is missing, word keeps its
+// old value and nothing more is read. position is the end of the last word
+// read.
+static bool nextWord
+(   const string & text,
+    const size_t * offsets,
+    size_t words,
+    size_t & next,
+    string & word,
+    size_t & position
+)
+{
+    if ( next >= words )
+    {
+        next = words + 1;   // and stays missing
+        return false;
+    }
+    word.assign ( text, offsets[2*next], offsets[2*next+1] - offsets[2*next] );
+    position = offsets[2*next+1];
+    ++next;
+    return true;
+}
+
+// Nothing here looks at anything but the command line and the list of valid
+// commands, so it can go on on any thread.
+void CommandFactory::parseCommand ( const string & commandString, SymbolicCommand & parsed ) const
+{
+    parsed.text = commandString;
+    parsed.error.clear();
+    parsed.timed = false;
+    parsed.time = 0;
+    parsed.targeted = false;
+    parsed.target.clear();
+    parsed.validVerb = false;
+    parsed.qualifiers.clear();
+    parsed.line = 0;
+    parsed.argumentError.clear();
+
+    // Shame this only splits on whitespace; we would like to split on ":"
+    // too. No more than three words are wanted before the qualifiers.
+    size_t offsets[6];
+    size_t words = Scanner::tokens ( commandString.data(), commandString.length(),
+                                     " \t\n\v\f\r", offsets, 3 );
+    size_t next = 0;
+    size_t position = 0;
+    string verb;
+    nextWord ( commandString, offsets, words, next, verb, position );
+
+    // Then see if it's timestamped.
+    if ( verb.length() > 3 && lowerCaseString ( verb.substr ( 0, 3 ) ) == "@t=" )
+    {
+        istringstream timeParser ( verb.substr ( 3 ) );
+        if ( verb[3] == '-' || ! ( timeParser >> parsed.time ) || ! timeParser.eof() )
+        {
+            parsed.error = "Invalid timestamp " + verb;
+            return;
+        }
+        parsed.timed = true;
+        verb.clear();
+        nextWord ( commandString, offsets, words, next, verb, position );
+    }
+
+    // Then whether it starts with a name and a colon; what the name is can
+    // wait.
+    if ( ! verb.empty() && verb[verb.length()-1] == ':' )
+    {
+        parsed.targeted = true;
+        parsed.target = verb.substr(0,verb.length()-1);
+        nextWord ( commandString, offsets, words, next, verb, position );
+    }
+
+    parsed.verb = lowerCaseString ( verb );
+    try
+    {
+        checkValidCommand ( parsed.verb );
+        parsed.validVerb = true;
+    }
+    catch ( const InvalidCommandException & )
+    {
+    }
+
+    // Store the rest of the command for later command-dependent parsing
+    // (none if a word was missing or the last one ended the line).
+    if ( next <= words && position < commandString.length() )
+    {
+        parsed.qualifiers.assign ( commandString, position, commandString.find ( '\n', position ) - position );
+    }
+}
+
+Command * CommandFactory::resolveCommand ( const SymbolicCommand & parsed ) const
+{
+    if ( ! parsed.error.empty() )
+    {
+        throw exception ( parsed.error.c_str() );
+    }
+
+    // See if this is "<known-robot-name>:" or "<known-group-name>:".
+    Robot * knownRobot = 0;
+    const Group * knownGroup = 0;
+    string selector;
+    if ( parsed.targeted )
+    {
+        if ( isSelector ( parsed.target ) )
+        {
+            selector = parsed.target;
+        }
+        else
+        {
+            knownRobot = Robot::find ( parsed.target );
+        }
+        if ( selector.empty() && knownRobot == 0 )
+        {
+            knownGroup = GroupFactory::singleton()->find ( parsed.target );
+        }
+        if ( knownRobot == 0 && knownGroup == 0 && selector.empty() )
+        {
+            // The name and colon were the verb all along.
+            throw InvalidCommandException ( lowerCaseString ( parsed.target + ":" ).c_str() );
+        }
+    }
+    if ( ! parsed.validVerb )
+    {
+        throw InvalidCommandException ( parsed.verb.c_str() );
+    }
+
+    Command * command = new Command ( parsed.verb, parsed.qualifiers, knownRobot );
+    command->m_group = knownGroup;
+    command->m_selector = selector;
+    command->m_timed = parsed.timed;
+    command->m_time = parsed.time;
+    return command;
+}
+
+// The checks the commands themselves make of their qualifiers, short of
+// looking up names, with the same messages as they'd give.
+void CommandFactory::checkArguments ( SymbolicCommand & parsed ) const
+{
+    parsed.argumentError.clear();
+    if ( ! parsed.error.empty() || ! parsed.validVerb )
+    {
+        return;
+    }
+    const string & verb ( parsed.verb );
+    if ( parsed.timed && ( verb == "quit" || verb == "run" ) )
+    {
+        parsed.argumentError = "quit and run cannot be timestamped";
+    }
+    else if ( verb == "table" )
+    {
+        Tokeniser tokeniser ( parsed.qualifiers, ", " );
+        int xmin = atoi ( tokeniser.nextToken().c_str() );
+        int ymin = atoi ( tokeniser.nextToken().c_str() );
+        int xmax = atoi ( tokeniser.nextToken().c_str() );
+        int ymax = atoi ( tokeniser.nextToken().c_str() );
+        if ( xmin >= xmax || ymin >= ymax )
+        {
+            stringstream errorStream;
+            errorStream << "Invalid table limits [ ( " << xmin << ", " << ymin << " ), ( " << xmax << ", " << ymax << " ) ]";
+            parsed.argumentError = errorStream.str();
+        }
+    }
+    else if ( verb == "place" )
+    {
+        try
+        {
+            int xpos;
+            int ypos;
+            Direction direction;
+            Robot::parsePlacement ( parsed.qualifiers, xpos, ypos, direction );
+        }
+        catch ( const InvalidDirectionException & error )
+        {
+            parsed.argumentError = "Invalid direction " + error.directionString() + " for " + error.what();
+        }
+    }
+    else if ( verb == "continuous" )
+    {
+        string modeToken ( lowerCaseString ( Tokeniser ( parsed.qualifiers, ", " ).nextToken() ) );
+        if ( modeToken != "on" && modeToken != "off" )
+        {
+            parsed.argumentError = "continuous expects on or off, not " + modeToken;
+        }
+    }
+    else if ( verb == "behave" )
+    {
+        string behaviourName ( lowerCaseString ( Tokeniser ( parsed.qualifiers, ", " ).nextToken() ) );
+        if ( behaviourName != "wander" && behaviourName != "forward" && behaviourName != "stop" )
+        {
+            parsed.argumentError = "Unknown behaviour " + behaviourName;
+        }
+    }
+    else if ( verb == "export" )
+    {
+        if ( Tokeniser ( parsed.qualifiers, ", " ).nextToken().empty() )
+        {
+            parsed.argumentError = "export needs a file name";
+        }
+    }
+    else if ( verb == "heatmap" )
+    {
+        Tokeniser tokeniser ( parsed.qualifiers, ", " );
+        string modeToken ( lowerCaseString ( tokeniser.nextToken() ) );
+        if ( modeToken != "on" && modeToken != "off" && modeToken != "export" &&
+             modeToken != "top" && modeToken != "rejected"
+           )
+        {
+            parsed.argumentError = "heatmap expects on, off, export, top or rejected, not " + modeToken;
+        }
+        else if ( modeToken == "export" && tokeniser.nextToken().empty() )
+        {
+            parsed.argumentError = "heatmap export needs a file name";
+        }
+    }
+    else if ( verb == "room" )
+    {
+        Tokeniser tokeniser ( parsed.qualifiers, ", " );
+        tokeniser.nextToken();
+        string token ( tokeniser.nextToken() );
+        string lcToken ( lowerCaseString ( token ) );
+        if ( lcToken == "place" )
+        {
+            tokeniser.nextToken();
+            tokeniser.nextToken();
+            tokeniser.nextToken();
+            string directionToken ( tokeniser.nextToken() );
+            if ( directionFromString ( directionToken ) == Invalid )
+            {
+                parsed.argumentError = "Invalid direction " + directionToken + " for room place";
+            }
+        }
+        else if ( lcToken != "portal" )
+        {
+            int xmin = atoi ( token.c_str() );
+            int ymin = atoi ( tokeniser.nextToken().c_str() );
+            int xmax = atoi ( tokeniser.nextToken().c_str() );
+            int ymax = atoi ( tokeniser.nextToken().c_str() );
+            if ( xmin >= xmax || ymin >= ymax )
+            {
+                stringstream errorStream;
+                errorStream << "Invalid room limits [ ( " << xmin << ", " << ymin << " ), ( " << xmax << ", " << ymax << " ) ]";
+                parsed.argumentError = errorStream.str();
+            }
+        }
+    }
+    else if ( verb == "fleet" )
+    {
+        string modeToken ( lowerCaseString ( Tokeniser ( parsed.qualifiers, ", " ).nextToken() ) );
+        if ( modeToken != "step" )
+        {
+            parsed.argumentError = "fleet expects step, not " + modeToken;
+        }
+    }
+    else if ( verb == "session" )
+    {
+        Tokeniser tokeniser ( parsed.qualifiers, ", " );
+        string token ( tokeniser.nextToken() );
+        if ( ! token.empty() && token.find_first_not_of ( "0123456789" ) == string::npos )
+        {
+            token = tokeniser.nextToken();
+        }
+        string laneToken ( lowerCaseString ( token ) );
+        if ( laneToken != "interactive" && laneToken != "bulk" )
+        {
+            parsed.argumentError = "session expects interactive or bulk, not " + laneToken;
+        }
+    }
+    else if ( verb == "rooms" )
+    {
+        string modeToken ( lowerCaseString ( Tokeniser ( parsed.qualifiers, ", " ).nextToken() ) );
+        if ( ! modeToken.empty() && modeToken != "step" )
+        {
+            parsed.argumentError = "rooms expects step, not " + modeToken;
+        }
+    }
+    else if ( verb == "zone" )
+    {
+        try
+        {
+            string name;
+            string kindName;
+            int xmin;
+            int ymin;
+            int xmax;
+            int ymax;
+            int limit;
+            Zones::parse ( parsed.qualifiers, name, kindName, xmin, ymin, xmax, ymax, limit );
+        }
+        catch ( const InvalidDirectionException & error )
+        {
+            parsed.argumentError = "Invalid direction " + error.directionString() + " for " + error.what();
+        }
+        catch ( const exception & error )
+        {
+            parsed.argumentError = error.what();
+        }
+    }
+    else if ( verb == "group" || verb == "ungroup" )
+    {
+        if ( Tokeniser ( parsed.qualifiers, ", " ).nextToken().empty() )
+        {
+            parsed.argumentError = verb + " needs a group name";
+        }
+    }
+}
+
+// A copy of a timed Command, for just the given object and at a later time.
+Command * CommandFactory::createDeferredCommand
+(   const Command & command,
+    GameObject * gameObject,
+    SimTime time
+) const
+{
+    Command * deferred = new Command ( command.m_name, command.m_qualifiers, gameObject );
+    deferred->m_timed = true;
+    deferred->m_time = time;
+    deferred->m_deferred = true;
+    return deferred;
+}
+
+// Does the name have wildcards in it?
+bool CommandFactory::isSelector ( const string & name )
+{
+    return name.find_first_of ( "*?" ) != string::npos;
+}
+
+void CommandFactory::setValidCommands ( const vector<string> & commands )
+{
+    m_validCommands = commands;
+}
+
+const vector<string> & CommandFactory::validCommands() const
+{
+    return m_validCommands;
+}
+
+void CommandFactory::checkValidCommand ( const string & command ) const
+{
+    for ( vector<string>::const_iterator iter = m_validCommands.begin();
+          iter != m_validCommands.end(); ++iter
+        )
+    {
+        if ( *iter == command )
+        {
+            return;
+        }
+    }
+    throw InvalidCommandException ( command.c_str() );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+CommandListener::CommandListener
+(   GameObject * object,
+    GameObjectResponder responder
+) : m_object ( object ), m_responder ( responder )
+{
+}
+
+GameObject * CommandListener::object() const
+{
+    return m_object;
+}
+
+void CommandListener::inform ( const Command & command )
+{
+    (m_object->*m_responder) ( command );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+GameObject::GameObject ( const string & name )
+ : m_name ( name ),
+   m_xpos ( 0 ),            // }
+   m_ypos ( 0 ),            // } but irrelevant since not on table
+   m_direction ( Invalid ), // }
+   m_onTable ( false )
+{
+    // It would be tempting to put these here, but that would preclude derived
+    // classes from choosing *not* to respond and/or constrain.
+    // Broadcaster::singleton()->createCommandListener ( this, GameObject::respond );
+    // ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider );
+}
+
+string GameObject::name()
+{
+    return m_name;
+}
+
+int GameObject::xpos()
+{
+    return m_xpos;
+}
+
+int GameObject::ypos()
+{
+    return m_ypos;
+}
+
+Direction GameObject::direction()
+{
+    return m_direction;
+}
+
+bool GameObject::onTable()
+{
+    return m_onTable;
+}
+
+// Only robots go anywhere of their own accord.
+int GameObject::speed()
+{
+    return 0;
+}
+
+// Is the proposed placement of the given object acceptable to me?
+bool GameObject::constraintDecider
+(   GameObject * object,
+    int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable
+)
+{
+    return true;    // notional GameObject doesn't care
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Trajectory::Trajectory()
+  : m_steps ( 0 )
+{
+    m_current.step = 0;
+    m_current.xpos = 0;
+    m_current.ypos = 0;
+    m_current.direction = Invalid;
+    m_current.onTable = false;
+    m_keyframes.push_back ( m_current );
+}
+
+void Trajectory::record ( int xpos, int ypos, Direction direction, bool onTable )
+{
+    Code next = Jump;
+    if ( ! onTable && ! m_current.onTable )
+    {
+        return;     // off is off
+    }
+    else if ( onTable && m_current.onTable )
+    {
+        int forwardXpos = m_current.xpos;
+        int forwardYpos = m_current.ypos;
+        Robot::step ( m_current.direction, forwardXpos, forwardYpos );
+        if ( xpos == m_current.xpos && ypos == m_current.ypos )
+        {
+            if ( direction == m_current.direction )
+            {
+                return;
+            }
+            next = ( direction == Robot::turnLeft ( m_current.direction ) ) ? Left :
+                   ( direction == Robot::turnRight ( m_current.direction ) ) ? Right :
+                                                                              Jump;
+        }
+        else if ( xpos == forwardXpos && ypos == forwardYpos && direction == m_current.direction )
+        {
+            next = Forward;
+        }
+    }
+
+    if ( m_steps % 4 == 0 )
+    {
+        m_codes.push_back ( 0 );
+    }
+    m_codes.back() |= static_cast< unsigned char > ( next << ( 2 * ( m_steps % 4 ) ) );
+    ++m_steps;
+    m_current.step = m_steps;
+    m_current.xpos = xpos;
+    m_current.ypos = ypos;
+    m_current.direction = direction;
+    m_current.onTable = onTable;
+    if ( next == Jump || m_steps % keyframeInterval == 0 )
+    {
+        m_keyframes.push_back ( m_current );
+    }
+}
+
+size_t Trajectory::steps() const
+{
+    return m_steps;
+}
+
+// The code for the step which led to the state after the given number.
+Trajectory::Code Trajectory::code ( size_t step ) const
+{
+    return static_cast< Code > ( ( m_codes[(step-1)/4] >> ( 2 * ( (step-1) % 4 ) ) ) & 3 );
+}
+
+bool Trajectory::before ( size_t step, const Keyframe & keyframe )
+{
+    return step < keyframe.step;
+}
+
+void Trajectory::write ( ostream & stream, size_t from, size_t to ) const
+{
+    to = min ( to, m_steps );
+    if ( from > to )
+    {
+        return;
+    }
+    // The last keyframe at or before from, and then one step at a time,
+    // taking each keyframe as it comes (for a jump, it's the only way of
+    // knowing where the robot went).
+    size_t next = upper_bound ( m_keyframes.begin(), m_keyframes.end(), from, before ) - m_keyframes.begin();
+    Keyframe state = m_keyframes[next-1];
+    for ( size_t step = state.step; step <= to; ++step )
+    {
+        if ( step > state.step )
+        {
+            switch ( code ( step ) )
+            {
+                case Forward:
+                    Robot::step ( state.direction, state.xpos, state.ypos );
+                    break;
+                case Left:
+                    state.direction = Robot::turnLeft ( state.direction );
+                    break;
+                case Right:
+                    state.direction = Robot::turnRight ( state.direction );
+                    break;
+                case Jump:
+                    break;
+            }
+            if ( next < m_keyframes.size() && m_keyframes[next].step == step )
+            {
+                state = m_keyframes[next++];
+            }
+        }
+        if ( step >= from )
+        {
+            stream << "Step " << step << ": ";
+            if ( state.onTable )
+            {
+                stream << "x = " << state.xpos << ", y = " << state.ypos
+                       << ", facing " << directionName ( state.direction ) << endl;
+            }
+            else
+            {
+                stream << "not on the table" << endl;
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Robot::Robot ( const string & name, unsigned id )
+ : GameObject ( name ), m_id ( id ), m_destroyed ( false ), m_lifted ( false ),
+   m_speed ( 0 ), m_busyUntil ( 0 ),
+   m_fxpos ( 0 ), m_fypos ( 0 ), m_xvelocity ( 0 ), m_yvelocity ( 0 )
+{
+    // This had better all be single-threaded, otherwise someone might
+    // broadcast a command to (or ask for a constraint-verdict from) this
+    // not-yet-fully-formed Robot.
+    // Robots keep each other apart through the Occupancy rather than a
+    // Constraint each.
+    Broadcaster::singleton()->createCommandListener ( this, GameObject::respond );
+}
+
+void Robot::respond ( const Command & command )
+{
+    const string & commandName ( command.name() );
+
+    if ( deferTimed ( command ) || Rooms::singleton()->command ( this, command ) )
+    {
+        return;
+    }
+
+    // Hmmm... could have a map of command-name-to-method... although only if
+    // all the relevant methods have the same signature. This would be so much
+    // easier in Ruby, as I could just use send().
+    if ( commandName == "place" )
+    {
+        int newXpos;
+        int newYpos;
+        Direction newDirection;
+        parsePlacement ( command.qualifiers(), newXpos, newYpos, newDirection );
+        place ( newXpos, newYpos, newDirection );
+    }
+    else if ( commandName == "move" )
+    {
+        move();
+    }
+    else if ( commandName == "left" )
+    {
+        left();
+    }
+    else if ( commandName == "right" )
+    {
+        right();
+    }
+    else if ( commandName == "report" )
+    {
+        report();
+    }
+    else if ( commandName == "remove" )
+    {
+        remove();
+    }
+    else if ( commandName == "speed" )
+    {
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        setSpeed ( atoi ( tokeniser.nextToken().c_str() ) );
+    }
+    else if ( commandName == "velocity" )
+    {
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        double newXvelocity = atof ( tokeniser.nextToken().c_str() );
+        double newYvelocity = atof ( tokeniser.nextToken().c_str() );
+        setVelocity ( newXvelocity, newYvelocity );
+    }
+    else if ( commandName == "behave" )
+    {
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        string behaviourName ( lowerCaseString ( tokeniser.nextToken() ) );
+        if ( behaviourName == "wander" )
+        {
+            Scheduler::singleton()->start ( new WanderBehaviour ( this ) );
+        }
+        else if ( behaviourName == "forward" )
+        {
+            int steps = atoi ( tokeniser.nextToken().c_str() );
+            Scheduler::singleton()->start ( new ForwardBehaviour ( this, steps ) );
+        }
+        else if ( behaviourName == "stop" )
+        {
+            Scheduler::singleton()->stop ( this );
+        }
+        else
+        {
+            cout << "Unknown behaviour " << behaviourName << " for robot " << m_name << endl;
+        }
+    }
+}
+
+// A robot with a speed is busy while it moves, so a timestamped command is
+// put off until the robot is free (and, for a move, has got there). Returns
+// whether it was put off.
+bool Robot::deferTimed ( const Command & command )
+{
+    if ( ! command.timed() || command.deferred() || m_speed <= 0 )
+    {
+        return false;
+    }
+    SimTime now = Timeline::singleton()->now();
+    SimTime start = ( m_busyUntil > now ) ? m_busyUntil : now;
+    if ( command.name() == "move" )
+    {
+        SimTime duration = 1000 / m_speed;
+        m_busyUntil = start + ( duration > 0 ? duration : 1 );
+    }
+    else if ( start == now )
+    {
+        return false;   // free now, and nothing to wait for
+    }
+    Timeline::singleton()->schedule
+    (   CommandFactory::singleton()->createDeferredCommand
+        (   command, this, command.name() == "move" ? m_busyUntil : start )
+    );
+    return true;
+}
+
+void Robot::setSpeed ( int cellsPerSecond )
+{
+    m_speed = ( cellsPerSecond > 0 ) ? cellsPerSecond : 0;
+}
+
+int Robot::speed()
+{
+    return m_speed;
+}
+
+void Robot::setVelocity ( double xvelocity, double yvelocity )
+{
+    if ( ! m_onTable )
+    {
+        cout << "Robot " << m_name << " is not on the table" << endl;
+        return;
+    }
+    m_xvelocity = xvelocity;
+    m_yvelocity = yvelocity;
+}
+
+double Robot::fxpos() const
+{
+    return m_fxpos;
+}
+
+double Robot::fypos() const
+{
+    return m_fypos;
+}
+
+double Robot::xvelocity() const
+{
+    return m_xvelocity;
+}
+
+double Robot::yvelocity() const
+{
+    return m_yvelocity;
+}
+
+bool Robot::moving() const
+{
+    return m_onTable && ( m_xvelocity != 0 || m_yvelocity != 0 );
+}
+
+// Glide along for a while, ending up in whichever cell is nearest.
+void Robot::coast ( double seconds )
+{
+    if ( ! moving() )
+    {
+        return;
+    }
+    double fxpos = m_fxpos + m_xvelocity * seconds;
+    double fypos = m_fypos + m_yvelocity * seconds;
+    int xpos = static_cast< int > ( floor ( fxpos + 0.5 ) );
+    int ypos = static_cast< int > ( floor ( fypos + 0.5 ) );
+    if ( xpos != m_xpos || ypos != m_ypos )
+    {
+        relocate ( xpos, ypos, m_direction, true );
+    }
+    m_fxpos = fxpos;
+    m_fypos = fypos;
+}
+
+void Robot::halt()
+{
+    m_xvelocity = 0;
+    m_yvelocity = 0;
+}
+
+// Stop, and right in the middle of the nearest cell.
+void Robot::settle()
+{
+    halt();
+    m_fxpos = m_xpos;
+    m_fypos = m_ypos;
+}
+
+void Robot::parsePlacement
+(   const string & qualifiers,
+    int & xpos,
+    int & ypos,
+    Direction & direction
+)
+{
+    // DIY parsing to handle comma and whitespace.
+    Tokeniser tokeniser ( qualifiers, ", " );
+    string newXposToken = tokeniser.nextToken();
+    string newYposToken = tokeniser.nextToken();
+    string newDirectionToken = tokeniser.nextToken();
+
+    // Got tokens, now convert them.
+    xpos = atoi ( newXposToken.c_str() );
+    ypos = atoi ( newYposToken.c_str() );
+    direction = directionFromString ( newDirectionToken );
+    if ( direction == Invalid )
+    {
+        throw InvalidDirectionException ( newDirectionToken, "place" );
+    }
+}
+
+// Every change of cell (or getting on or off the table) comes through here,
+// to keep the Occupancy straight.
+void Robot::relocate
+(   int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable,
+    bool momentarily
+)
+{
+    bool wasOnTable = m_onTable || m_lifted;
+    if ( ! momentarily && onTable &&
+         ( ! wasOnTable || xpos != m_xpos || ypos != m_ypos ) &&
+         Heatmap::singleton()->enabled()
+       )
+    {
+        Heatmap::singleton()->visit ( xpos, ypos );
+    }
+    m_lifted = momentarily && wasOnTable;
+    // A robot staying in its cell keeps it: releasing and re-claiming it
+    // would leave it free, for a moment, to another thread's claim.
+    bool changingCell = onTable != m_onTable || xpos != m_xpos || ypos != m_ypos;
+    if ( m_onTable && changingCell )
+    {
+        Occupancy::singleton()->remove ( this );
+        if ( Zones::singleton()->counting() )
+        {
+            Zones::singleton()->leave ( this );
+        }
+    }
+    m_xpos = xpos;
+    m_ypos = ypos;
+    m_fxpos = xpos;
+    m_fypos = ypos;
+    m_direction = direction;
+    m_onTable = onTable;
+    if ( m_onTable && changingCell )
+    {
+        Occupancy::singleton()->add ( this );
+        if ( Zones::singleton()->counting() )
+        {
+            Zones::singleton()->enter ( this );
+        }
+    }
+    if ( ! momentarily )
+    {
+        m_trajectory.record ( m_xpos, m_ypos, m_direction, m_onTable );
+    }
+}
+
+const Trajectory & Robot::trajectory() const
+{
+    return m_trajectory;
+}
+
+unsigned Robot::id() const
+{
+    return m_id;
+}
+
+bool Robot::destroyed() const
+{
+    return m_destroyed;
+}
+
+// Return named robot or 0.
+Robot * Robot::find ( const string & robotName )
+{
+    return RobotFactory::singleton()->find ( robotName );
+}
+
+// How best to report failures etc?
+
+void Robot::place ( int xpos, int ypos, Direction direction )
+{
+    if ( ! tryPlace ( xpos, ypos, direction ) )
+    {
+        cout << "Ignoring attempt to place robot " << m_name << " in invalid position" << endl;
+    }
+}
+
+// As place() but without the chat.
+bool Robot::tryPlace ( int xpos, int ypos, Direction direction )
+{
+    if ( Constraint::acceptable ( this, xpos, ypos, direction, true ) )
+    {
+        relocate ( xpos, ypos, direction, true );
+        return true;
+    }
+    return false;
+}
+
+// Returns whether the robot actually moved.
+bool Robot::move()
+{
+    if ( ! m_onTable )
+    {
+        cout << "Robot " << m_name << " is not on the table" << endl;
+        return false;
+    }
+
+    if ( m_direction == Invalid )
+    {
+        cout << "Attempt to move robot " << m_name << " without placing it first" << endl;
+    }
+
+    if ( tryMove() )
+    {
+        return true;
+    }
+    cout << "Ignoring attempt to move robot " << m_name << " to invalid position" << endl;
+    return false;
+}
+
+// As move() but without the chat, for Behaviours which expect to be blocked
+// now and again.
+bool Robot::tryMove()
+{
+    if ( ! m_onTable )
+    {
+        return false;
+    }
+
+    int newXpos = m_xpos;
+    int newYpos = m_ypos;
+    step ( m_direction, newXpos, newYpos );
+
+    GameObject * rejecter;
+    if ( Constraint::acceptable ( this, newXpos, newYpos, m_direction, true, 0, &rejecter ) )
+    {
+        relocate ( newXpos, newYpos, m_direction, true );
+        return true;
+    }
+    if ( Heatmap::singleton()->enabled() )
+    {
+        Heatmap::singleton()->reject ( newXpos, newYpos );
+    }
+    Contention::singleton()->record ( this, newXpos, newYpos, rejecter );
+    return false;
+}
+
+// Where one step in the given direction goes. Invalid goes nowhere.
+void Robot::step ( Direction direction, int & xpos, int & ypos )
+{
+    switch ( direction )
+    {
+        case North:
+        {
+            ++ypos;
+            break;
+        }
+        case West:
+        {
+            --xpos;
+            break;
+        }
+        case South:
+        {
+            --ypos;
+            break;
+        }
+        case East:
+        {
+            ++xpos;
+            break;
+        }
+        case Invalid:
+        {
+            break;
+        }
+        default:    // impossible, it's an enum
+        {
+            throw exception ( "impossible enum value" );
+            break;
+        }
+    }
+}
+
+void Robot::left()
+{
+    if ( ! m_onTable )
+    {
+        cout << "Robot " << m_name << " is not on the table" << endl;
+        return;
+    }
+
+    m_direction = turnLeft ( m_direction );
+    m_trajectory.record ( m_xpos, m_ypos, m_direction, m_onTable );
+}
+
+void Robot::right()
+{
+    if ( ! m_onTable )
+    {
+        cout << "Robot " << m_name << " is not on the table" << endl;
+        return;
+    }
+
+    m_direction = turnRight ( m_direction );
+    m_trajectory.record ( m_xpos, m_ypos, m_direction, m_onTable );
+}
+
+Direction Robot::turnLeft ( Direction direction )
+{
+    return ( direction == North ) ? West :
+           ( direction == West )  ? South :
+           ( direction == South ) ? East :
+           ( direction == East )  ? North :
+                                    Invalid;
+}
+
+Direction Robot::turnRight ( Direction direction )
+{
+    return ( direction == North ) ? East :
+           ( direction == East )  ? South :
+           ( direction == South ) ? West :
+           ( direction == West )  ? North :
+                                    Invalid;
+}
+
+void Robot::report()
+{
+    if ( ReportWriter::singleton()->collecting() )
+    {
+        ReportWriter::singleton()->add ( this );
+        return;
+    }
+    RobotState current;
+    state ( current );
+    reportState ( cout, current, ContinuousWorld::singleton()->enabled() );
+    cout << endl;
+}
+
+void Robot::state ( RobotState & state ) const
+{
+    state.id = m_id;
+    state.name = m_name;
+    state.onTable = m_onTable;
+    state.xpos = m_xpos;
+    state.ypos = m_ypos;
+    state.direction = m_direction;
+    state.fxpos = m_fxpos;
+    state.fypos = m_fypos;
+    state.xvelocity = m_xvelocity;
+    state.yvelocity = m_yvelocity;
+}
+
+void Robot::remove()
+{
+    halt();
+    relocate ( m_xpos, m_ypos, Invalid, false );    // Invalid for good measure
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+RobotFactory * RobotFactory::singleton()
+{
+    static RobotFactory * factory = 0;
+    if ( factory == 0 )
+    {
+        factory = new RobotFactory;
+    }
+    return factory;
+}
+
+Robot * RobotFactory::createRobot ( const string & robotName )
+{
+    if ( Robot::find ( robotName ) != 0 )
+    {
+        stringstream errorStream;
+        errorStream << "Robot " << robotName << " already exists";
+        throw exception ( errorStream.str().c_str() );
+    }
+    if ( GroupFactory::singleton()->find ( robotName ) != 0 )
+    {
+        stringstream errorStream;
+        errorStream << "There is already a group called " << robotName;
+        throw exception ( errorStream.str().c_str() );
+    }
+    if ( CommandFactory::isSelector ( robotName ) )
+    {
+        stringstream errorStream;
+        errorStream << "Robot name " << robotName << " cannot contain * or ?";
+        throw exception ( errorStream.str().c_str() );
+    }
+    Robot * robot = new Robot ( robotName, static_cast< unsigned > ( m_robotsById.size() ) );
+    m_names.insert ( robotName, robot->id() );
+    m_robotsById.push_back ( robot );
+    return robot;
+}
+
+void RobotFactory::destroyRobot ( const string & robotName )
+{
+    Robot * robot = find ( robotName );
+    if ( robot == 0 )
+    {
+        stringstream errorStream;
+        errorStream << "No such robot " << robotName;
+        throw exception ( errorStream.str().c_str() );
+    }
+    if ( Transaction::singleton()->open() )
+    {
+        throw exception ( "Robots cannot be destroyed during a transaction" );
+    }
+    Scheduler::singleton()->stop ( robot );
+    robot->remove();
+    Rooms::singleton()->evict ( robot->id() );
+    GroupFactory::singleton()->forget ( robot->id() );
+    Broadcaster::singleton()->removeCommandListener ( robot );
+    m_names.erase ( robotName );
+    m_robotsById[robot->id()] = 0;
+    robot->m_destroyed = true;
+}
+
+// Return named robot or 0.
+Robot * RobotFactory::find ( const string & robotName ) const
+{
+    unsigned id;
+    return m_names.find ( robotName, id ) ? m_robotsById[id] : 0;
+}
+
+// Ids of all robots whose names match the pattern, in order of creation.
+void RobotFactory::match ( const string & pattern, vector< unsigned > & ids ) const
+{
+    size_t start = ids.size();
+    m_names.match ( pattern, ids );
+    sort ( ids.begin() + start, ids.end() );
+    ids.erase ( unique ( ids.begin() + start, ids.end() ), ids.end() );
+}
+
+void RobotFactory::targets ( const Command & command, vector< Robot* > & robots ) const
+{
+    if ( command.gameObject() != 0 )
+    {
+        robots.push_back ( static_cast< Robot* > ( command.gameObject() ) );
+        return;
+    }
+    vector< unsigned > ids;
+    if ( command.group() != 0 )
+    {
+        ids = command.group()->members();
+    }
+    else if ( ! command.selector().empty() )
+    {
+        match ( command.selector(), ids );
+    }
+    else
+    {
+        for ( size_t inx = 0; inx < m_robotsById.size(); ++inx )
+        {
+            if ( m_robotsById[inx] != 0 )
+            {
+                robots.push_back ( m_robotsById[inx] );
+            }
+        }
+        return;
+    }
+    for ( size_t inx = 0; inx < ids.size(); ++inx )
+    {
+        robots.push_back ( m_robotsById[ids[inx]] );
+    }
+}
+
+// Indexed by id, with 0 for destroyed robots.
+const vector< Robot* > & RobotFactory::robots() const
+{
+    return m_robotsById;
+}
+
+Robot * RobotFactory::robot ( unsigned id ) const
+{
+    return ( id < m_robotsById.size() ) ? m_robotsById[id] : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+RadixTree::RadixTree()
+  : m_root ( newNode ( "" ) )
+{
+}
+
+RadixTree::~RadixTree()
+{
+    destroy ( m_root );
+}
+
+RadixTree::Node * RadixTree::newNode ( const string & label )
+{
+    Node * node = new Node;
+    node->label = label;
+    node->terminal = false;
+    node->value = 0;
+    return node;
+}
+
+void RadixTree::destroy ( Node * node )
+{
+    for ( size_t inx = 0; inx < node->children.size(); ++inx )
+    {
+        destroy ( node->children[inx] );
+    }
+    delete node;
+}
+
+// The child whose label starts with the given character, or 0 (in which case
+// the position is where such a child would go).
+RadixTree::Node * RadixTree::child ( const Node * node, char first, size_t * position )
+{
+    size_t low = 0;
+    size_t high = node->children.size();
+    while ( low < high )
+    {
+        size_t middle = ( low + high ) / 2;
+        if ( node->children[middle]->label[0] < first )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if ( position != 0 )
+    {
+        *position = low;
+    }
+    return ( low < node->children.size() && node->children[low]->label[0] == first ) ?
+           node->children[low] : 0;
+}
+
+bool RadixTree::insert ( const string & key, unsigned value )
+{
+    Node * node = m_root;
+    size_t keyPosition = 0;
+    while ( keyPosition < key.length() )
+    {
+        size_t position;
+        Node * next = child ( node, key[keyPosition], &position );
+        if ( next == 0 )
+        {
+            Node * leaf = newNode ( key.substr ( keyPosition ) );
+            node->children.insert ( node->children.begin() + position, leaf );
+            node = leaf;
+            keyPosition = key.length();
+            break;
+        }
+
+        // How much of the edge does the key follow?
+        size_t common = 0;
+        while ( common < next->label.length() && keyPosition + common < key.length() &&
+                next->label[common] == key[keyPosition + common]
+              )
+        {
+            ++common;
+        }
+        if ( common < next->label.length() )
+        {
+            // Not all of it, so split the edge.
+            Node * split = newNode ( next->label.substr ( 0, common ) );
+            next->label.erase ( 0, common );
+            split->children.push_back ( next );
+            node->children[position] = split;
+            next = split;
+        }
+        node = next;
+        keyPosition += common;
+    }
+    if ( node->terminal )
+    {
+        return false;
+    }
+    node->terminal = true;
+    node->value = value;
+    return true;
+}
+
+bool RadixTree::erase ( const string & key )
+{
+    // Remember the way down, to tidy up on the way back.
+    vector< Node* > path ( 1, m_root );
+    size_t keyPosition = 0;
+    while ( keyPosition < key.length() )
+    {
+        Node * next = child ( path.back(), key[keyPosition] );
+        if ( next == 0 || key.compare ( keyPosition, next->label.length(), next->label ) != 0 )
+        {
+            return false;
+        }
+        path.push_back ( next );
+        keyPosition += next->label.length();
+    }
+    Node * node = path.back();
+    if ( ! node->terminal )
+    {
+        return false;
+    }
+    node->terminal = false;
+
+    // Drop the node if it's now a dead end, and fold away whichever node is
+    // left with a single child and no key of its own.
+    if ( path.size() > 1 && node->children.empty() )
+    {
+        Node * parent = path[path.size()-2];
+        size_t position;
+        child ( parent, node->label[0], &position );
+        parent->children.erase ( parent->children.begin() + position );
+        delete node;
+        path.pop_back();
+        node = parent;
+    }
+    if ( path.size() > 1 && ! node->terminal && node->children.size() == 1 )
+    {
+        Node * only = node->children[0];
+        node->label += only->label;
+        node->terminal = only->terminal;
+        node->value = only->value;
+        node->children.swap ( only->children );
+        delete only;
+    }
+    return true;
+}
+
+bool RadixTree::find ( const string & key, unsigned & value ) const
+{
+    const Node * node = m_root;
+    size_t keyPosition = 0;
+    while ( keyPosition < key.length() )
+    {
+        node = child ( node, key[keyPosition] );
+        if ( node == 0 || key.compare ( keyPosition, node->label.length(), node->label ) != 0 )
+        {
+            return false;
+        }
+        keyPosition += node->label.length();
+    }
+    if ( node->terminal )
+    {
+        value = node->value;
+    }
+    return node->terminal;
+}
+
+// Matches come out in key order, but a pattern with several stars can find
+// the same key more than once.
+void RadixTree::match ( const string & pattern, vector< unsigned > & values ) const
+{
+    matchFrom ( m_root, 0, pattern, 0, values );
+}
+
+void RadixTree::collect ( const Node * node, vector< unsigned > & values )
+{
+    if ( node->terminal )
+    {
+        values.push_back ( node->value );
+    }
+    for ( size_t inx = 0; inx < node->children.size(); ++inx )
+    {
+        collect ( node->children[inx], values );
+    }
+}
+
+// Carry on matching from part way along the edge into a node.
+void RadixTree::matchFrom
+(   const Node * node,
+    size_t offset,
+    const string & pattern,
+    size_t patternPosition,
+    vector< unsigned > & values
+)
+{
+    for (;;)
+    {
+        if ( patternPosition == pattern.length() )
+        {
+            // Pattern used up, so only a key ending right here will do.
+            if ( offset == node->label.length() && node->terminal )
+            {
+                values.push_back ( node->value );
+            }
+            return;
+        }
+        if ( pattern.find_first_not_of ( '*', patternPosition ) == string::npos )
+        {
+            // Only stars left, so everything from here down matches.
+            collect ( node, values );
+            return;
+        }
+        if ( offset == node->label.length() )
+        {
+            break;
+        }
+        char wanted = pattern[patternPosition];
+        if ( wanted == '*' )
+        {
+            // The star either stops here or takes one more character.
+            matchFrom ( node, offset, pattern, patternPosition + 1, values );
+            ++offset;
+            continue;
+        }
+        if ( wanted != '?' && wanted != node->label[offset] )
+        {
+            return;
+        }
+        ++offset;
+        ++patternPosition;
+    }
+
+    // On to the children: just the one, if the pattern says which.
+    char wanted = pattern[patternPosition];
+    if ( wanted != '*' && wanted != '?' )
+    {
+        const Node * next = child ( node, wanted );
+        if ( next != 0 )
+        {
+            matchFrom ( next, 0, pattern, patternPosition, values );
+        }
+        return;
+    }
+    for ( size_t inx = 0; inx < node->children.size(); ++inx )
+    {
+        matchFrom ( node->children[inx], 0, pattern, patternPosition, values );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Group::Group ( const string & name )
+  : m_name ( name )
+{
+}
+
+const string & Group::name() const
+{
+    return m_name;
+}
+
+const vector< unsigned > & Group::members() const
+{
+    return m_members;
+}
+
+// False if already a member.
+bool Group::add ( unsigned robotId )
+{
+    if ( ! m_positions.insert ( make_pair ( robotId, m_members.size() ) ).second )
+    {
+        return false;
+    }
+    m_members.push_back ( robotId );
+    return true;
+}
+
+// False if not a member.
+bool Group::remove ( unsigned robotId )
+{
+    map< unsigned, size_t >::iterator found = m_positions.find ( robotId );
+    if ( found == m_positions.end() )
+    {
+        return false;
+    }
+    size_t position = found->second;
+    unsigned last = m_members.back();
+    m_members[position] = last;
+    m_positions[last] = position;
+    m_members.pop_back();
+    m_positions.erase ( robotId );
+    return true;
+}
+
+void Group::clear()
+{
+    m_members.clear();
+    m_positions.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+GroupFactory * GroupFactory::singleton()
+{
+    static GroupFactory * factory = 0;
+    if ( factory == 0 )
+    {
+        factory = new GroupFactory;
+    }
+    return factory;
+}
+
+// The named group, newly created if need be.
+Group * GroupFactory::group ( const string & groupName )
+{
+    Group * existing = find ( groupName );
+    if ( existing != 0 )
+    {
+        return existing;
+    }
+    if ( Robot::find ( groupName ) != 0 )
+    {
+        stringstream errorStream;
+        errorStream << "There is already a robot called " << groupName;
+        throw exception ( errorStream.str().c_str() );
+    }
+    Group * group = new Group ( groupName );
+    m_groups.insert ( pair< string, Group* > ( groupName, group ) );
+    return group;
+}
+
+void GroupFactory::destroyGroup ( const string & groupName )
+{
+    map< string, Group* >::iterator found = m_groups.find ( groupName );
+    if ( found == m_groups.end() )
+    {
+        stringstream errorStream;
+        errorStream << "No such group " << groupName;
+        throw exception ( errorStream.str().c_str() );
+    }
+    found->second->clear();
+    m_retired.push_back ( found->second );
+    m_groups.erase ( found );
+}
+
+// Take a robot out of every group.
+void GroupFactory::forget ( unsigned robotId )
+{
+    for ( map< string, Group* >::iterator iter = m_groups.begin();
+          iter != m_groups.end(); ++iter
+        )
+    {
+        iter->second->remove ( robotId );
+    }
+}
+
+// Return named group or 0.
+Group * GroupFactory::find ( const string & groupName ) const
+{
+    map< string, Group* >::const_iterator found = m_groups.find ( groupName );
+    return ( found == m_groups.end() ) ? 0 : found->second;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Behaviour::Behaviour ( Robot * robot )
+  : m_robot ( robot ), m_resumePoint ( 0 ), m_cancelled ( false )
+{
+}
+
+Behaviour::~Behaviour()
+{
+}
+
+Robot * Behaviour::robot() const
+{
+    return m_robot;
+}
+
+void Behaviour::cancel()
+{
+    m_cancelled = true;
+}
+
+bool Behaviour::cancelled() const
+{
+    return m_cancelled;
+}
+
+void * Behaviour::operator new ( size_t size )
+{
+    FramePool * pool = FramePool::behaviourPool();
+    return ( size <= pool->slotSize() ) ? pool->allocate() : ::operator new ( size );
+}
+
+void Behaviour::operator delete ( void * ptr, size_t size )
+{
+    FramePool * pool = FramePool::behaviourPool();
+    if ( size <= pool->slotSize() )
+    {
+        pool->release ( ptr );
+    }
+    else
+    {
+        ::operator delete ( ptr );
+    }
+}
+
+WanderBehaviour::WanderBehaviour ( Robot * robot )
+  : Behaviour ( robot )
+{
+}
+
+bool WanderBehaviour::resume()
+{
+    BEHAVIOUR_BEGIN;
+    while ( m_robot->onTable() )
+    {
+        while ( m_robot->tryMove() )
+        {
+            BEHAVIOUR_YIELD;
+        }
+        m_robot->right();
+        BEHAVIOUR_YIELD;
+    }
+    BEHAVIOUR_END;
+}
+
+ForwardBehaviour::ForwardBehaviour ( Robot * robot, int steps )
+  : Behaviour ( robot ), m_remaining ( steps )
+{
+}
+
+bool ForwardBehaviour::resume()
+{
+    BEHAVIOUR_BEGIN;
+    while ( m_remaining > 0 && m_robot->tryMove() )
+    {
+        --m_remaining;
+        BEHAVIOUR_YIELD;
+    }
+    BEHAVIOUR_END;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+FramePool::FramePool ( size_t slotSize, size_t slotsPerChunk )
+  : m_slotSize ( slotSize ), m_slotsPerChunk ( slotsPerChunk ), m_freeList ( 0 )
+{
+    // Slots double as free-list links, and need suitable alignment for
+    // whatever lives in them.
+    const size_t alignment = sizeof ( double ) > sizeof ( void* ) ? sizeof ( double ) : sizeof ( void* );
+    m_slotSize = ( ( m_slotSize + alignment - 1 ) / alignment ) * alignment;
+}
+
+FramePool::~FramePool()
+{
+    for ( vector< char* >::iterator iter = m_chunks.begin();
+          iter != m_chunks.end(); ++iter
+        )
+    {
+        delete [] *iter;
+    }
+}
+
+void * FramePool::allocate()
+{
+    if ( m_freeList == 0 )
+    {
+        // Thread a new chunk onto the free list.
+        char * chunk = new char [ m_slotSize * m_slotsPerChunk ];
+        m_chunks.push_back ( chunk );
+        for ( size_t inx = m_slotsPerChunk; inx > 0; --inx )
+        {
+            void * slot = chunk + ( inx - 1 ) * m_slotSize;
+            *static_cast< void** > ( slot ) = m_freeList;
+            m_freeList = slot;
+        }
+    }
+    void * slot = m_freeList;
+    m_freeList = *static_cast< void** > ( slot );
+    return slot;
+}
+
+void FramePool::release ( void * slot )
+{
+    if ( slot != 0 )
+    {
+        *static_cast< void** > ( slot ) = m_freeList;
+        m_freeList = slot;
+    }
+}
+
+size_t FramePool::slotSize() const
+{
+    return m_slotSize;
+}
+
+// Big enough for the Behaviours we know about; anything bigger falls back to
+// the heap.
+FramePool * FramePool::behaviourPool()
+{
+    static FramePool * pool = 0;
+    if ( pool == 0 )
+    {
+        pool = new FramePool ( 64, 4096 );
+    }
+    return pool;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Scheduler * Scheduler::singleton()
+{
+    static Scheduler * scheduler = 0;
+    if ( scheduler == 0 )
+    {
+        scheduler = new Scheduler;
+    }
+    return scheduler;
+}
+
+// A robot's new Behaviour replaces any it already had.
+void Scheduler::start ( Behaviour * behaviour )
+{
+    stop ( behaviour->robot() );
+    m_ready.push_back ( behaviour );
+    m_byRobot[ behaviour->robot() ] = behaviour;
+}
+
+// Only flags it; the next tick does the tidying up.
+void Scheduler::stop ( Robot * robot )
+{
+    map< Robot*, Behaviour* >::iterator iter = m_byRobot.find ( robot );
+    if ( iter != m_byRobot.end() )
+    {
+        iter->second->cancel();
+        m_byRobot.erase ( iter );
+    }
+}
+
+void Scheduler::tick ( unsigned ticks )
+{
+    for ( unsigned tickCount = 0; tickCount < ticks && ! m_ready.empty(); ++tickCount )
+    {
+        size_t keep = 0;
+        for ( size_t inx = 0; inx < m_ready.size(); ++inx )
+        {
+            Behaviour * behaviour = m_ready[inx];
+            if ( ! behaviour->cancelled() && behaviour->resume() )
+            {
+                m_ready[keep++] = behaviour;
+                continue;
+            }
+            if ( ! behaviour->cancelled() )
+            {
+                m_byRobot.erase ( behaviour->robot() );
+            }
+            delete behaviour;
+        }
+        m_ready.resize ( keep );
+    }
+}
+
+size_t Scheduler::size() const
+{
+    return m_ready.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+TimingWheel::TimingWheel()
+  : m_now ( 0 ), m_count ( 0 )
+{
+    for ( int level = 0; level < Levels; ++level )
+    {
+        for ( int word = 0; word < Words; ++word )
+        {
+            m_occupied[level][word] = 0;
+        }
+    }
+}
+
+// The Command's time must not be before now().
+void TimingWheel::schedule ( Command * command )
+{
+    insert ( command );
+    ++m_count;
+}
+
+// Into the lowest level whose span covers the gap between now and then: that
+// is, the level of the highest digit in which the two times differ.
+void TimingWheel::insert ( Command * command )
+{
+    SimTime time = command->time();
+    SimTime difference = time ^ m_now;
+    for ( int level = 0; level < Levels; ++level )
+    {
+        if ( ( difference >> ( LevelBits * ( level + 1 ) ) ) == 0 )
+        {
+            int slot = static_cast< int > ( ( time >> ( LevelBits * level ) ) & ( Slots - 1 ) );
+            m_slots[level][slot].push_back ( command );
+            m_occupied[level][slot / 64] |= 1ULL << ( slot % 64 );
+            return;
+        }
+    }
+    m_overflow.insert ( pair< SimTime, Command* > ( time, command ) );
+}
+
+// Redistribute a slot whose time has come amongst the lower levels.
+void TimingWheel::cascade ( int level, int slot )
+{
+    vector< Command* > commands;
+    commands.swap ( m_slots[level][slot] );
+    m_occupied[level][slot / 64] &= ~( 1ULL << ( slot % 64 ) );
+    for ( vector< Command* >::iterator iter = commands.begin();
+          iter != commands.end(); ++iter
+        )
+    {
+        insert ( *iter );
+    }
+}
+
+// First occupied slot at or after the given one, or -1.
+int TimingWheel::findOccupied ( int level, int fromSlot ) const
+{
+    for ( int word = fromSlot / 64; word < Words; ++word )
+    {
+        unsigned long long bits = m_occupied[level][word];
+        if ( word == fromSlot / 64 )
+        {
+            bits &= ~0ULL << ( fromSlot % 64 );
+        }
+        if ( bits != 0 )
+        {
+            return word * 64 + lowestSetBit ( bits );
+        }
+    }
+    return -1;
+}
+
+bool TimingWheel::nextBatch ( SimTime limit, SimTime & time, vector< Command* > & batch )
+{
+    for (;;)
+    {
+        // Anything left in the current level 0 window?
+        int slot = findOccupied ( 0, static_cast< int > ( m_now & ( Slots - 1 ) ) );
+        if ( slot >= 0 )
+        {
+            time = ( m_now & ~static_cast< SimTime > ( Slots - 1 ) ) | slot;
+            if ( time > limit )
+            {
+                return false;
+            }
+            m_now = time;
+            batch.clear();
+            batch.swap ( m_slots[0][slot] );
+            m_occupied[0][slot / 64] &= ~( 1ULL << ( slot % 64 ) );
+            m_count -= batch.size();
+            return true;
+        }
+
+        // No, so move the clock on to the next occupied slot further up and
+        // bring its contents down.
+        bool cascaded = false;
+        for ( int level = 1; level < Levels && ! cascaded; ++level )
+        {
+            int shift = LevelBits * level;
+            int current = static_cast< int > ( ( m_now >> shift ) & ( Slots - 1 ) );
+            slot = ( current + 1 < Slots ) ? findOccupied ( level, current + 1 ) : -1;
+            if ( slot >= 0 )
+            {
+                SimTime above = m_now >> ( shift + LevelBits ) << ( shift + LevelBits );
+                SimTime windowStart = above | ( static_cast< SimTime > ( slot ) << shift );
+                if ( windowStart > limit )
+                {
+                    return false;
+                }
+                m_now = windowStart;
+                cascade ( level, slot );
+                cascaded = true;
+            }
+        }
+        if ( cascaded )
+        {
+            continue;
+        }
+
+        // The wheel is empty; all that's left is the far future.
+        if ( m_overflow.empty() || m_overflow.begin()->first > limit )
+        {
+            return false;
+        }
+        int shift = LevelBits * Levels;
+        m_now = m_overflow.begin()->first >> shift << shift;
+        while ( ! m_overflow.empty() &&
+                ( ( m_overflow.begin()->first ^ m_now ) >> shift ) == 0
+              )
+        {
+            insert ( m_overflow.begin()->second );
+            m_overflow.erase ( m_overflow.begin() );
+        }
+    }
+}
+
+bool TimingWheel::empty() const
+{
+    return m_count == 0;
+}
+
+SimTime TimingWheel::now() const
+{
+    return m_now;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Timeline::Timeline()
+  : m_now ( 0 )
+{
+}
+
+Timeline * Timeline::singleton()
+{
+    static Timeline * timeline = 0;
+    if ( timeline == 0 )
+    {
+        timeline = new Timeline;
+    }
+    return timeline;
+}
+
+SimTime Timeline::now() const
+{
+    return m_now;
+}
+
+// Takes ownership of the Command.
+void Timeline::schedule ( Command * command )
+{
+    if ( command->time() < m_now )
+    {
+        stringstream errorStream;
+        errorStream << "Timestamp " << command->time()
+                    << " is before the current time " << m_now;
+        delete command;
+        throw exception ( errorStream.str().c_str() );
+    }
+    m_wheel.schedule ( command );
+}
+
+void Timeline::runUntil ( SimTime time, bool inclusive )
+{
+    if ( time < m_now )
+    {
+        stringstream errorStream;
+        errorStream << "Timestamp " << time << " is before the current time " << m_now;
+        throw exception ( errorStream.str().c_str() );
+    }
+    if ( inclusive )
+    {
+        fire ( time );
+    }
+    else if ( time > 0 )
+    {
+        fire ( time - 1 );
+    }
+    m_now = time;
+    ContinuousWorld::singleton()->advance ( m_now );
+}
+
+void Timeline::runAll()
+{
+    fire ( ~static_cast< SimTime > ( 0 ) );
+}
+
+// Each batch is one step for the whole fleet: the Commands due at the same
+// time, in the order they were read.
+void Timeline::fire ( SimTime limit )
+{
+    SimTime time;
+    vector< Command* > batch;
+    while ( m_wheel.nextBatch ( limit, time, batch ) )
+    {
+        m_now = time;
+        ContinuousWorld::singleton()->advance ( m_now );
+        for ( vector< Command* >::iterator iter = batch.begin();
+              iter != batch.end(); ++iter
+            )
+        {
+            scoped_ptr<Command> freeCommand ( *iter );
+            try
+            {
+                Interpreter::execute ( **iter );
+            }
+            catch ( ... )
+            {
+                Interpreter::reportException ( (*iter)->name() + (*iter)->qualifiers() );
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+ContinuousWorld::ContinuousWorld()
+  : m_knownRobots ( 0 ), m_time ( 0 ), m_enabled ( false )
+{
+}
+
+ContinuousWorld * ContinuousWorld::singleton()
+{
+    static ContinuousWorld * world = 0;
+    if ( world == 0 )
+    {
+        world = new ContinuousWorld;
+    }
+    return world;
+}
+
+// Switching off leaves everyone in their nearest cell, and stopped.
+void ContinuousWorld::enable ( bool on )
+{
+    if ( on == m_enabled )
+    {
+        return;
+    }
+    if ( on && Occupancy::singleton()->concurrent() )
+    {
+        // Robots share cells in continuous mode, which a CellGrid can't hold.
+        throw exception ( "Cannot go continuous in concurrent mode" );
+    }
+    m_enabled = on;
+    m_time = Timeline::singleton()->now();
+    if ( ! on )
+    {
+        const vector< Robot* > & robots = RobotFactory::singleton()->robots();
+        for ( size_t inx = 0; inx < robots.size(); ++inx )
+        {
+            if ( robots[inx] != 0 )
+            {
+                robots[inx]->settle();
+            }
+        }
+    }
+}
+
+bool ContinuousWorld::enabled() const
+{
+    return m_enabled;
+}
+
+void ContinuousWorld::advance ( SimTime time )
+{
+    if ( ! m_enabled || time <= m_time )
+    {
+        return;
+    }
+
+    // Robots come and go, so pick up any newcomers (keeping the existing,
+    // nearly sorted, order for the rest) and drop the destroyed.
+    const vector< Robot* > & robots = RobotFactory::singleton()->robots();
+    for ( ; m_knownRobots < robots.size(); ++m_knownRobots )
+    {
+        if ( robots[m_knownRobots] != 0 )
+        {
+            Sweep sweep = { robots[m_knownRobots], 0, 0, 0, 0 };
+            m_sweeps.push_back ( sweep );
+        }
+    }
+    size_t keep = 0;
+    for ( size_t inx = 0; inx < m_sweeps.size(); ++inx )
+    {
+        if ( ! m_sweeps[inx].robot->destroyed() )
+        {
+            m_sweeps[keep++] = m_sweeps[inx];
+        }
+    }
+    m_sweeps.resize ( keep );
+
+    double remaining = ( time - m_time ) / 1000.0;
+    for (;;)
+    {
+        vector< Robot* > stopping;
+        double impact = firstImpact ( remaining, stopping );
+        double elapsed = ( impact < 0 ) ? remaining : impact;
+        for ( size_t inx = 0; inx < m_sweeps.size(); ++inx )
+        {
+            m_sweeps[inx].robot->coast ( elapsed );
+        }
+        if ( impact < 0 )
+        {
+            break;
+        }
+        for ( vector< Robot* >::iterator iter = stopping.begin();
+              iter != stopping.end(); ++iter
+            )
+        {
+            (*iter)->halt();
+        }
+        remaining -= elapsed;
+    }
+    m_time = time;
+}
+
+// Work out each robot's sweep over the coming interval and bring the sweeps
+// back into order.
+void ContinuousWorld::sweepOut ( double seconds )
+{
+    for ( size_t inx = 0; inx < m_sweeps.size(); ++inx )
+    {
+        Sweep & sweep = m_sweeps[inx];
+        double xstart = sweep.robot->fxpos();
+        double ystart = sweep.robot->fypos();
+        double xend = xstart;
+        double yend = ystart;
+        if ( sweep.robot->moving() )
+        {
+            xend += sweep.robot->xvelocity() * seconds;
+            yend += sweep.robot->yvelocity() * seconds;
+        }
+        sweep.xmin = min ( xstart, xend ) - 0.5;
+        sweep.xmax = max ( xstart, xend ) + 0.5;
+        sweep.ymin = min ( ystart, yend ) - 0.5;
+        sweep.ymax = max ( ystart, yend ) + 0.5;
+    }
+    for ( size_t inx = 1; inx < m_sweeps.size(); ++inx )
+    {
+        Sweep sweep = m_sweeps[inx];
+        size_t place = inx;
+        while ( place > 0 && m_sweeps[place-1].xmin > sweep.xmin )
+        {
+            m_sweeps[place] = m_sweeps[place-1];
+            --place;
+        }
+        m_sweeps[place] = sweep;
+    }
+}
+
+// Earliest time within the interval at which some moving robot hits
+// something, or -1 if none does, along with everyone who stops then.
+double ContinuousWorld::firstImpact ( double seconds, vector< Robot* > & stopping )
+{
+    static const double tolerance = 1e-9;
+    double first = -1;
+    sweepOut ( seconds );
+    for ( size_t inx = 0; inx < m_sweeps.size(); ++inx )
+    {
+        Sweep & sweep = m_sweeps[inx];
+        if ( ! sweep.robot->onTable() )
+        {
+            continue;
+        }
+        vector< Robot* > involved;
+        double impact = sweep.robot->moving() ? edgeTime ( sweep.robot, seconds ) : -1;
+        if ( impact >= 0 )
+        {
+            involved.push_back ( sweep.robot );
+        }
+        // Everything which starts sweeping before this one finishes.
+        for ( size_t other = inx + 1;
+              other < m_sweeps.size() && m_sweeps[other].xmin < sweep.xmax; ++other
+            )
+        {
+            Sweep & otherSweep = m_sweeps[other];
+            if ( ! otherSweep.robot->onTable() ||
+                 otherSweep.ymin >= sweep.ymax || sweep.ymin >= otherSweep.ymax ||
+                 ! ( sweep.robot->moving() || otherSweep.robot->moving() )
+               )
+            {
+                continue;
+            }
+            double pairImpact = impactTime ( sweep.robot, otherSweep.robot, seconds );
+            if ( pairImpact < 0 || ( impact >= 0 && pairImpact > impact + tolerance ) )
+            {
+                continue;
+            }
+            if ( impact < 0 || pairImpact < impact - tolerance )
+            {
+                involved.clear();
+                impact = pairImpact;
+            }
+            involved.push_back ( sweep.robot );
+            involved.push_back ( otherSweep.robot );
+        }
+        if ( impact < 0 || ( first >= 0 && impact > first + tolerance ) )
+        {
+            continue;
+        }
+        if ( first < 0 || impact < first - tolerance )
+        {
+            stopping.clear();
+            first = impact;
+        }
+        stopping.insert ( stopping.end(), involved.begin(), involved.end() );
+    }
+    return first;
+}
+
+// When, within the interval, two robots (discs of unit diameter) first
+// touch while closing on one another, or -1 if they don't.
+double ContinuousWorld::impactTime ( Robot * first, Robot * second, double seconds )
+{
+    double dx = second->fxpos() - first->fxpos();
+    double dy = second->fypos() - first->fypos();
+    double wx = ( second->moving() ? second->xvelocity() : 0 ) -
+                ( first->moving() ? first->xvelocity() : 0 );
+    double wy = ( second->moving() ? second->yvelocity() : 0 ) -
+                ( first->moving() ? first->yvelocity() : 0 );
+    double a = wx * wx + wy * wy;
+    double b = 2 * ( dx * wx + dy * wy );
+    double c = dx * dx + dy * dy - 1;
+    if ( a == 0 || b >= 0 )
+    {
+        return -1;      // not closing
+    }
+    if ( c <= 0 )
+    {
+        return 0;       // already touching
+    }
+    double discriminant = b * b - 4 * a * c;
+    if ( discriminant < 0 )
+    {
+        return -1;      // near miss
+    }
+    double impact = ( -b - sqrt ( discriminant ) ) / ( 2 * a );
+    return ( impact <= seconds ) ? impact : -1;
+}
+
+// When, within the interval, a robot's centre would leave the outermost
+// cells of the table, or -1 if it doesn't.
+double ContinuousWorld::edgeTime ( Robot * robot, double seconds ) const
+{
+    Table * table = Table::table();
+    double impact = -1;
+    double limits[2][2] =
+    {   { static_cast< double > ( table->xmin() ), static_cast< double > ( table->xmax() - 1 ) },
+        { static_cast< double > ( table->ymin() ), static_cast< double > ( table->ymax() - 1 ) }
+    };
+    double positions[2] = { robot->fxpos(), robot->fypos() };
+    double velocities[2] = { robot->xvelocity(), robot->yvelocity() };
+    for ( int axis = 0; axis < 2; ++axis )
+    {
+        double limit = ( velocities[axis] > 0 ) ? limits[axis][1] :
+                       ( velocities[axis] < 0 ) ? limits[axis][0] :
+                                                  positions[axis];
+        if ( velocities[axis] == 0 )
+        {
+            continue;
+        }
+        double axisImpact = ( limit - positions[axis] ) / velocities[axis];
+        axisImpact = ( axisImpact < 0 ) ? 0 : axisImpact;
+        if ( axisImpact <= seconds && ( impact < 0 || axisImpact < impact ) )
+        {
+            impact = axisImpact;
+        }
+    }
+    return impact;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Table::Table ( int xmin, int ymin, int xmax, int ymax )
+ : GameObject ( "Table" ),
+   m_xmin ( xmin ), m_ymin ( ymin ), m_xmax ( xmax ), m_ymax ( ymax )
+{
+    Broadcaster::singleton()->createCommandListener ( this, GameObject::respond );
+    ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider );
+}
+
+Table * Table::m_table = 0;
+
+void Table::setTable ( int xmin, int ymin, int xmax, int ymax )
+{
+    if ( xmin >= xmax || ymin >= ymax )
+    {
+        stringstream errorStream;
+        errorStream << "Invalid table limits [ ( " << xmin << ", " << ymin << " ), ( " << xmax << ", " << ymax << " ) ]";
+        throw exception ( errorStream.str().c_str() );
+    }
+    if ( m_table == 0 )
+    {
+        m_table = new Table ( xmin, ymin, xmax, ymax );
+    }
+    else
+    {
+        m_table->m_xmin = xmin;
+        m_table->m_ymin = ymin;
+        m_table->m_xmax = xmax;
+        m_table->m_ymax = ymax;
+    }
+}
+
+Table * Table::table()
+{
+    return m_table;
+}
+
+void Table::respond ( const Command & command )
+{
+    const string & commandName ( command.name() );
+
+    if ( commandName == "report" )
+    {
+        report();
+    }
+    else if ( commandName == "table" )
+    {
+        // DIY parsing to handle comma and whitespace.
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        string newXminToken = tokeniser.nextToken();
+        string newYminToken = tokeniser.nextToken();
+        string newXmaxToken = tokeniser.nextToken();
+        string newYmaxToken = tokeniser.nextToken();
+
+        // Got tokens, now convert them.
+        int newXmin = atoi ( newXminToken.c_str() );
+        int newYmin = atoi ( newYminToken.c_str() );
+        int newXmax = atoi ( newXmaxToken.c_str() );
+        int newYmax = atoi ( newYmaxToken.c_str() );
+        setTable ( newXmin, newYmin, newXmax, newYmax );
+    }
+}
+
+void Table::report()
+{
+    stringstream line;
+    line << "Table limits are: [ ( " << m_xmin << ", " << m_ymin << " ), ( "
+         << m_xmax << ", " << m_ymax << " ) ]";
+    if ( ReportWriter::singleton()->collecting() )
+    {
+        ReportWriter::singleton()->add ( line.str() );
+        return;
+    }
+    cout << line.str() << endl;
+}
+
+bool Table::constraintDecider
+(   GameObject * object,
+    int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable
+)
+{
+    // It's ok if it's the table itself or if it's not on the table or if it's
+    // within the table boundaries.
+    return object == this ||
+           ( ! onTable ) ||
+           ( m_xmin <= xpos && xpos < m_xmax &&
+             m_ymin <= ypos && ypos < m_ymax
+           );
+}
+
+int Table::xmin()
+{
+    return m_xmin;
+}
+
+int Table::ymin()
+{
+    return m_ymin;
+}
+
+int Table::xmax()
+{
+    return m_xmax;
+}
+
+int Table::ymax()
+{
+    return m_ymax;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// A map lookup, where the Table's check is four comparisons.
+Occupancy::Occupancy()
+ : GameObject ( "Occupancy" ),
+   m_grid ( 0 )
+{
+    ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider, 4 );
+}
+
+Occupancy * Occupancy::singleton()
+{
+    static Occupancy * occupancy = 0;
+    if ( occupancy == 0 )
+    {
+        occupancy = new Occupancy;
+    }
+    return occupancy;
+}
+
+void Occupancy::respond ( const Command & command )
+{
+    // Nothing to say.
+}
+
+// Is the proposed placement of the given object acceptable to me?
+bool Occupancy::constraintDecider
+(   GameObject * object,
+    int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable
+)
+{
+    // Off the table, anywhere goes. On it, nobody else can be there.
+    return ( ! onTable ) ||
+           occupant ( xpos, ypos, object ) == 0;
+}
+
+void Occupancy::add ( Robot * robot )
+{
+    if ( m_grid != 0 )
+    {
+        // Engine::shift has claimed it already, so this only fails if
+        // somebody else got there first.
+        if ( ! m_grid->claim ( robot->xpos(), robot->ypos(), robot->id() ) )
+        {
+            throw exception ( ( robot->name() + "'s cell is taken" ).c_str() );
+        }
+        return;
+    }
+    m_cells.insert ( CellMap::value_type ( make_pair ( robot->xpos(), robot->ypos() ), robot ) );
+}
+
+void Occupancy::remove ( Robot * robot )
+{
+    if ( m_grid != 0 )
+    {
+        m_grid->release ( robot->xpos(), robot->ypos(), robot->id() );
+        return;
+    }
+    pair< CellMap::iterator, CellMap::iterator > range =
+        m_cells.equal_range ( make_pair ( robot->xpos(), robot->ypos() ) );
+    for ( CellMap::iterator iter = range.first; iter != range.second; ++iter )
+    {
+        if ( iter->second == robot )
+        {
+            m_cells.erase ( iter );
+            return;
+        }
+    }
+}
+
+Robot * Occupancy::occupant ( int xpos, int ypos, const GameObject * other ) const
+{
+    if ( m_grid != 0 )
+    {
+        Robot * robot = RobotFactory::singleton()->robot ( m_grid->occupant ( xpos, ypos ) );
+        return robot == other ? 0 : robot;
+    }
+    pair< CellMap::const_iterator, CellMap::const_iterator > range =
+        m_cells.equal_range ( make_pair ( xpos, ypos ) );
+    for ( CellMap::const_iterator iter = range.first; iter != range.second; ++iter )
+    {
+        if ( iter->second != other )
+        {
+            return iter->second;
+        }
+    }
+    return 0;
+}
+
+// Swap the index for a CellGrid or back. Only to be done when no-one else
+// is moving robots about.
+void Occupancy::setConcurrent ( bool concurrent )
+{
+    if ( concurrent == ( m_grid != 0 ) )
+    {
+        return;
+    }
+    const vector< Robot* > & robots = RobotFactory::singleton()->robots();
+    if ( concurrent )
+    {
+        Table * table = Table::table();
+        m_grid = new CellGrid ( table->xmin(), table->ymin(), table->xmax(), table->ymax() );
+        m_cells.clear();
+    }
+    else
+    {
+        delete m_grid;
+        m_grid = 0;
+    }
+    for ( vector< Robot* >::const_iterator iter = robots.begin();
+          iter != robots.end(); ++iter
+        )
+    {
+        if ( *iter != 0 && (*iter)->onTable() )
+        {
+            add ( *iter );
+        }
+    }
+}
+
+bool Occupancy::concurrent() const
+{
+    return m_grid != 0;
+}
+
+bool Occupancy::claim ( int xpos, int ypos, Robot * robot )
+{
+    return m_grid == 0 || m_grid->claim ( xpos, ypos, robot->id() );
+}
+
+void Occupancy::release ( int xpos, int ypos, Robot * robot )
+{
+    if ( m_grid != 0 )
+    {
+        m_grid->release ( xpos, ypos, robot->id() );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Zones::Zones()
+ : GameObject ( "Zones" ),
+   m_capacityZones ( 0 ),
+   m_constraint ( 0 )
+{
+    // The Constraint is only made with the first zone, so that robots
+    // never bother with zones unless there are some.
+}
+
+Zones * Zones::singleton()
+{
+    static Zones * zones = 0;
+    if ( zones == 0 )
+    {
+        zones = new Zones;
+    }
+    return zones;
+}
+
+void Zones::respond ( const Command & command )
+{
+    // Nothing to say.
+}
+
+bool Zones::Zone::holds ( int xpos, int ypos ) const
+{
+    return xmin <= xpos && xpos < xmax && ymin <= ypos && ypos < ymax;
+}
+
+bool Zones::leftOf ( const Span & first, const Span & second )
+{
+    return first.xmin < second.xmin;
+}
+
+bool Zones::startsAfter ( int xpos, const Span & span )
+{
+    return xpos < span.xmin;
+}
+
+const Zones::Band * Zones::band ( int ypos ) const
+{
+    vector< int >::const_iterator edge = upper_bound ( m_edges.begin(), m_edges.end(), ypos );
+    if ( edge == m_edges.begin() || edge == m_edges.end() )
+    {
+        return 0;
+    }
+    return &m_bands[edge - m_edges.begin() - 1];
+}
+
+bool Zones::constraintDecider
+(   GameObject * object,
+    int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable
+)
+{
+    const Band * band = onTable ? this->band ( ypos ) : 0;
+    if ( band == 0 )
+    {
+        return true;
+    }
+
+    // Back from the last span starting at or before xpos, for as long as
+    // any span that far back reaches past it.
+    size_t inx = upper_bound ( band->spans.begin(), band->spans.end(), xpos, startsAfter ) -
+                 band->spans.begin();
+    while ( inx > 0 && band->reach[inx - 1] > xpos )
+    {
+        --inx;
+        const Span & span = band->spans[inx];
+        if ( span.xmax <= xpos )
+        {
+            continue;
+        }
+        const Zone * zone = span.zone;
+        if ( zone->kind == SpeedLimit )
+        {
+            // Instantaneous is as fast as it gets.
+            int speed = object->speed();
+            if ( speed == 0 || speed > zone->limit )
+            {
+                return false;
+            }
+        }
+        else if ( zone->kind == NoHeading )
+        {
+            if ( direction == zone->limit )
+            {
+                return false;
+            }
+        }
+        else if ( zone->count >= zone->limit &&
+                  ! ( object->onTable() && zone->holds ( object->xpos(), object->ypos() ) )
+                )
+        {
+            // Full, and not already in there.
+            return false;
+        }
+    }
+    return true;
+}
+
+void Zones::parse
+(   const string & qualifiers,
+    string & name,
+    string & kindName,
+    int & xmin,
+    int & ymin,
+    int & xmax,
+    int & ymax,
+    int & limit
+)
+{
+    Tokeniser tokeniser ( qualifiers, ", " );
+    name = tokeniser.nextToken();
+    kindName = lowerCaseString ( tokeniser.nextToken() );
+    if ( name.empty() || kindName == "remove" )
+    {
+        return;
+    }
+    if ( kindName != "speed" && kindName != "heading" && kindName != "capacity" )
+    {
+        throw exception ( ( "zone expects speed, heading, capacity or remove, not " + kindName ).c_str() );
+    }
+    xmin = atoi ( tokeniser.nextToken().c_str() );
+    ymin = atoi ( tokeniser.nextToken().c_str() );
+    xmax = atoi ( tokeniser.nextToken().c_str() );
+    ymax = atoi ( tokeniser.nextToken().c_str() );
+    if ( xmin >= xmax || ymin >= ymax )
+    {
+        stringstream errorStream;
+        errorStream << "Invalid zone limits [ ( " << xmin << ", " << ymin << " ), ( " << xmax << ", " << ymax << " ) ]";
+        throw exception ( errorStream.str().c_str() );
+    }
+    string limitToken ( tokeniser.nextToken() );
+    if ( limitToken.empty() )
+    {
+        throw exception ( ( "zone " + kindName + " needs a limit" ).c_str() );
+    }
+    if ( kindName == "heading" )
+    {
+        Direction direction = directionFromString ( limitToken );
+        if ( direction == Invalid )
+        {
+            throw InvalidDirectionException ( limitToken, "zone" );
+        }
+        limit = direction;
+    }
+    else
+    {
+        limit = atoi ( limitToken.c_str() );
+    }
+}
+
+void Zones::command ( const string & qualifiers )
+{
+    string name;
+    string kindName;
+    int xmin;
+    int ymin;
+    int xmax;
+    int ymax;
+    int limit;
+    parse ( qualifiers, name, kindName, xmin, ymin, xmax, ymax, limit );
+    if ( name.empty() )
+    {
+        list();
+        return;
+    }
+    if ( kindName == "remove" )
+    {
+        remove ( name );
+        return;
+    }
+    Kind kind = ( kindName == "speed" )   ? SpeedLimit :
+                ( kindName == "heading" ) ? NoHeading :
+                                            Capacity;
+    if ( kind == Capacity && Occupancy::singleton()->concurrent() )
+    {
+        throw exception ( "Cannot have capacity zones in concurrent mode" );
+    }
+    Zone * zone = new Zone;
+    zone->name = name;
+    zone->kind = kind;
+    zone->xmin = xmin;
+    zone->ymin = ymin;
+    zone->xmax = xmax;
+    zone->ymax = ymax;
+    zone->limit = limit;
+    zone->count = 0;
+    add ( zone );
+}
+
+// Replacing any zone of the same name.
+void Zones::add ( Zone * zone )
+{
+    ZoneMap::iterator found = m_zones.find ( zone->name );
+    if ( found != m_zones.end() )
+    {
+        if ( found->second->kind == Capacity )
+        {
+            --m_capacityZones;
+        }
+        delete found->second;
+        m_zones.erase ( found );
+    }
+    if ( zone->kind == Capacity )
+    {
+        const vector< Robot* > & robots = RobotFactory::singleton()->robots();
+        for ( vector< Robot* >::const_iterator iter = robots.begin();
+              iter != robots.end(); ++iter
+            )
+        {
+            Robot * robot = *iter;
+            if ( robot != 0 && robot->onTable() && zone->holds ( robot->xpos(), robot->ypos() ) )
+            {
+                ++zone->count;
+            }
+        }
+        ++m_capacityZones;
+    }
+    m_zones[zone->name] = zone;
+    if ( m_constraint == 0 )
+    {
+        m_constraint = ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider, 2 );
+    }
+    rebuild();
+}
+
+void Zones::remove ( const string & name )
+{
+    ZoneMap::iterator found = m_zones.find ( name );
+    if ( found == m_zones.end() )
+    {
+        throw exception ( ( "No such zone " + name ).c_str() );
+    }
+    if ( found->second->kind == Capacity )
+    {
+        --m_capacityZones;
+    }
+    delete found->second;
+    m_zones.erase ( found );
+    rebuild();
+}
+
+void Zones::list() const
+{
+    if ( m_zones.empty() )
+    {
+        cout << "No zones" << endl;
+        return;
+    }
+    for ( ZoneMap::const_iterator iter = m_zones.begin();
+          iter != m_zones.end(); ++iter
+        )
+    {
+        const Zone * zone = iter->second;
+        cout << "Zone " << zone->name << ": [ ( " << zone->xmin << ", " << zone->ymin
+             << " ), ( " << zone->xmax << ", " << zone->ymax << " ) ], ";
+        if ( zone->kind == SpeedLimit )
+        {
+            cout << "speed at most " << zone->limit;
+        }
+        else if ( zone->kind == NoHeading )
+        {
+            cout << "not facing " << directionName ( static_cast< Direction > ( zone->limit ) );
+        }
+        else
+        {
+            cout << "at most " << zone->limit << " robot" << ( zone->limit == 1 ? "" : "s" )
+                 << ", " << zone->count << " in it";
+        }
+        cout << endl;
+    }
+}
+
+// Zones come and go rarely, so the bands are just made again from scratch.
+void Zones::rebuild()
+{
+    m_edges.clear();
+    m_bands.clear();
+    int xmin = INT_MAX;
+    int ymin = INT_MAX;
+    int xmax = INT_MIN;
+    int ymax = INT_MIN;
+    for ( ZoneMap::const_iterator iter = m_zones.begin();
+          iter != m_zones.end(); ++iter
+        )
+    {
+        const Zone * zone = iter->second;
+        m_edges.push_back ( zone->ymin );
+        m_edges.push_back ( zone->ymax );
+        xmin = min ( xmin, zone->xmin );
+        ymin = min ( ymin, zone->ymin );
+        xmax = max ( xmax, zone->xmax );
+        ymax = max ( ymax, zone->ymax );
+    }
+    sort ( m_edges.begin(), m_edges.end() );
+    m_edges.erase ( unique ( m_edges.begin(), m_edges.end() ), m_edges.end() );
+    if ( ! m_edges.empty() )
+    {
+        m_bands.resize ( m_edges.size() - 1 );
+    }
+    for ( size_t inx = 0; inx < m_bands.size(); ++inx )
+    {
+        Band & band = m_bands[inx];
+        for ( ZoneMap::const_iterator iter = m_zones.begin();
+              iter != m_zones.end(); ++iter
+            )
+        {
+            Zone * zone = iter->second;
+            if ( zone->ymin <= m_edges[inx] && m_edges[inx] < zone->ymax )
+            {
+                Span span = { zone->xmin, zone->xmax, zone };
+                band.spans.push_back ( span );
+            }
+        }
+        stable_sort ( band.spans.begin(), band.spans.end(), leftOf );
+        int reach = INT_MIN;
+        for ( vector< Span >::const_iterator iter = band.spans.begin();
+              iter != band.spans.end(); ++iter
+            )
+        {
+            reach = max ( reach, iter->xmax );
+            band.reach.push_back ( reach );
+        }
+    }
+
+    // Moves anywhere else needn't ask.
+    if ( m_zones.empty() )
+    {
+        m_constraint->setExtent ( 0, 0, 0, 0 );
+    }
+    else
+    {
+        m_constraint->setExtent ( xmin, ymin, xmax, ymax );
+    }
+}
+
+void Zones::count ( Robot * robot, int change )
+{
+    const Band * band = this->band ( robot->ypos() );
+    if ( band == 0 )
+    {
+        return;
+    }
+    int xpos = robot->xpos();
+    size_t inx = upper_bound ( band->spans.begin(), band->spans.end(), xpos, startsAfter ) -
+                 band->spans.begin();
+    while ( inx > 0 && band->reach[inx - 1] > xpos )
+    {
+        --inx;
+        Zone * zone = band->spans[inx].zone;
+        if ( zone->kind == Capacity && band->spans[inx].xmax > xpos )
+        {
+            zone->count += change;
+        }
+    }
+}
+
+void Zones::enter ( Robot * robot )
+{
+    count ( robot, 1 );
+}
+
+void Zones::leave ( Robot * robot )
+{
+    count ( robot, -1 );
+}
+
+bool Zones::counting() const
+{
+    return m_capacityZones > 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Rooms::Rooms()
+ : GameObject ( "Rooms" ),
+   m_steps ( 0 ),
+   m_constraint ( 0 ),
+   m_target ( 0 )
+{
+    // The Constraint is only made when the first robot goes into a room.
+}
+
+Rooms * Rooms::singleton()
+{
+    static Rooms * rooms = 0;
+    if ( rooms == 0 )
+    {
+        rooms = new Rooms;
+    }
+    return rooms;
+}
+
+void Rooms::respond ( const Command & command )
+{
+    // Nothing to say.
+}
+
+bool Rooms::Room::holds ( int xpos, int ypos ) const
+{
+    return xmin <= xpos && xpos < xmax && ymin <= ypos && ypos < ymax;
+}
+
+// Off the table for as long as it's in a room.
+bool Rooms::constraintDecider
+(   GameObject * object,
+    int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable
+)
+{
+    return ( ! onTable ) || m_away.empty() || m_away.count ( object ) == 0;
+}
+
+Rooms::Room * Rooms::find ( const string & name ) const
+{
+    for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+          iter != m_rooms.end(); ++iter
+        )
+    {
+        if ( ( *iter )->name == name )
+        {
+            return *iter;
+        }
+    }
+    throw exception ( ( "No such room " + name ).c_str() );
+}
+
+void Rooms::room ( const string & qualifiers )
+{
+    Tokeniser tokeniser ( qualifiers, ", " );
+    string name ( tokeniser.nextToken() );
+    if ( name.empty() )
+    {
+        throw exception ( "room needs a room name" );
+    }
+    string token ( tokeniser.nextToken() );
+    string lcToken ( lowerCaseString ( token ) );
+    if ( lcToken == "portal" )
+    {
+        Room * room = find ( name );
+        int xpos = atoi ( tokeniser.nextToken().c_str() );
+        int ypos = atoi ( tokeniser.nextToken().c_str() );
+        string toName ( tokeniser.nextToken() );
+        Room * to = find ( toName );
+        int toXpos = atoi ( tokeniser.nextToken().c_str() );
+        int toYpos = atoi ( tokeniser.nextToken().c_str() );
+        if ( ! room->holds ( xpos, ypos ) || ! to->holds ( toXpos, toYpos ) )
+        {
+            stringstream errorStream;
+            errorStream << "Invalid portal from ( " << xpos << ", " << ypos << " ) in room " << name
+                        << " to ( " << toXpos << ", " << toYpos << " ) in room " << toName;
+            throw exception ( errorStream.str().c_str() );
+        }
+        Portal portal = { static_cast< size_t > ( std::find ( m_rooms.begin(), m_rooms.end(), to ) - m_rooms.begin() ),
+                          toXpos, toYpos };
+        room->portals[make_pair ( xpos, ypos )] = portal;
+    }
+    else if ( lcToken == "place" )
+    {
+        Room * room = find ( name );
+        string robotName ( tokeniser.nextToken() );
+        Robot * robot = Robot::find ( robotName );
+        if ( robot == 0 )
+        {
+            throw exception ( ( "No such robot " + robotName ).c_str() );
+        }
+        int xpos = atoi ( tokeniser.nextToken().c_str() );
+        int ypos = atoi ( tokeniser.nextToken().c_str() );
+        string directionToken ( tokeniser.nextToken() );
+        Direction direction = directionFromString ( directionToken );
+        if ( direction == Invalid )
+        {
+            throw InvalidDirectionException ( directionToken, "room place" );
+        }
+        if ( robot->onTable() )
+        {
+            throw exception ( ( "Robot " + robotName + " is on the table" ).c_str() );
+        }
+        unsigned id = robot->id();
+        if ( id < m_roomOf.size() && m_roomOf[id] >= 0 )
+        {
+            throw exception ( ( "Robot " + robotName + " is already in room " + m_rooms[m_roomOf[id]]->name ).c_str() );
+        }
+        if ( ! room->holds ( xpos, ypos ) || room->cells.count ( make_pair ( xpos, ypos ) ) != 0 )
+        {
+            cout << "Ignoring attempt to place robot " << robotName << " in invalid position" << endl;
+            return;
+        }
+        Resident resident = { id, xpos, ypos, direction };
+        room->residents[id] = resident;
+        room->cells[make_pair ( xpos, ypos )] = id;
+        if ( m_constraint == 0 )
+        {
+            m_constraint = ConstraintFactory::singleton()->createConstraint ( this, GameObject::constraintDecider, 2 );
+        }
+        settle ( id, static_cast< int > ( std::find ( m_rooms.begin(), m_rooms.end(), room ) - m_rooms.begin() ) );
+    }
+    else
+    {
+        for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+              iter != m_rooms.end(); ++iter
+            )
+        {
+            if ( ( *iter )->name == name )
+            {
+                throw exception ( ( "Room " + name + " already exists" ).c_str() );
+            }
+        }
+        int xmin = atoi ( token.c_str() );
+        int ymin = atoi ( tokeniser.nextToken().c_str() );
+        int xmax = atoi ( tokeniser.nextToken().c_str() );
+        int ymax = atoi ( tokeniser.nextToken().c_str() );
+        if ( xmin >= xmax || ymin >= ymax )
+        {
+            stringstream errorStream;
+            errorStream << "Invalid room limits [ ( " << xmin << ", " << ymin << " ), ( " << xmax << ", " << ymax << " ) ]";
+            throw exception ( errorStream.str().c_str() );
+        }
+        Room * room = new Room;
+        room->name = name;
+        room->xmin = xmin;
+        room->ymin = ymin;
+        room->xmax = xmax;
+        room->ymax = ymax;
+        room->started = m_steps;
+        room->finished = m_steps;
+        room->worker = 0;
+        m_rooms.push_back ( room );
+    }
+}
+
+void Rooms::rooms ( const string & qualifiers )
+{
+    Tokeniser tokeniser ( qualifiers, ", " );
+    string modeToken ( lowerCaseString ( tokeniser.nextToken() ) );
+    if ( modeToken.empty() )
+    {
+        list();
+        return;
+    }
+    if ( modeToken != "step" )
+    {
+        throw exception ( ( "rooms expects step, not " + modeToken ).c_str() );
+    }
+    string countToken ( tokeniser.nextToken() );
+    long count = countToken.empty() ? 1 : atol ( countToken.c_str() );
+    if ( count <= 0 || m_rooms.empty() )
+    {
+        return;
+    }
+
+    // Who holds up whom, as the portals stand now.
+    unique_lock< mutex > lock ( m_stepMutex );
+    for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+          iter != m_rooms.end(); ++iter
+        )
+    {
+        ( *iter )->feeders.clear();
+        ( *iter )->destinations.clear();
+    }
+    for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+          iter != m_rooms.end(); ++iter
+        )
+    {
+        for ( PortalMap::const_iterator portal = ( *iter )->portals.begin();
+              portal != ( *iter )->portals.end(); ++portal
+            )
+        {
+            Room * to = m_rooms[portal->second.room];
+            ( *iter )->destinations.insert ( to );
+            to->feeders.insert ( *iter );
+        }
+    }
+
+    // Each room's thread, started the first time round, takes it from
+    // there; this one just waits for them all to get to the end.
+    m_target = m_steps + count;
+    for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+          iter != m_rooms.end(); ++iter
+        )
+    {
+        if ( ( *iter )->worker == 0 )
+        {
+            ( *iter )->worker = new thread ( own, *iter );
+        }
+        ( *iter )->advanced.notify_one();
+    }
+    for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+          iter != m_rooms.end(); ++iter
+        )
+    {
+        while ( ( *iter )->finished < m_target )
+        {
+            m_stepped.wait ( lock );
+        }
+    }
+    lock.unlock();
+    m_steps += count;
+}
+
+// A room's thread, for good. Between runs it waits for the next; in a run,
+// it takes a step whenever its feeders and destinations are far enough on.
+void Rooms::own ( Room * room )
+{
+    Rooms * rooms = singleton();
+    unique_lock< mutex > lock ( rooms->m_stepMutex );
+    for ( ;; )
+    {
+        while ( ! rooms->ready ( room ) )
+        {
+            room->advanced.wait ( lock );
+        }
+        unsigned long step = room->finished;
+        lock.unlock();
+        rooms->arrive ( room, step );
+        lock.lock();
+        room->started = step + 1;
+        for ( set< Room* >::const_iterator iter = room->feeders.begin();
+              iter != room->feeders.end(); ++iter
+            )
+        {
+            ( *iter )->advanced.notify_one();
+        }
+        lock.unlock();
+        rooms->step ( room, step );
+        lock.lock();
+        room->finished = step + 1;
+        for ( set< Room* >::const_iterator iter = room->destinations.begin();
+              iter != room->destinations.end(); ++iter
+            )
+        {
+            ( *iter )->advanced.notify_one();
+        }
+        rooms->m_stepped.notify_one();
+    }
+}
+
+// Under m_stepMutex. Can the room start its next step? Not until everyone
+// coming through a portal in the step before has been sent, nor while a
+// room it might send someone to is still to empty the queue they'd go on.
+bool Rooms::ready ( const Room * room ) const
+{
+    unsigned long step = room->finished;
+    if ( step >= m_target )
+    {
+        return false;
+    }
+    for ( set< Room* >::const_iterator iter = room->feeders.begin();
+          iter != room->feeders.end(); ++iter
+        )
+    {
+        if ( ( *iter )->finished < step )
+        {
+            return false;
+        }
+    }
+    for ( set< Room* >::const_iterator iter = room->destinations.begin();
+          iter != room->destinations.end(); ++iter
+        )
+    {
+        if ( ( *iter )->started < step )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Rooms::byRobot ( const Resident & first, const Resident & second )
+{
+    return first.id < second.id;
+}
+
+// On the room's own thread: whoever came through a portal last step joins
+// whoever's still waiting from before.
+void Rooms::arrive ( Room * room, unsigned long step )
+{
+    lock_guard< mutex > lock ( room->inboundMutex );
+    vector< Resident > & arrived = room->inbound[( step + 1 ) % 2];
+    room->waiting.insert ( room->waiting.end(), arrived.begin(), arrived.end() );
+    arrived.clear();
+}
+
+// On the room's own thread, once it's arrived.
+void Rooms::step ( Room * room, unsigned long step )
+{
+    // Those waiting come out if they can.
+    sort ( room->waiting.begin(), room->waiting.end(), byRobot );
+    vector< Resident > stillWaiting;
+    for ( vector< Resident >::const_iterator iter = room->waiting.begin();
+          iter != room->waiting.end(); ++iter
+        )
+    {
+        pair< int, int > cell ( iter->xpos, iter->ypos );
+        if ( room->cells.count ( cell ) != 0 )
+        {
+            stillWaiting.push_back ( *iter );
+        }
+        else
+        {
+            room->residents[iter->id] = *iter;
+            room->cells[cell] = iter->id;
+        }
+    }
+    room->waiting.swap ( stillWaiting );
+
+    // Then everyone in the room takes a step, in order of robot.
+    map< unsigned, Resident >::iterator iter = room->residents.begin();
+    while ( iter != room->residents.end() )
+    {
+        Resident & resident = iter->second;
+        int xpos = resident.xpos;
+        int ypos = resident.ypos;
+        Robot::step ( resident.direction, xpos, ypos );
+        if ( ! room->holds ( xpos, ypos ) || room->cells.count ( make_pair ( xpos, ypos ) ) != 0 )
+        {
+            resident.direction = Robot::turnRight ( resident.direction );
+            ++iter;
+            continue;
+        }
+        room->cells.erase ( make_pair ( resident.xpos, resident.ypos ) );
+        PortalMap::const_iterator portal = room->portals.find ( make_pair ( xpos, ypos ) );
+        if ( portal == room->portals.end() )
+        {
+            resident.xpos = xpos;
+            resident.ypos = ypos;
+            room->cells[make_pair ( xpos, ypos )] = resident.id;
+            ++iter;
+            continue;
+        }
+        Resident traveller = resident;
+        traveller.xpos = portal->second.xpos;
+        traveller.ypos = portal->second.ypos;
+        Room * to = m_rooms[portal->second.room];
+        {
+            lock_guard< mutex > lock ( to->inboundMutex );
+            to->inbound[step % 2].push_back ( traveller );
+        }
+        // Only this thread has the robot, so only it writes its entry.
+        m_roomOf[traveller.id] = static_cast< int > ( portal->second.room );
+        room->residents.erase ( iter++ );
+    }
+}
+
+// A robot's gone into a room, or out of the rooms (-1). Robots going from
+// room to room only change their entry in m_roomOf.
+void Rooms::settle ( unsigned id, int room )
+{
+    if ( id >= m_roomOf.size() )
+    {
+        m_roomOf.resize ( max ( static_cast< size_t > ( id + 1 ), RobotFactory::singleton()->robots().size() ), -1 );
+    }
+    m_roomOf[id] = room;
+    if ( room < 0 )
+    {
+        m_away.erase ( RobotFactory::singleton()->robot ( id ) );
+    }
+    else
+    {
+        m_away.insert ( RobotFactory::singleton()->robot ( id ) );
+    }
+}
+
+void Rooms::evict ( unsigned id )
+{
+    if ( id >= m_roomOf.size() || m_roomOf[id] < 0 )
+    {
+        return;
+    }
+    Room * room = m_rooms[m_roomOf[id]];
+    map< unsigned, Resident >::iterator resident = room->residents.find ( id );
+    if ( resident != room->residents.end() )
+    {
+        room->cells.erase ( make_pair ( resident->second.xpos, resident->second.ypos ) );
+        room->residents.erase ( resident );
+    }
+    vector< Resident > * queues[3] = { &room->waiting, &room->inbound[0], &room->inbound[1] };
+    for ( int inx = 0; inx < 3; ++inx )
+    {
+        vector< Resident > & queue = *queues[inx];
+        for ( vector< Resident >::iterator iter = queue.begin(); iter != queue.end(); )
+        {
+            iter = ( iter->id == id ) ? queue.erase ( iter ) : iter + 1;
+        }
+    }
+    settle ( id, -1 );
+}
+
+string Rooms::roomOf ( unsigned id ) const
+{
+    if ( id >= m_roomOf.size() || m_roomOf[id] < 0 )
+    {
+        return string();
+    }
+    return m_rooms[m_roomOf[id]]->name;
+}
+
+bool Rooms::command ( Robot * robot, const Command & command )
+{
+    unsigned id = robot->id();
+    if ( id >= m_roomOf.size() || m_roomOf[id] < 0 )
+    {
+        return false;
+    }
+    Room * room = m_rooms[m_roomOf[id]];
+    const string & commandName ( command.name() );
+    if ( commandName == "place" )
+    {
+        int xpos;
+        int ypos;
+        Direction direction;
+        Robot::parsePlacement ( command.qualifiers(), xpos, ypos, direction );
+        // Let the Constraint pass it, and only let it go if it's placed.
+        m_away.erase ( robot );
+        if ( robot->tryPlace ( xpos, ypos, direction ) )
+        {
+            evict ( id );
+        }
+        else
+        {
+            m_away.insert ( robot );
+            cout << "Ignoring attempt to place robot " << robot->name() << " in invalid position" << endl;
+        }
+        return true;
+    }
+    if ( commandName == "remove" )
+    {
+        evict ( id );
+        return false;
+    }
+    if ( commandName != "move" && commandName != "left" &&
+         commandName != "right" && commandName != "report"
+       )
+    {
+        return false;
+    }
+
+    map< unsigned, Resident >::iterator found = room->residents.find ( id );
+    if ( found == room->residents.end() )
+    {
+        // Come through a portal, and not out yet.
+        vector< Resident > waiting ( room->waiting );
+        for ( int parity = 0; parity < 2; ++parity )
+        {
+            waiting.insert ( waiting.end(), room->inbound[parity].begin(), room->inbound[parity].end() );
+        }
+        stringstream line;
+        line << "Robot " << robot->name() << " is waiting to come out in room " << room->name;
+        if ( commandName == "report" )
+        {
+            for ( vector< Resident >::const_iterator iter = waiting.begin();
+                  iter != waiting.end(); ++iter
+                )
+            {
+                if ( iter->id == id )
+                {
+                    line << " at x = " << iter->xpos << ", y = " << iter->ypos;
+                }
+            }
+            say ( line.str() );
+        }
+        else
+        {
+            cout << line.str() << endl;
+        }
+        return true;
+    }
+
+    Resident & resident = found->second;
+    if ( commandName == "report" )
+    {
+        stringstream line;
+        line << "Robot " << robot->name() << " is in room " << room->name
+             << " at x = " << resident.xpos << ", y = " << resident.ypos
+             << ", facing " << directionName ( resident.direction );
+        say ( line.str() );
+    }
+    else if ( commandName == "left" )
+    {
+        resident.direction = Robot::turnLeft ( resident.direction );
+    }
+    else if ( commandName == "right" )
+    {
+        resident.direction = Robot::turnRight ( resident.direction );
+    }
+    else
+    {
+        move ( room, resident );
+    }
+    return true;
+}
+
+// A report line, in its turn if a broadcast's are being collected.
+void Rooms::say ( const string & line )
+{
+    if ( ReportWriter::singleton()->collecting() )
+    {
+        ReportWriter::singleton()->add ( line );
+        return;
+    }
+    cout << line << endl;
+}
+
+// As a step of a run, going through a portal onto the far room's inbound
+// queue, to come out at the start of the next step.
+void Rooms::move ( Room * room, Resident & resident )
+{
+    int xpos = resident.xpos;
+    int ypos = resident.ypos;
+    Robot::step ( resident.direction, xpos, ypos );
+    if ( ! room->holds ( xpos, ypos ) || room->cells.count ( make_pair ( xpos, ypos ) ) != 0 )
+    {
+        cout << "Ignoring attempt to move robot " << RobotFactory::singleton()->robot ( resident.id )->name()
+             << " to invalid position" << endl;
+        return;
+    }
+    room->cells.erase ( make_pair ( resident.xpos, resident.ypos ) );
+    PortalMap::const_iterator portal = room->portals.find ( make_pair ( xpos, ypos ) );
+    if ( portal == room->portals.end() )
+    {
+        resident.xpos = xpos;
+        resident.ypos = ypos;
+        room->cells[make_pair ( xpos, ypos )] = resident.id;
+        return;
+    }
+    Resident traveller = resident;
+    traveller.xpos = portal->second.xpos;
+    traveller.ypos = portal->second.ypos;
+    room->residents.erase ( resident.id );
+    Room * to = m_rooms[portal->second.room];
+    {
+        lock_guard< mutex > lock ( to->inboundMutex );
+        to->inbound[( m_steps + 1 ) % 2].push_back ( traveller );
+    }
+    m_roomOf[traveller.id] = static_cast< int > ( portal->second.room );
+}
+
+void Rooms::list() const
+{
+    if ( m_rooms.empty() )
+    {
+        cout << "No rooms" << endl;
+        return;
+    }
+    for ( vector< Room* >::const_iterator iter = m_rooms.begin();
+          iter != m_rooms.end(); ++iter
+        )
+    {
+        const Room * room = *iter;
+        cout << "Room " << room->name << ": [ ( " << room->xmin << ", " << room->ymin
+             << " ), ( " << room->xmax << ", " << room->ymax << " ) ], "
+             << room->portals.size() << " portal" << ( room->portals.size() == 1 ? "" : "s" ) << endl;
+        for ( map< unsigned, Resident >::const_iterator resident = room->residents.begin();
+              resident != room->residents.end(); ++resident
+            )
+        {
+            cout << "Robot " << RobotFactory::singleton()->robot ( resident->first )->name()
+                 << " is at x = " << resident->second.xpos << ", y = " << resident->second.ypos
+                 << ", facing " << directionName ( resident->second.direction ) << endl;
+        }
+        vector< Resident > waiting ( room->waiting );
+        for ( int parity = 0; parity < 2; ++parity )
+        {
+            waiting.insert ( waiting.end(), room->inbound[parity].begin(), room->inbound[parity].end() );
+        }
+        sort ( waiting.begin(), waiting.end(), byRobot );
+        for ( vector< Resident >::const_iterator resident = waiting.begin();
+              resident != waiting.end(); ++resident
+            )
+        {
+            cout << "Robot " << RobotFactory::singleton()->robot ( resident->id )->name()
+                 << " is waiting to come out at x = " << resident->xpos << ", y = " << resident->ypos << endl;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Heatmap::Heatmap()
+  : m_lastTile ( 0 ),
+    m_enabled ( false )
+{
+}
+
+Heatmap * Heatmap::singleton()
+{
+    static Heatmap * heatmap = 0;
+    if ( heatmap == 0 )
+    {
+        heatmap = new Heatmap;
+    }
+    return heatmap;
+}
+
+void Heatmap::enable ( bool on )
+{
+    if ( on == m_enabled )
+    {
+        return;
+    }
+    if ( on && Occupancy::singleton()->concurrent() )
+    {
+        throw exception ( "Cannot keep a heatmap in concurrent mode" );
+    }
+    m_enabled = on;
+    if ( ! on )
+    {
+        clear();
+    }
+}
+
+bool Heatmap::enabled() const
+{
+    return m_enabled;
+}
+
+void Heatmap::clear()
+{
+    for ( TileMap::iterator iter = m_tiles.begin(); iter != m_tiles.end(); ++iter )
+    {
+        delete iter->second;
+    }
+    m_tiles.clear();
+    m_lastTile = 0;
+}
+
+// Rounding down, negative or not.
+int Heatmap::tileOf ( int pos )
+{
+    return pos >= 0 ? pos / tileSide : -1 - ( -1 - pos ) / tileSide;
+}
+
+Heatmap::Tile * Heatmap::tile ( int xpos, int ypos, size_t & index )
+{
+    pair< int, int > key ( tileOf ( xpos ), tileOf ( ypos ) );
+    index = size_t ( ypos - key.second * tileSide ) * tileSide + size_t ( xpos - key.first * tileSide );
+    if ( m_lastTile != 0 && key == m_lastKey )
+    {
+        return m_lastTile;
+    }
+    TileMap::iterator found = m_tiles.find ( key );
+    if ( found == m_tiles.end() )
+    {
+        Tile * newTile = new Tile;
+        memset ( newTile, 0, sizeof ( Tile ) );
+        found = m_tiles.insert ( TileMap::value_type ( key, newTile ) ).first;
+    }
+    m_lastKey = key;
+    m_lastTile = found->second;
+    return m_lastTile;
+}
+
+void Heatmap::visit ( int xpos, int ypos )
+{
+    size_t index;
+    unsigned short & count = tile ( xpos, ypos, index )->visits[index];
+    if ( count != USHRT_MAX )
+    {
+        ++count;
+    }
+}
+
+void Heatmap::reject ( int xpos, int ypos )
+{
+    size_t index;
+    unsigned char & count = tile ( xpos, ypos, index )->rejections[index];
+    if ( count != UCHAR_MAX )
+    {
+        ++count;
+    }
+}
+
+static void putLittleEndian ( ostream & stream, unsigned long value, int bytes )
+{
+    for ( int inx = 0; inx < bytes; ++inx )
+    {
+        stream.put ( char ( ( value >> ( 8 * inx ) ) & 0xFF ) );
+    }
+}
+
+void Heatmap::exportTo ( const string & fileName ) const
+{
+    ofstream stream ( fileName.c_str(), ios::binary );
+    if ( ! stream )
+    {
+        throw exception ( ( "Cannot open " + fileName + " for export" ).c_str() );
+    }
+    stream.write ( "GRHM", 4 );
+    putLittleEndian ( stream, 1, 4 );               // version
+    putLittleEndian ( stream, tileSide, 4 );
+    putLittleEndian ( stream, m_tiles.size(), 4 );
+    for ( TileMap::const_iterator iter = m_tiles.begin(); iter != m_tiles.end(); ++iter )
+    {
+        putLittleEndian ( stream, static_cast< unsigned long > ( iter->first.first ), 4 );
+        putLittleEndian ( stream, static_cast< unsigned long > ( iter->first.second ), 4 );
+        for ( size_t inx = 0; inx < tileCells; ++inx )
+        {
+            putLittleEndian ( stream, iter->second->visits[inx], 2 );
+        }
+        stream.write ( reinterpret_cast< const char * > ( iter->second->rejections ), tileCells );
+    }
+    if ( ! stream.flush() )
+    {
+        throw exception ( ( "Failed writing " + fileName ).c_str() );
+    }
+}
+
+namespace
+{
+    struct HeatmapCell
+    {
+        unsigned count;
+        int xpos;
+        int ypos;
+    };
+
+    // Busier first, then bottom to top and left to right.
+    bool busier ( const HeatmapCell & first, const HeatmapCell & second )
+    {
+        if ( first.count != second.count )
+        {
+            return first.count > second.count;
+        }
+        return first.ypos != second.ypos ? first.ypos < second.ypos : first.xpos < second.xpos;
+    }
+}
+
+// The top count are kept in a heap with the least busy on top, to be pushed
+// out by anything busier.
+void Heatmap::top ( ostream & stream, size_t count, bool byRejections ) const
+{
+    vector< HeatmapCell > heap;
+    for ( TileMap::const_iterator iter = m_tiles.begin(); iter != m_tiles.end(); ++iter )
+    {
+        for ( size_t inx = 0; inx < tileCells; ++inx )
+        {
+            HeatmapCell cell;
+            cell.count = byRejections ? iter->second->rejections[inx] : iter->second->visits[inx];
+            if ( cell.count == 0 )
+            {
+                continue;
+            }
+            cell.xpos = iter->first.first * tileSide + int ( inx % tileSide );
+            cell.ypos = iter->first.second * tileSide + int ( inx / tileSide );
+            if ( heap.size() < count )
+            {
+                heap.push_back ( cell );
+                push_heap ( heap.begin(), heap.end(), busier );
+            }
+            else if ( count != 0 && busier ( cell, heap.front() ) )
+            {
+                pop_heap ( heap.begin(), heap.end(), busier );
+                heap.back() = cell;
+                push_heap ( heap.begin(), heap.end(), busier );
+            }
+        }
+    }
+    sort_heap ( heap.begin(), heap.end(), busier );
+    unsigned limit = byRejections ? UCHAR_MAX : USHRT_MAX;
+    for ( vector< HeatmapCell >::const_iterator iter = heap.begin(); iter != heap.end(); ++iter )
+    {
+        stream << "Cell ( " << iter->xpos << ", " << iter->ypos << " ): " << iter->count
+               << ( iter->count == limit ? "+" : "" )
+               << ( byRejections ? " rejected move" : " visit" ) << ( iter->count == 1 ? "" : "s" ) << endl;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+CountMinSketch::CountMinSketch()
+  : m_counters ( new atomic< unsigned > [ depth * width ] ),
+    m_threshold ( 0 )
+{
+    for ( size_t inx = 0; inx < depth * width; ++inx )
+    {
+        m_counters[inx].store ( 0, memory_order_relaxed );
+    }
+}
+
+CountMinSketch::~CountMinSketch()
+{
+    delete [] m_counters;
+}
+
+// A different mix of the key for each row (the splitmix64 finaliser), the
+// top bits picking the column.
+size_t CountMinSketch::column ( unsigned long long key, size_t row )
+{
+    static const unsigned long long seeds[depth] =
+    {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+    };
+    unsigned long long hash = key + seeds[row];
+    hash = ( hash ^ ( hash >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+    hash = ( hash ^ ( hash >> 27 ) ) * 0x94D049BB133111EBULL;
+    hash = hash ^ ( hash >> 31 );
+    return static_cast< size_t > ( hash >> ( 64 - widthBits ) );
+}
+
+unsigned CountMinSketch::estimate ( unsigned long long key ) const
+{
+    unsigned least = UINT_MAX;
+    for ( size_t row = 0; row < depth; ++row )
+    {
+        least = min ( least, m_counters[row * width + column ( key, row )].load ( memory_order_relaxed ) );
+    }
+    return least;
+}
+
+void CountMinSketch::add ( unsigned long long key )
+{
+    unsigned count = UINT_MAX;
+    for ( size_t row = 0; row < depth; ++row )
+    {
+        count = min ( count, m_counters[row * width + column ( key, row )].fetch_add ( 1, memory_order_relaxed ) + 1 );
+    }
+    if ( count <= m_threshold.load ( memory_order_relaxed ) ||
+         ( ( count & ( count - 1 ) ) != 0 && count % 64 != 0 )
+       )
+    {
+        return;
+    }
+
+    lock_guard< mutex > lock ( m_heapMutex );
+    vector< pair< unsigned, unsigned long long > >::iterator found = m_heap.begin();
+    for ( ; found != m_heap.end() && found->second != key; ++found )
+    {
+    }
+    if ( found != m_heap.end() )
+    {
+        found->first = count;
+        make_heap ( m_heap.begin(), m_heap.end(), greater< pair< unsigned, unsigned long long > >() );
+    }
+    else if ( m_heap.size() < tracked )
+    {
+        m_heap.push_back ( make_pair ( count, key ) );
+        push_heap ( m_heap.begin(), m_heap.end(), greater< pair< unsigned, unsigned long long > >() );
+    }
+    else if ( count > m_heap.front().first )
+    {
+        pop_heap ( m_heap.begin(), m_heap.end(), greater< pair< unsigned, unsigned long long > >() );
+        m_heap.back() = make_pair ( count, key );
+        push_heap ( m_heap.begin(), m_heap.end(), greater< pair< unsigned, unsigned long long > >() );
+    }
+    m_threshold.store ( m_heap.size() < tracked ? 0 : m_heap.front().first, memory_order_relaxed );
+}
+
+namespace
+{
+    // Most first, and then in order of key, so the order doesn't depend on
+    // the order they were counted in.
+    bool countedMore
+    (   const pair< unsigned long long, unsigned > & first,
+        const pair< unsigned long long, unsigned > & second
+    )
+    {
+        return first.second != second.second ? first.second > second.second : first.first < second.first;
+    }
+}
+
+// The counts in the heap are as of the key's last check, so they're
+// brought up to date first.
+void CountMinSketch::top ( size_t count, vector< pair< unsigned long long, unsigned > > & keys ) const
+{
+    keys.clear();
+    {
+        lock_guard< mutex > lock ( m_heapMutex );
+        for ( size_t inx = 0; inx < m_heap.size(); ++inx )
+        {
+            keys.push_back ( make_pair ( m_heap[inx].second, 0u ) );
+        }
+    }
+    for ( size_t inx = 0; inx < keys.size(); ++inx )
+    {
+        keys[inx].second = estimate ( keys[inx].first );
+    }
+    sort ( keys.begin(), keys.end(), countedMore );
+    if ( keys.size() > count )
+    {
+        keys.resize ( count );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Contention::Contention()
+  : m_edge ( 0 ),
+    m_robots ( 0 ),
+    m_other ( 0 )
+{
+}
+
+Contention * Contention::singleton()
+{
+    static Contention * contention = new Contention;
+    return contention;
+}
+
+static unsigned long long cellKey ( int xpos, int ypos )
+{
+    return static_cast< unsigned long long > ( static_cast< unsigned > ( xpos ) ) << 32 |
+           static_cast< unsigned > ( ypos );
+}
+
+void Contention::record ( Robot * robot, int xpos, int ypos, GameObject * rejecter )
+{
+    m_cells.add ( cellKey ( xpos, ypos ) );
+    if ( rejecter != 0 && rejecter == Table::table() )
+    {
+        m_edge.fetch_add ( 1, memory_order_relaxed );
+    }
+    else if ( rejecter != 0 && rejecter == Occupancy::singleton() )
+    {
+        m_robots.fetch_add ( 1, memory_order_relaxed );
+        // Gone again already, possibly, in concurrent mode.
+        Robot * blocker = Occupancy::singleton()->occupant ( xpos, ypos, robot );
+        if ( blocker != 0 )
+        {
+            m_pairs.add ( static_cast< unsigned long long > ( robot->id() ) << 32 | blocker->id() );
+        }
+    }
+    else
+    {
+        m_other.fetch_add ( 1, memory_order_relaxed );
+    }
+}
+
+static string nameOfRobot ( unsigned id )
+{
+    Robot * robot = RobotFactory::singleton()->robot ( id );
+    if ( robot != 0 )
+    {
+        return robot->name();
+    }
+    stringstream name;
+    name << "#" << id << " (destroyed)";
+    return name.str();
+}
+
+void Contention::report ( ostream & stream, size_t count ) const
+{
+    unsigned long edge = m_edge.load ( memory_order_relaxed );
+    unsigned long robots = m_robots.load ( memory_order_relaxed );
+    unsigned long other = m_other.load ( memory_order_relaxed );
+    stream << "Rejected moves: " << edge + robots + other << " (table edge " << edge
+           << ", robots in the way " << robots << ", other " << other << ")" << endl;
+
+    vector< pair< unsigned long long, unsigned > > keys;
+    m_cells.top ( count, keys );
+    stream << "Most contended cells:" << endl;
+    for ( size_t inx = 0; inx < keys.size(); ++inx )
+    {
+        stream << "    Cell ( " << static_cast< int > ( keys[inx].first >> 32 ) << ", "
+               << static_cast< int > ( keys[inx].first & 0xFFFFFFFF ) << " ): "
+               << keys[inx].second << endl;
+    }
+    m_pairs.top ( count, keys );
+    stream << "Robots most held up by others:" << endl;
+    for ( size_t inx = 0; inx < keys.size(); ++inx )
+    {
+        stream << "    " << nameOfRobot ( static_cast< unsigned > ( keys[inx].first >> 32 ) )
+               << " by " << nameOfRobot ( static_cast< unsigned > ( keys[inx].first & 0xFFFFFFFF ) )
+               << ": " << keys[inx].second << endl;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Sockets on Windows are much the same as anywhere else, once started.
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+typedef int SocketLength;
+static void closeSocket ( SocketHandle handle )
+{
+    closesocket ( handle );
+}
+static void stopSocket ( SocketHandle handle )
+{
+    shutdown ( handle, SD_BOTH );
+}
+static void startSockets()
+{
+    static bool started = false;
+    if ( ! started )
+    {
+        WSADATA data;
+        if ( WSAStartup ( MAKEWORD ( 2, 2 ), &data ) != 0 )
+        {
+            throw exception ( "Cannot start Windows Sockets" );
+        }
+        started = true;
+    }
+}
+#else
+typedef int SocketHandle;
+typedef socklen_t SocketLength;
+static void closeSocket ( SocketHandle handle )
+{
+    close ( handle );
+}
+static void stopSocket ( SocketHandle handle )
+{
+    shutdown ( handle, SHUT_RDWR );
+}
+static void startSockets()
+{
+}
+#endif
+
+#ifdef MSG_NOSIGNAL
+static const int sendFlags = MSG_NOSIGNAL;     // a lost connection throws instead
+#else
+static const int sendFlags = 0;
+#endif
+
+static void noDelay ( SocketHandle handle )
+{
+    int on = 1;
+    setsockopt ( handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast< const char* > ( &on ), sizeof on );
+}
+
+// Connecting to a port in the ephemeral range on this host, with nothing
+// listening there yet, can be given that same port to connect from, and so
+// connect to itself.
+static bool connectedToSelf ( SocketHandle handle )
+{
+    sockaddr_in local;
+    sockaddr_in remote;
+    SocketLength localLength = sizeof local;
+    SocketLength remoteLength = sizeof remote;
+    return getsockname ( handle, reinterpret_cast< sockaddr* > ( &local ), &localLength ) == 0 &&
+           getpeername ( handle, reinterpret_cast< sockaddr* > ( &remote ), &remoteLength ) == 0 &&
+           local.sin_port == remote.sin_port &&
+           local.sin_addr.s_addr == remote.sin_addr.s_addr;
+}
+
+SocketLink::SocketLink ( const string & peer )
+  : m_peer ( peer ), m_listener ( -1 ), m_socket ( -1 )
+{
+}
+
+SocketLink::~SocketLink()
+{
+    if ( m_listener != -1 )
+    {
+        closeSocket ( static_cast< SocketHandle > ( m_listener ) );
+    }
+    if ( m_socket != -1 )
+    {
+        closeSocket ( static_cast< SocketHandle > ( m_socket ) );
+    }
+}
+
+// On any address, unless given a host to listen on the address of.
+static SocketHandle listenOn ( int port, int backlog, const string & host = string() )
+{
+    startSockets();
+    sockaddr_in address;
+    memset ( &address, 0, sizeof address );
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl ( INADDR_ANY );
+    if ( ! host.empty() )
+    {
+        addrinfo hints;
+        memset ( &hints, 0, sizeof hints );
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo * found = 0;
+        if ( getaddrinfo ( host.c_str(), 0, &hints, &found ) != 0 )
+        {
+            throw exception ( ( "Cannot find host " + host ).c_str() );
+        }
+        address.sin_addr = reinterpret_cast< sockaddr_in* > ( found->ai_addr )->sin_addr;
+        freeaddrinfo ( found );
+    }
+    address.sin_port = htons ( static_cast< unsigned short > ( port ) );
+    SocketHandle listener = socket ( AF_INET, SOCK_STREAM, 0 );
+    int on = 1;
+    setsockopt ( listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast< const char* > ( &on ), sizeof on );
+    if ( bind ( listener, reinterpret_cast< sockaddr* > ( &address ), sizeof address ) != 0 ||
+         ::listen ( listener, backlog ) != 0
+       )
+    {
+        closeSocket ( listener );
+        stringstream errorStream;
+        errorStream << "Cannot listen on port " << port;
+        throw exception ( errorStream.str().c_str() );
+    }
+    return listener;
+}
+
+void SocketLink::listen ( int port )
+{
+    m_listener = listenOn ( port, 1 );
+}
+
+void SocketLink::accept()
+{
+    SocketHandle connection = ::accept ( static_cast< SocketHandle > ( m_listener ), 0, 0 );
+    closeSocket ( static_cast< SocketHandle > ( m_listener ) );
+    m_listener = -1;
+    if ( connection == static_cast< SocketHandle > ( -1 ) )
+    {
+        throw exception ( ( "Cannot accept a connection from " + m_peer ).c_str() );
+    }
+    noDelay ( connection );
+    m_socket = connection;
+}
+
+void SocketLink::connect ( const string & host, int port )
+{
+    startSockets();
+    addrinfo hints;
+    memset ( &hints, 0, sizeof hints );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    stringstream portStream;
+    portStream << port;
+    addrinfo * found = 0;
+    if ( getaddrinfo ( host.c_str(), portStream.str().c_str(), &hints, &found ) != 0 )
+    {
+        throw exception ( ( "Cannot find host " + host ).c_str() );
+    }
+
+    // For up to half a minute, as it may not have started yet.
+    for ( int attempt = 0; attempt < 300 && m_socket == -1; ++attempt )
+    {
+        SocketHandle connection = socket ( found->ai_family, found->ai_socktype, found->ai_protocol );
+        if ( ::connect ( connection, found->ai_addr, static_cast< SocketLength > ( found->ai_addrlen ) ) == 0 &&
+             ! connectedToSelf ( connection )
+           )
+        {
+            noDelay ( connection );
+            m_socket = connection;
+        }
+        else
+        {
+            closeSocket ( connection );
+            this_thread::sleep_for ( chrono::milliseconds ( 100 ) );
+        }
+    }
+    freeaddrinfo ( found );
+    if ( m_socket == -1 )
+    {
+        throw exception ( ( "Cannot connect to " + host + ":" + portStream.str() ).c_str() );
+    }
+}
+
+void SocketLink::send ( const vector< int > & words )
+{
+    vector< char > bytes ( ( words.size() + 1 ) * 4 );
+    unsigned long value = static_cast< unsigned long > ( words.size() );
+    for ( size_t inx = 0; inx <= words.size(); ++inx )
+    {
+        if ( inx > 0 )
+        {
+            value = static_cast< unsigned long > ( static_cast< unsigned > ( words[inx - 1] ) );
+        }
+        for ( int byte = 0; byte < 4; ++byte )
+        {
+            bytes[inx * 4 + byte] = static_cast< char > ( ( value >> ( byte * 8 ) ) & 0xFF );
+        }
+    }
+    sendBytes ( &bytes[0], bytes.size() );
+}
+
+void SocketLink::receive ( vector< int > & words )
+{
+    size_t count = receiveCount();
+    vector< char > bytes ( count * 4 + 1 );
+    receiveBytes ( &bytes[0], count * 4 );
+    words.resize ( count );
+    for ( size_t inx = 0; inx < count; ++inx )
+    {
+        const unsigned char * word = reinterpret_cast< const unsigned char* > ( &bytes[inx * 4] );
+        words[inx] = static_cast< int > ( word[0] | word[1] << 8 | word[2] << 16 | static_cast< unsigned > ( word[3] ) << 24 );
+    }
+}
+
+void SocketLink::send ( const string & text )
+{
+    // The count and the text together, so as not to wait on an ack between.
+    string bytes ( 4, '\0' );
+    for ( int byte = 0; byte < 4; ++byte )
+    {
+        bytes[byte] = static_cast< char > ( ( text.size() >> ( byte * 8 ) ) & 0xFF );
+    }
+    bytes += text;
+    sendBytes ( bytes.data(), bytes.size() );
+}
+
+void SocketLink::receive ( string & text )
+{
+    size_t count = receiveCount();
+    vector< char > bytes ( count + 1 );
+    receiveBytes ( &bytes[0], count );
+    text.assign ( &bytes[0], count );
+}
+
+size_t SocketLink::receiveCount()
+{
+    unsigned char header[4];
+    receiveBytes ( reinterpret_cast< char* > ( header ), 4 );
+    return header[0] | header[1] << 8 | header[2] << 16 | static_cast< size_t > ( header[3] ) << 24;
+}
+
+void SocketLink::sendBytes ( const char * bytes, size_t count )
+{
+    while ( count > 0 )
+    {
+        int chunk = static_cast< int > ( min ( count, static_cast< size_t > ( 1 << 20 ) ) );
+        int sent = ::send ( static_cast< SocketHandle > ( m_socket ), bytes, chunk, sendFlags );
+        if ( sent <= 0 )
+        {
+            throw exception ( ( "Lost the connection to " + m_peer ).c_str() );
+        }
+        bytes += sent;
+        count -= sent;
+    }
+}
+
+void SocketLink::receiveBytes ( char * bytes, size_t count )
+{
+    while ( count > 0 )
+    {
+        int chunk = static_cast< int > ( min ( count, static_cast< size_t > ( 1 << 20 ) ) );
+        int received = recv ( static_cast< SocketHandle > ( m_socket ), bytes, chunk, 0 );
+        if ( received <= 0 )
+        {
+            throw exception ( ( "Lost the connection to " + m_peer ).c_str() );
+        }
+        bytes += received;
+        count -= received;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Fleet::Fleet()
+  : m_strip ( 0 ), m_count ( 1 ), m_below ( 0 ), m_above ( 0 ),
+    m_stepping ( false ), m_low ( 0 ), m_high ( 0 )
+{
+}
+
+Fleet * Fleet::singleton()
+{
+    static Fleet * fleet = 0;
+    if ( fleet == 0 )
+    {
+        fleet = new Fleet;
+    }
+    return fleet;
+}
+
+static void splitAddress ( const string & address, string & host, int & port )
+{
+    size_t colon = address.rfind ( ':' );
+    if ( colon == string::npos || colon == 0 || atoi ( address.c_str() + colon + 1 ) <= 0 )
+    {
+        throw exception ( ( "Invalid address " + address + " (expected <host>:<port>)" ).c_str() );
+    }
+    host = address.substr ( 0, colon );
+    port = atoi ( address.c_str() + colon + 1 );
+}
+
+void Fleet::distribute ( size_t strip, size_t count, const vector< string > & peers )
+{
+    if ( strip >= count )
+    {
+        throw exception ( "Invalid strip" );
+    }
+    if ( peers.size() != count )
+    {
+        throw exception ( "Distributed mode needs an address for every strip" );
+    }
+    m_strip = strip;
+    m_count = count;
+    string host;
+    int port;
+    if ( strip + 1 < count )
+    {
+        splitAddress ( peers[strip], host, port );
+        m_above = new SocketLink ( "the strip above" );
+        m_above->listen ( port );
+    }
+    if ( strip > 0 )
+    {
+        splitAddress ( peers[strip - 1], host, port );
+        m_below = new SocketLink ( "the strip below" );
+        m_below->connect ( host, port );
+    }
+    if ( m_above != 0 )
+    {
+        m_above->accept();
+    }
+}
+
+void Fleet::command ( const string & qualifiers )
+{
+    Tokeniser tokeniser ( qualifiers, ", " );
+    string modeToken ( lowerCaseString ( tokeniser.nextToken() ) );
+    if ( modeToken != "step" )
+    {
+        throw exception ( ( "fleet expects step, not " + modeToken ).c_str() );
+    }
+    string countToken ( tokeniser.nextToken() );
+    long count = countToken.empty() ? 1 : atol ( countToken.c_str() );
+    if ( count > 0 )
+    {
+        step ( count );
+    }
+}
+
+void Fleet::pack ( const vector< Mover > & movers, vector< int > & words )
+{
+    words.push_back ( static_cast< int > ( movers.size() ) );
+    for ( vector< Mover >::const_iterator iter = movers.begin();
+          iter != movers.end(); ++iter
+        )
+    {
+        words.push_back ( static_cast< int > ( iter->id ) );
+        words.push_back ( iter->xpos );
+        words.push_back ( iter->ypos );
+        words.push_back ( iter->direction );
+    }
+}
+
+// Returns where the next lot starts.
+size_t Fleet::unpack ( const vector< int > & words, size_t from, vector< Mover > & movers )
+{
+    size_t count = static_cast< size_t > ( words.at ( from ) );
+    if ( from + 1 + count * 4 > words.size() )
+    {
+        throw exception ( "Garbled message from the next strip" );
+    }
+    for ( size_t inx = 0; inx < count; ++inx )
+    {
+        const int * word = &words[from + 1 + inx * 4];
+        Mover mover = { static_cast< unsigned > ( word[0] ), word[1], word[2], static_cast< Direction > ( word[3] ) };
+        movers.push_back ( mover );
+    }
+    return from + 1 + count * 4;
+}
+
+void Fleet::border ( const vector< Mover > & movers, int low, int high, vector< Mover > & found )
+{
+    for ( vector< Mover >::const_iterator iter = movers.begin();
+          iter != movers.end(); ++iter
+        )
+    {
+        if ( low <= iter->ypos && iter->ypos < high )
+        {
+            found.push_back ( *iter );
+        }
+    }
+}
+
+void Fleet::stepOnce
+(   vector< Mover > & held,
+    const vector< Mover > & ghosts,
+    int low,
+    int high,
+    vector< Mover > & below,
+    vector< Mover > & above
+) const
+{
+    // Where everyone is, and where they're trying to go, as of now.
+    vector< pair< unsigned long long, unsigned > > cells;
+    vector< pair< unsigned long long, unsigned > > targets;
+    for ( int list = 0; list < 2; ++list )
+    {
+        const vector< Mover > & movers = ( list == 0 ) ? held : ghosts;
+        for ( vector< Mover >::const_iterator iter = movers.begin();
+              iter != movers.end(); ++iter
+            )
+        {
+            int xpos = iter->xpos;
+            int ypos = iter->ypos;
+            cells.push_back ( make_pair ( cellKey ( xpos, ypos ), iter->id ) );
+            Robot::step ( iter->direction, xpos, ypos );
+            targets.push_back ( make_pair ( cellKey ( xpos, ypos ), iter->id ) );
+        }
+    }
+    sort ( cells.begin(), cells.end() );
+    sort ( targets.begin(), targets.end() );
+
+    Table * table = Table::table();
+    vector< Mover > staying;
+    for ( vector< Mover >::iterator iter = held.begin();
+          iter != held.end(); ++iter
+        )
+    {
+        int xpos = iter->xpos;
+        int ypos = iter->ypos;
+        Robot::step ( iter->direction, xpos, ypos );
+        pair< unsigned long long, unsigned > cell ( cellKey ( xpos, ypos ), 0 );
+        vector< pair< unsigned long long, unsigned > >::const_iterator occupant =
+            lower_bound ( cells.begin(), cells.end(), cell );
+        if ( table->xmin() <= xpos && xpos < table->xmax() &&
+             table->ymin() <= ypos && ypos < table->ymax() &&
+             ( occupant == cells.end() || occupant->first != cell.first ) &&
+             lower_bound ( targets.begin(), targets.end(), cell )->second == iter->id &&
+             Constraint::acceptable ( RobotFactory::singleton()->robot ( iter->id ),
+                                      xpos, ypos, iter->direction, true, Occupancy::singleton() )
+           )
+        {
+            iter->xpos = xpos;
+            iter->ypos = ypos;
+        }
+        else
+        {
+            iter->direction = Robot::turnRight ( iter->direction );
+        }
+        ( iter->ypos >= high ? above : iter->ypos < low ? below : staying ).push_back ( *iter );
+    }
+    held.swap ( staying );
+}
+
+static bool byMoverId ( const pair< unsigned, size_t > & first, const pair< unsigned, size_t > & second )
+{
+    return first.first < second.first;
+}
+
+void Fleet::step ( unsigned long count )
+{
+    if ( Occupancy::singleton()->concurrent() )
+    {
+        throw exception ( "Cannot step the fleet in concurrent mode" );
+    }
+    if ( Transaction::singleton()->open() )
+    {
+        throw exception ( "Cannot step the fleet during a transaction" );
+    }
+    if ( Zones::singleton()->counting() )
+    {
+        throw exception ( "Cannot step the fleet with capacity zones" );
+    }
+    if ( ! m_stepping )
+    {
+        Table * table = Table::table();
+        long long rows = table->ymax() - table->ymin();
+        int low = table->ymin() + static_cast< int > ( rows * m_strip / m_count );
+        int high = table->ymin() + static_cast< int > ( rows * ( m_strip + 1 ) / m_count );
+        if ( m_count > 1 && high - low < 3 )
+        {
+            throw exception ( "Each strip of the table needs at least 3 rows" );
+        }
+
+        // Everyone is where they are everywhere, to begin with.
+        m_low = low;
+        m_high = high;
+        const vector< Robot* > & robots = RobotFactory::singleton()->robots();
+        for ( vector< Robot* >::const_iterator iter = robots.begin();
+              iter != robots.end(); ++iter
+            )
+        {
+            Robot * robot = *iter;
+            if ( robot == 0 || ! robot->onTable() )
+            {
+                continue;
+            }
+            Mover mover = { robot->id(), robot->xpos(), robot->ypos(), robot->direction() };
+            if ( low <= mover.ypos && mover.ypos < high )
+            {
+                m_held.push_back ( mover );
+            }
+            else if ( low - 2 <= mover.ypos && mover.ypos < high + 2 )
+            {
+                m_ghosts.push_back ( mover );
+            }
+        }
+        m_stepping = true;
+    }
+
+    for ( unsigned long inx = 0; inx < count; ++inx )
+    {
+        vector< Mover > below;
+        vector< Mover > above;
+        stepOnce ( m_held, m_ghosts, m_low, m_high, below, above );
+
+        // The rows next door, before anyone arrives: robots going next door
+        // land in the row by the border, so they're ghosts from now on, and
+        // robots coming in land in the row by the border too, which with
+        // three rows or more isn't one sent the other way.
+        vector< Mover > belowEdge;
+        vector< Mover > aboveEdge;
+        border ( m_held, m_low, m_low + 2, belowEdge );
+        border ( m_held, m_high - 2, m_high, aboveEdge );
+        m_ghosts = below;
+        m_ghosts.insert ( m_ghosts.end(), above.begin(), above.end() );
+
+        // Upwards first, then down, so that the sends and receives pair off
+        // along the line of processes.
+        vector< int > words;
+        if ( m_above != 0 )
+        {
+            pack ( above, words );
+            pack ( aboveEdge, words );
+            m_above->send ( words );
+            m_above->receive ( words );
+            unpack ( words, unpack ( words, 0, m_held ), m_ghosts );
+        }
+        if ( m_below != 0 )
+        {
+            m_below->receive ( words );
+            unpack ( words, unpack ( words, 0, m_held ), m_ghosts );
+            words.clear();
+            pack ( below, words );
+            pack ( belowEdge, words );
+            m_below->send ( words );
+        }
+    }
+}
+
+void Fleet::settle()
+{
+    if ( ! m_stepping )
+    {
+        return;
+    }
+    m_stepping = false;
+
+    // Only the robots the steps have changed need to go anywhere, everyone
+    // having started out alike.
+    vector< Mover > changed;
+    for ( vector< Mover >::const_iterator iter = m_held.begin();
+          iter != m_held.end(); ++iter
+        )
+    {
+        Robot * robot = RobotFactory::singleton()->robot ( iter->id );
+        if ( robot->xpos() != iter->xpos || robot->ypos() != iter->ypos ||
+             robot->direction() != iter->direction
+           )
+        {
+            changed.push_back ( *iter );
+        }
+    }
+    m_held.clear();
+    m_ghosts.clear();
+    gather ( changed );
+
+    // Put everyone where they've got to. Robots changing cell all come off
+    // the table first, so nobody's put where somebody else still is.
+    vector< pair< unsigned, size_t > > order;
+    for ( size_t inx = 0; inx < changed.size(); ++inx )
+    {
+        order.push_back ( make_pair ( changed[inx].id, inx ) );
+    }
+    sort ( order.begin(), order.end(), byMoverId );
+    vector< const Mover* > moving;
+    for ( vector< pair< unsigned, size_t > >::const_iterator iter = order.begin();
+          iter != order.end(); ++iter
+        )
+    {
+        const Mover & mover = changed[iter->second];
+        Robot * robot = RobotFactory::singleton()->robot ( mover.id );
+        if ( robot->xpos() != mover.xpos || robot->ypos() != mover.ypos )
+        {
+            robot->relocate ( robot->xpos(), robot->ypos(), robot->direction(), false, true );
+            moving.push_back ( &mover );
+        }
+        else
+        {
+            robot->relocate ( mover.xpos, mover.ypos, mover.direction, true );
+        }
+    }
+    for ( vector< const Mover* >::const_iterator iter = moving.begin();
+          iter != moving.end(); ++iter
+        )
+    {
+        RobotFactory::singleton()->robot ( ( *iter )->id )->relocate ( ( *iter )->xpos, ( *iter )->ypos, ( *iter )->direction, true );
+    }
+}
+
+// Everyone's changed robots to everyone: up the line to the first strip,
+// and back.
+void Fleet::gather ( vector< Mover > & movers )
+{
+    vector< int > words;
+    if ( m_above != 0 )
+    {
+        m_above->receive ( words );
+        unpack ( words, 0, movers );
+    }
+    if ( m_below != 0 )
+    {
+        words.clear();
+        pack ( movers, words );
+        m_below->send ( words );
+        m_below->receive ( words );
+        movers.clear();
+        unpack ( words, 0, movers );
+    }
+    if ( m_above != 0 )
+    {
+        words.clear();
+        pack ( movers, words );
+        m_above->send ( words );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Replication::Replication()
+  : m_link ( 0 ),
+    m_batchSize ( 1 ),
+    m_sender ( 0 ),
+    m_lines ( 0 ),
+    m_finishing ( false ),
+    m_lost ( false ),
+    m_lossReported ( false )
+{
+}
+
+Replication * Replication::singleton()
+{
+    static Replication * replication = 0;
+    if ( replication == 0 )
+    {
+        replication = new Replication;
+    }
+    return replication;
+}
+
+void Replication::lead ( const string & address, size_t batchSize )
+{
+    string host;
+    int port;
+    splitAddress ( address, host, port );
+    m_link = new SocketLink ( "the follower" );
+    m_link->connect ( host, port );
+    m_batchSize = batchSize;
+    m_sender = new thread ( send, this );
+}
+
+void Replication::follow ( int port )
+{
+    SocketLink link ( "the leader" );
+    link.listen ( port );
+    link.accept();
+
+    // The leader's already said everything there is to say.
+    streambuf * out = cout.rdbuf ( 0 );
+    streambuf * err = cerr.rdbuf ( 0 );
+    bool lost = false;
+    try
+    {
+        string batch;
+        for ( link.receive ( batch ); ! batch.empty(); link.receive ( batch ) )
+        {
+            size_t start = 0;
+            for ( size_t end = batch.find ( '\n' ); end != string::npos; end = batch.find ( '\n', start ) )
+            {
+                string commandString ( batch, start, end - start );
+                start = end + 1;
+                try
+                {
+                    if ( commandString.empty() )
+                    {
+                        Interpreter::finish();
+                    }
+                    else
+                    {
+                        Interpreter::carryOut ( CommandFactory::singleton()->createCommand ( commandString ) );
+                    }
+                }
+                catch ( ... )
+                {
+                    // As the leader found, and said, already.
+                }
+            }
+        }
+    }
+    catch ( const exception & )
+    {
+        lost = true;
+    }
+    cout.rdbuf ( out );
+    cerr.rdbuf ( err );
+    if ( lost )
+    {
+        cerr << "Lost the leader; taking over" << endl;
+    }
+}
+
+bool Replication::leading() const
+{
+    return m_link != 0;
+}
+
+bool Replication::replicated ( const Command & command ) const
+{
+    if ( m_link == 0 )
+    {
+        return false;
+    }
+    // Timed ones all go, as each moves the clock on.
+    if ( command.timed() )
+    {
+        return true;
+    }
+    string name ( command.name() );
+    if ( name == "heatmap" )
+    {
+        string setting ( lowerCaseString ( Tokeniser ( command.qualifiers(), ", " ).nextToken() ) );
+        return setting == "on" || setting == "off";
+    }
+    return name != "report" &&
+           name != "export" &&
+           name != "trace" &&
+           name != "contention" &&
+           name != "constraints" &&
+           name != "session" &&
+           name != "lanes" &&
+           name != "help" &&
+           name != "quit";
+}
+
+void Replication::log ( const string & commandString )
+{
+    if ( m_link == 0 )
+    {
+        return;
+    }
+    unique_lock< mutex > lock ( m_mutex );
+    // Rather than let the follower fall ever further behind.
+    while ( m_lines >= m_batchSize * backlogBatches && ! m_lost )
+    {
+        m_changed.wait ( lock );
+    }
+    if ( m_lost )
+    {
+        if ( ! m_lossReported )
+        {
+            m_lossReported = true;
+            lock.unlock();
+            cerr << "Lost the follower; carrying on without it" << endl;
+        }
+        return;
+    }
+    m_batch += commandString;
+    m_batch += '\n';
+    if ( ++m_lines == 1 || m_lines == m_batchSize )
+    {
+        m_changed.notify_all();
+    }
+}
+
+void Replication::finish()
+{
+    if ( m_link == 0 )
+    {
+        return;
+    }
+    {
+        lock_guard< mutex > lock ( m_mutex );
+        m_finishing = true;
+        m_changed.notify_all();
+    }
+    m_sender->join();
+    delete m_sender;
+    m_sender = 0;
+    delete m_link;
+    m_link = 0;
+    if ( m_lost && ! m_lossReported )
+    {
+        m_lossReported = true;
+        cerr << "Lost the follower; carrying on without it" << endl;
+    }
+}
+
+// A batch goes when it's full or, failing that, flushDelay after its first
+// line, and everything left goes at the finish.
+void Replication::send ( Replication * replication )
+{
+    unique_lock< mutex > lock ( replication->m_mutex );
+    for ( ;; )
+    {
+        while ( replication->m_lines == 0 && ! replication->m_finishing )
+        {
+            replication->m_changed.wait ( lock );
+        }
+        chrono::steady_clock::time_point due = chrono::steady_clock::now() + chrono::milliseconds ( flushDelay );
+        while ( replication->m_lines < replication->m_batchSize &&
+                ! replication->m_finishing &&
+                replication->m_changed.wait_until ( lock, due ) == cv_status::no_timeout
+              )
+        {
+        }
+        string batch;
+        batch.swap ( replication->m_batch );
+        replication->m_lines = 0;
+        bool last = replication->m_finishing;
+        replication->m_changed.notify_all();
+        lock.unlock();
+        try
+        {
+            if ( ! batch.empty() )
+            {
+                replication->m_link->send ( batch );
+            }
+            if ( last )
+            {
+                replication->m_link->send ( string() );
+                return;
+            }
+        }
+        catch ( const exception & )
+        {
+            lock.lock();
+            replication->m_lost = true;
+            replication->m_batch.clear();
+            replication->m_lines = 0;
+            replication->m_changed.notify_all();
+            return;
+        }
+        lock.lock();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static unsigned long long microsecondsNow()
+{
+    return chrono::duration_cast< chrono::microseconds > ( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+Server::Server()
+  : m_throttled ( 0 ),
+    m_console ( 0 ),
+    m_current ( 0 ),
+    m_nextId ( 1 ),
+    m_finished ( 0 ),
+    m_listener ( -1 ),
+    m_acceptor ( 0 ),
+    m_serving ( false ),
+    m_stopping ( false )
+{
+    m_sessionBudget.lines = 10000;
+    m_sessionBudget.bytes = 1024 * 1024;
+    m_serverBudget.lines = 100000;
+    m_serverBudget.bytes = 16 * 1024 * 1024;
+    m_queued.lines = 0;
+    m_queued.bytes = 0;
+    for ( int lane = 0; lane < Lanes; ++lane )
+    {
+        LaneState & state = m_lanes[lane];
+        state.weight = ( lane == Interactive ) ? 16 : 1;
+        state.current = 0;
+        state.sessions = 0;
+        state.queued = 0;
+        state.peakQueued = 0;
+        state.run = 0;
+        for ( int bucket = 0; bucket < waitBuckets; ++bucket )
+        {
+            state.waits[bucket] = 0;
+        }
+        state.longestWait = 0;
+    }
+}
+
+Server * Server::singleton()
+{
+    static Server * server = 0;
+    if ( server == 0 )
+    {
+        server = new Server;
+    }
+    return server;
+}
+
+void Server::setWeights ( unsigned interactive, unsigned bulk )
+{
+    if ( interactive == 0 || bulk == 0 )
+    {
+        throw exception ( "Lane weights have to be at least 1" );
+    }
+    m_lanes[Interactive].weight = interactive;
+    m_lanes[Bulk].weight = bulk;
+}
+
+void Server::setSessionBudget ( size_t lines, size_t bytes )
+{
+    if ( lines == 0 || bytes == 0 )
+    {
+        throw exception ( "Queue budgets have to be at least 1" );
+    }
+    m_sessionBudget.lines = lines;
+    m_sessionBudget.bytes = bytes;
+}
+
+void Server::setServerBudget ( size_t lines, size_t bytes )
+{
+    if ( lines == 0 || bytes == 0 )
+    {
+        throw exception ( "Queue budgets have to be at least 1" );
+    }
+    m_serverBudget.lines = lines;
+    m_serverBudget.bytes = bytes;
+}
+
+bool Server::serving() const
+{
+    return m_serving;
+}
+
+const char * Server::laneName ( Lane lane )
+{
+    return ( lane == Interactive ) ? "interactive" : "bulk";
+}
+
+void Server::serve
+(   const string & host,
+    int port,
+    const vector< string > & fileNames
+)
+{
+    SocketHandle listener = listenOn ( port, SOMAXCONN, host );
+    m_listener = listener;
+    m_serving = true;
+    {
+        lock_guard< mutex > lock ( m_mutex );
+        m_console = open ( "console", -1, Interactive );
+        m_console->writerDone = true;
+    }
+    // Not waited for at the end, as it may be waiting on a terminal.
+    thread ( readConsole, this, m_console, fileNames ).detach();
+    m_acceptor = new thread ( accept, this );
+
+    Line line;
+    for ( Session * session = next ( line ); session != 0; session = next ( line ) )
+    {
+        carryOut ( session, line );
+    }
+
+    // Closing the listener sees off the acceptor, and closing the sessions
+    // their threads, once they've sent what they have.
+    stopSocket ( listener );
+    closeSocket ( listener );
+    m_acceptor->join();
+    delete m_acceptor;
+    m_acceptor = 0;
+    m_listener = -1;
+    unique_lock< mutex > lock ( m_mutex );
+    for ( size_t inx = 0; inx < m_sessions.size(); ++inx )
+    {
+        if ( m_sessions[inx] != m_console )
+        {
+            close ( m_sessions[inx] );
+        }
+    }
+    while ( m_sessions.size() > 1 )
+    {
+        if ( m_finished > 0 )
+        {
+            reap ( lock );
+        }
+        else
+        {
+            m_work.wait ( lock );
+        }
+    }
+    m_serving = false;
+    if ( ! m_consoleError.empty() )
+    {
+        throw exception ( m_consoleError.c_str() );
+    }
+}
+
+void Server::accept ( Server * server )
+{
+    SocketHandle listener = static_cast< SocketHandle > ( server->m_listener );
+    for ( ;; )
+    {
+        sockaddr_in address;
+        SocketLength length = sizeof address;
+        SocketHandle connection = ::accept ( listener, reinterpret_cast< sockaddr* > ( &address ), &length );
+        lock_guard< mutex > lock ( server->m_mutex );
+        if ( server->m_stopping )
+        {
+            if ( connection != static_cast< SocketHandle > ( -1 ) )
+            {
+                closeSocket ( connection );
+            }
+            return;
+        }
+        if ( connection == static_cast< SocketHandle > ( -1 ) )
+        {
+            continue;
+        }
+        noDelay ( connection );
+        const unsigned char * host = reinterpret_cast< const unsigned char* > ( &address.sin_addr.s_addr );
+        stringstream peerStream;
+        peerStream << static_cast< int > ( host[0] ) << "." << static_cast< int > ( host[1] ) << "."
+                   << static_cast< int > ( host[2] ) << "." << static_cast< int > ( host[3] ) << ":"
+                   << ntohs ( address.sin_port );
+        Session * session = server->open ( peerStream.str(), connection, Bulk );
+        session->reader = new thread ( read, server, session );
+        session->writer = new thread ( write, server, session );
+    }
+}
+
+// Lines as they arrive, whole ones at a time, blank ones left out.
+void Server::read ( Server * server, Session * session )
+{
+    SocketHandle handle = static_cast< SocketHandle > ( session->socket );
+    // No more at a time than a session can have queued.
+    vector< char > buffer ( min ( server->m_sessionBudget.bytes, static_cast< size_t > ( 64 * 1024 ) ) );
+    string partial;
+    vector< Line > lines;
+    Line line;
+    line.endOfInput = false;
+    for ( ;; )
+    {
+        int received = recv ( handle, &buffer[0], static_cast< int > ( buffer.size() ), 0 );
+        if ( received <= 0 )
+        {
+            break;
+        }
+        line.queued = microsecondsNow();
+        lines.clear();
+        const char * next = &buffer[0];
+        const char * end = next + received;
+        for ( const char * newline = static_cast< const char* > ( memchr ( next, '\n', end - next ) );
+              newline != 0;
+              newline = static_cast< const char* > ( memchr ( next, '\n', end - next ) )
+            )
+        {
+            partial.append ( next, newline );
+            next = newline + 1;
+            if ( ! partial.empty() && partial[partial.size() - 1] == '\r' )
+            {
+                partial.resize ( partial.size() - 1 );
+            }
+            if ( ! partial.empty() )
+            {
+                line.text.swap ( partial );
+                lines.push_back ( line );
+            }
+            partial.clear();
+        }
+        partial.append ( next, end );
+        server->queue ( session, lines );
+    }
+    if ( ! partial.empty() )
+    {
+        line.text = partial;
+        line.queued = microsecondsNow();
+        server->queue ( session, vector< Line > ( 1, line ) );
+    }
+    server->endInput ( session );
+}
+
+// A thousand lines at a time, or fewer if that's more than a session can
+// have queued, with the end of each input after its lines.
+// An input which can't be read ends them all, as it would without a server.
+void Server::readConsole ( Server * server, Session * session, vector< string > fileNames )
+{
+    // Files are queued in batches, but stdin a line at a time, as an
+    // operator typing at it (or a program piping to it) mustn't wait for a
+    // batch to fill up.
+    size_t batch = fileNames.empty() ? 1 : min ( server->m_sessionBudget.lines, static_cast< size_t > ( 1000 ) );
+    vector< Line > lines;
+    Line line;
+    line.endOfInput = false;
+    for ( size_t inx = 0; inx < max ( fileNames.size(), static_cast< size_t > ( 1 ) ); ++inx )
+    {
+        scoped_ptr< CommandStream > stream;
+        try
+        {
+            stream = fileNames.empty() ? new CommandStream ( stdin ) : new CommandStream ( fileNames[inx].c_str() );
+        }
+        catch ( const exception & error )
+        {
+            lock_guard< mutex > lock ( server->m_mutex );
+            server->m_consoleError = error.what();
+            break;
+        }
+        for ( ;; )
+        {
+            bool more = stream->getCommand ( line.text );
+            if ( more )
+            {
+                line.queued = microsecondsNow();
+                lines.push_back ( line );
+            }
+            if ( ! more || lines.size() == batch )
+            {
+                server->queue ( session, lines );
+                lines.clear();
+            }
+            if ( ! more )
+            {
+                break;
+            }
+        }
+        line.text.clear();
+        line.queued = microsecondsNow();
+        line.endOfInput = true;
+        server->queue ( session, vector< Line > ( 1, line ) );
+        line.endOfInput = false;
+    }
+    server->endInput ( session );
+}
+
+// Replies as the executor leaves them, then, once the session's closing,
+// the socket shut so that the reader stops too.
+void Server::write ( Server * server, Session * session )
+{
+    SocketHandle handle = static_cast< SocketHandle > ( session->socket );
+    unique_lock< mutex > lock ( server->m_mutex );
+    for ( ;; )
+    {
+        while ( session->outbox.empty() && ! session->closing )
+        {
+            session->outboxChanged.wait ( lock );
+        }
+        if ( session->outbox.empty() )
+        {
+            break;
+        }
+        string reply;
+        reply.swap ( session->outbox );
+        lock.unlock();
+        bool sent = true;
+        for ( size_t done = 0; sent && done < reply.size(); )
+        {
+            int chunk = static_cast< int > ( min ( reply.size() - done, static_cast< size_t > ( 1 << 20 ) ) );
+            int count = ::send ( handle, reply.data() + done, chunk, sendFlags );
+            sent = count > 0;
+            done += sent ? count : 0;
+        }
+        lock.lock();
+        if ( ! sent )
+        {
+            server->close ( session );
+            session->outbox.clear();
+            break;
+        }
+    }
+    stopSocket ( handle );
+    session->writerDone = true;
+    server->finished ( session );
+}
+
+Server::Session * Server::open ( const string & peer, long long socket, Lane lane )
+{
+    Session * session = new Session;
+    session->id = m_nextId++;
+    session->peer = peer;
+    session->socket = socket;
+    session->lane = lane;
+    session->bytes = 0;
+    session->run = 0;
+    session->throttled = false;
+    session->throttledSince = 0;
+    session->throttledFor = 0;
+    session->listed = false;
+    session->ended = false;
+    session->closing = false;
+    session->readerDone = false;
+    session->writerDone = false;
+    session->reader = 0;
+    session->writer = 0;
+    m_sessions.push_back ( session );
+    ++m_lanes[lane].sessions;
+    return session;
+}
+
+// Held up here, not reading any more, while the session's over budget, and
+// let in no more lines at a time than there's room for. (Bytes can go over
+// by the rest of a read, which is no bigger than the session's budget.)
+void Server::queue ( Session * session, const vector< Line > & lines )
+{
+    unique_lock< mutex > lock ( m_mutex );
+    for ( size_t from = 0; from < lines.size(); )
+    {
+        if ( ! admitted ( session, false ) )
+        {
+            session->throttled = true;
+            session->throttledSince = microsecondsNow();
+            ++m_throttled;
+            while ( ! session->closing && ! admitted ( session, true ) )
+            {
+                session->roomMade.wait ( lock );
+            }
+            --m_throttled;
+            session->throttled = false;
+            session->throttledFor += microsecondsNow() - session->throttledSince;
+        }
+        if ( session->closing )
+        {
+            return;
+        }
+        // A line at least, even with the total over budget, if the session
+        // has nothing queued.
+        size_t totalRoom = ( m_queued.lines < m_serverBudget.lines ) ? m_serverBudget.lines - m_queued.lines : 1;
+        size_t room = min ( m_sessionBudget.lines - session->lines.size(), totalRoom );
+        size_t count = min ( room, lines.size() - from );
+        size_t bytes = 0;
+        for ( size_t inx = from; inx < from + count; ++inx )
+        {
+            bytes += lines[inx].text.size() + 1;
+        }
+        session->lines.insert ( session->lines.end(), lines.begin() + from, lines.begin() + from + count );
+        from += count;
+        session->bytes += bytes;
+        m_queued.lines += count;
+        m_queued.bytes += bytes;
+        LaneState & state = m_lanes[session->lane];
+        state.queued += count;
+        state.peakQueued = max ( state.peakQueued, state.queued );
+        if ( ! session->listed )
+        {
+            list ( session );
+            m_work.notify_one();
+        }
+    }
+}
+
+// Resuming, only once down to half the budget, so as not to stop and start
+// reading over and over.
+bool Server::admitted ( const Session * session, bool resuming ) const
+{
+    size_t share = resuming ? 2 : 1;
+    if ( session->lines.size() * share >= m_sessionBudget.lines ||
+         session->bytes * share >= m_sessionBudget.bytes
+       )
+    {
+        return false;
+    }
+    return session->lines.empty() ||
+           ( m_queued.lines * share < m_serverBudget.lines &&
+             m_queued.bytes * share < m_serverBudget.bytes
+           );
+}
+
+// Lines gone from the session's queue, carried out or thrown away. Whoever
+// that makes room for can start reading again.
+void Server::dequeued ( Session * session, size_t lines, size_t bytes )
+{
+    bool totalWasHigh = m_queued.lines * 2 >= m_serverBudget.lines || m_queued.bytes * 2 >= m_serverBudget.bytes;
+    session->bytes -= bytes;
+    m_queued.lines -= lines;
+    m_queued.bytes -= bytes;
+    if ( m_throttled == 0 )
+    {
+        return;
+    }
+    if ( session->throttled && admitted ( session, true ) )
+    {
+        session->roomMade.notify_one();
+    }
+    bool totalIsHigh = m_queued.lines * 2 >= m_serverBudget.lines || m_queued.bytes * 2 >= m_serverBudget.bytes;
+    if ( totalWasHigh && ! totalIsHigh )
+    {
+        for ( size_t inx = 0; inx < m_sessions.size(); ++inx )
+        {
+            if ( m_sessions[inx]->throttled && admitted ( m_sessions[inx], true ) )
+            {
+                m_sessions[inx]->roomMade.notify_one();
+            }
+        }
+    }
+}
+
+void Server::endInput ( Session * session )
+{
+    lock_guard< mutex > lock ( m_mutex );
+    session->ended = true;
+    if ( session->lines.empty() && session != m_current )
+    {
+        if ( session == m_console )
+        {
+            m_stopping = true;
+            m_work.notify_one();
+        }
+        else
+        {
+            close ( session );
+        }
+    }
+    session->readerDone = true;
+    finished ( session );
+}
+
+void Server::list ( Session * session )
+{
+    m_lanes[session->lane].ready.push_back ( session );
+    session->listed = true;
+}
+
+// Smooth weighted round robin: every lane with sessions waiting gains its
+// weight, and the one with most gained goes, losing what they all gained.
+Server::Session * Server::next ( Line & line )
+{
+    unique_lock< mutex > lock ( m_mutex );
+    for ( ;; )
+    {
+        if ( m_stopping )
+        {
+            return 0;
+        }
+        if ( m_finished > 0 )
+        {
+            reap ( lock );
+            continue;
+        }
+        LaneState * chosen = 0;
+        long long total = 0;
+        for ( int lane = 0; lane < Lanes; ++lane )
+        {
+            LaneState & state = m_lanes[lane];
+            if ( state.ready.empty() )
+            {
+                state.current = 0;
+                continue;
+            }
+            state.current += state.weight;
+            total += state.weight;
+            if ( chosen == 0 || state.current > chosen->current )
+            {
+                chosen = &state;
+            }
+        }
+        if ( chosen == 0 )
+        {
+            m_work.wait ( lock );
+            continue;
+        }
+        chosen->current -= total;
+        Session * session = chosen->ready.front();
+        chosen->ready.pop_front();
+        session->listed = false;
+        line = session->lines.front();
+        session->lines.pop_front();
+        --chosen->queued;
+        ++chosen->run;
+        ++session->run;
+        dequeued ( session, 1, line.text.size() + 1 );
+        unsigned long long wait = microsecondsNow() - line.queued;
+        int bucket = 0;
+        while ( bucket < waitBuckets - 1 && ( wait >> bucket ) != 0 )
+        {
+            ++bucket;
+        }
+        ++chosen->waits[bucket];
+        chosen->longestWait = max ( chosen->longestWait, wait );
+        // To the back, for the other sessions' turns.
+        if ( ! session->lines.empty() )
+        {
+            list ( session );
+        }
+        m_current = session;
+        return session;
+    }
+}
+
+// A client's output goes back to it rather than to cout.
+void Server::carryOut ( Session * session, const Line & line )
+{
+    bool more = true;
+    if ( line.endOfInput )
+    {
+        Interpreter::finish();
+        Replication::singleton()->log ( string() );
+    }
+    else if ( session == m_console )
+    {
+        more = Interpreter::perform ( line.text );
+        if ( ! more )
+        {
+            Interpreter::finish();
+            Replication::singleton()->log ( string() );
+        }
+    }
+    else
+    {
+        ostringstream reply;
+        streambuf * out = cout.rdbuf ( reply.rdbuf() );
+        streambuf * err = cerr.rdbuf ( reply.rdbuf() );
+        more = Interpreter::perform ( line.text, true );
+        cout.rdbuf ( out );
+        cerr.rdbuf ( err );
+        string text ( reply.str() );
+        if ( ! text.empty() )
+        {
+            lock_guard< mutex > lock ( m_mutex );
+            session->outbox += text;
+            session->outboxChanged.notify_one();
+        }
+    }
+
+    lock_guard< mutex > lock ( m_mutex );
+    m_current = 0;
+    if ( ! more || ( session->ended && session->lines.empty() ) )
+    {
+        if ( session == m_console )
+        {
+            m_stopping = true;
+        }
+        else
+        {
+            close ( session );
+        }
+    }
+}
+
+bool Server::allowed ( const Command & command )
+{
+    string name ( command.name() );
+    return name == "create" ||
+           name == "place" ||
+           name == "move" ||
+           name == "left" ||
+           name == "right" ||
+           name == "report" ||
+           name == "remove" ||
+           name == "speed" ||
+           name == "velocity" ||
+           name == "trace" ||
+           name == "contention" ||
+           name == "constraints" ||
+           name == "session" ||
+           name == "lanes" ||
+           name == "help" ||
+           name == "quit";
+}
+
+void Server::close ( Session * session )
+{
+    if ( session->closing )
+    {
+        return;
+    }
+    session->closing = true;
+    LaneState & state = m_lanes[session->lane];
+    if ( session->listed )
+    {
+        state.ready.erase ( find ( state.ready.begin(), state.ready.end(), session ) );
+        session->listed = false;
+    }
+    state.queued -= session->lines.size();
+    size_t lines = session->lines.size();
+    session->lines.clear();
+    dequeued ( session, lines, session->bytes );
+    session->outboxChanged.notify_one();
+    session->roomMade.notify_one();
+}
+
+void Server::finished ( Session * session )
+{
+    if ( session != m_console && session->readerDone && session->writerDone )
+    {
+        ++m_finished;
+        m_work.notify_one();
+    }
+}
+
+// Sees off the sessions whose threads are done, with the lock let go while
+// waiting for the threads to finish returning.
+void Server::reap ( unique_lock< mutex > & lock )
+{
+    vector< Session* > done;
+    for ( size_t inx = 0; inx < m_sessions.size(); )
+    {
+        Session * session = m_sessions[inx];
+        if ( session != m_console && session->readerDone && session->writerDone )
+        {
+            done.push_back ( session );
+            --m_lanes[session->lane].sessions;
+            m_sessions.erase ( m_sessions.begin() + inx );
+        }
+        else
+        {
+            ++inx;
+        }
+    }
+    m_finished = 0;
+    lock.unlock();
+    for ( size_t inx = 0; inx < done.size(); ++inx )
+    {
+        done[inx]->reader->join();
+        done[inx]->writer->join();
+        delete done[inx]->reader;
+        delete done[inx]->writer;
+        closeSocket ( static_cast< SocketHandle > ( done[inx]->socket ) );
+        delete done[inx];
+    }
+    lock.lock();
+}
+
+void Server::session ( const string & qualifiers )
+{
+    if ( ! m_serving )
+    {
+        throw exception ( "Not in server mode" );
+    }
+    Tokeniser tokeniser ( qualifiers, ", " );
+    string token ( tokeniser.nextToken() );
+    string idToken;
+    if ( ! token.empty() && token.find_first_not_of ( "0123456789" ) == string::npos )
+    {
+        idToken = token;
+        token = tokeniser.nextToken();
+    }
+    string laneToken ( lowerCaseString ( token ) );
+    if ( laneToken != "interactive" && laneToken != "bulk" )
+    {
+        throw exception ( ( "session expects interactive or bulk, not " + laneToken ).c_str() );
+    }
+    Lane lane = ( laneToken == "interactive" ) ? Interactive : Bulk;
+    lock_guard< mutex > lock ( m_mutex );
+    // The operator, at the console, says which sessions are interactive;
+    // a client can only stand down to bulk.
+    Session * session = m_current;
+    if ( session != m_console && ( ! idToken.empty() || lane == Interactive ) )
+    {
+        throw exception ( "Only the console can move a session into the interactive lane or move another session" );
+    }
+    if ( ! idToken.empty() )
+    {
+        unsigned id = static_cast< unsigned > ( strtoul ( idToken.c_str(), 0, 10 ) );
+        session = 0;
+        for ( size_t inx = 0; inx < m_sessions.size(); ++inx )
+        {
+            if ( m_sessions[inx]->id == id && ! m_sessions[inx]->closing )
+            {
+                session = m_sessions[inx];
+            }
+        }
+        if ( session == 0 )
+        {
+            throw exception ( ( "No such session " + idToken ).c_str() );
+        }
+    }
+    if ( session->lane == lane )
+    {
+        return;
+    }
+    LaneState & from = m_lanes[session->lane];
+    LaneState & to = m_lanes[lane];
+    if ( session->listed )
+    {
+        from.ready.erase ( find ( from.ready.begin(), from.ready.end(), session ) );
+        to.ready.push_back ( session );
+    }
+    from.queued -= session->lines.size();
+    to.queued += session->lines.size();
+    to.peakQueued = max ( to.peakQueued, to.queued );
+    --from.sessions;
+    ++to.sessions;
+    session->lane = lane;
+}
+
+void Server::report ( ostream & stream ) const
+{
+    if ( ! m_serving )
+    {
+        throw exception ( "Not in server mode" );
+    }
+    lock_guard< mutex > lock ( m_mutex );
+    for ( int lane = 0; lane < Lanes; ++lane )
+    {
+        const LaneState & state = m_lanes[lane];
+        stream << "Lane " << laneName ( static_cast< Lane > ( lane ) ) << ": weight " << state.weight << ", "
+               << state.sessions << ( state.sessions == 1 ? " session, " : " sessions, " )
+               << state.queued << " queued (at most " << state.peakQueued << "), " << state.run << " run";
+        if ( state.run > 0 )
+        {
+            // The bucket holding the 99th percentile, as its upper bound.
+            unsigned long long below = 0;
+            int bucket = 0;
+            for ( ; bucket < waitBuckets - 1; ++bucket )
+            {
+                below += state.waits[bucket];
+                if ( below * 100 >= state.run * 99 )
+                {
+                    break;
+                }
+            }
+            stream << ", waited at most " << state.longestWait << "us, 99% under "
+                   << ( 1ULL << bucket ) << "us";
+        }
+        stream << endl;
+    }
+    stream << "Queued in all: " << m_queued.lines << " lines of " << m_serverBudget.lines << ", "
+           << m_queued.bytes << " bytes of " << m_serverBudget.bytes << endl;
+    for ( size_t inx = 0; inx < m_sessions.size(); ++inx )
+    {
+        const Session & session = *m_sessions[inx];
+        unsigned long long throttledFor = session.throttledFor;
+        if ( session.throttled )
+        {
+            throttledFor += microsecondsNow() - session.throttledSince;
+        }
+        stream << "Session " << session.id << " (" << session.peer << "): " << laneName ( session.lane ) << ", "
+               << session.lines.size() << " lines of " << m_sessionBudget.lines << " queued, "
+               << session.bytes << " bytes of " << m_sessionBudget.bytes << ", " << session.run << " run, "
+               << ( session.throttled ? "held up" : "was held up" ) << " for " << throttledFor / 1000 << "ms" << endl;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+CellGrid::CellGrid ( int xmin, int ymin, int xmax, int ymax )
+  : m_xmin ( xmin ),
+    m_ymin ( ymin ),
+    m_xmax ( xmax ),
+    m_ymax ( ymax ),
+    m_cells ( new atomic< unsigned > [ size_t ( xmax - xmin ) * size_t ( ymax - ymin ) ] )
+{
+    for ( size_t inx = 0; inx < size_t ( xmax - xmin ) * size_t ( ymax - ymin ); ++inx )
+    {
+        m_cells[inx].store ( 0, memory_order_relaxed );
+    }
+}
+
+CellGrid::~CellGrid()
+{
+    delete [] m_cells;
+}
+
+bool CellGrid::contains ( int xpos, int ypos ) const
+{
+    return m_xmin <= xpos && xpos < m_xmax &&
+           m_ymin <= ypos && ypos < m_ymax;
+}
+
+atomic< unsigned > & CellGrid::cell ( int xpos, int ypos ) const
+{
+    return m_cells[ size_t ( ypos - m_ymin ) * size_t ( m_xmax - m_xmin ) + size_t ( xpos - m_xmin ) ];
+}
+
+// Having it already counts.
+bool CellGrid::claim ( int xpos, int ypos, unsigned robotId )
+{
+    if ( ! contains ( xpos, ypos ) )
+    {
+        return false;
+    }
+    unsigned expected = 0;
+    return cell ( xpos, ypos ).compare_exchange_strong ( expected, robotId + 1, memory_order_acq_rel ) ||
+           expected == robotId + 1;
+}
+
+// Only if it's the given robot's to give up.
+void CellGrid::release ( int xpos, int ypos, unsigned robotId )
+{
+    if ( contains ( xpos, ypos ) )
+    {
+        unsigned expected = robotId + 1;
+        cell ( xpos, ypos ).compare_exchange_strong ( expected, 0, memory_order_acq_rel );
+    }
+}
+
+// The id of the robot in the cell, or one which is nobody's.
+unsigned CellGrid::occupant ( int xpos, int ypos ) const
+{
+    if ( ! contains ( xpos, ypos ) )
+    {
+        return ~0u;
+    }
+    return cell ( xpos, ypos ).load ( memory_order_acquire ) - 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// No endl: the line is the caller's to end (and flush, or not).
+void reportState ( ostream & stream, const RobotState & state, bool continuous )
+{
+    string line;
+    appendReport ( line, state, continuous );
+    stream << line;
+}
+
+// Integers to text by hand, as streams are slow about it and this is what
+// reporting on a big fleet spends its time doing.
+static void appendInt ( string & buffer, int value )
+{
+    char digits[12];
+    char * start = digits + sizeof digits;
+    unsigned magnitude = value < 0 ? 0u - unsigned ( value ) : unsigned ( value );
+    do
+    {
+        *--start = char ( '0' + magnitude % 10 );
+        magnitude /= 10;
+    } while ( magnitude != 0 );
+    if ( value < 0 )
+    {
+        *--start = '-';
+    }
+    buffer.append ( start, digits + sizeof digits );
+}
+
+// As a stream would do it by default.
+static void appendDouble ( string & buffer, double value )
+{
+    char text[32];
+    snprintf ( text, sizeof text, "%g", value );
+    buffer.append ( text );
+}
+
+void appendReport ( string & buffer, const RobotState & state, bool continuous )
+{
+    buffer.append ( "Robot " );
+    buffer.append ( state.name );
+    if ( state.onTable && continuous )
+    {
+        buffer.append ( " is at x = " );
+        appendDouble ( buffer, state.fxpos );
+        buffer.append ( ", y = " );
+        appendDouble ( buffer, state.fypos );
+        buffer.append ( ", facing " );
+        buffer.append ( directionName ( state.direction ) );
+        buffer.append ( ", moving at ( " );
+        appendDouble ( buffer, state.xvelocity );
+        buffer.append ( ", " );
+        appendDouble ( buffer, state.yvelocity );
+        buffer.append ( " )" );
+    }
+    else if ( state.onTable )
+    {
+        buffer.append ( " is at x = " );
+        appendInt ( buffer, state.xpos );
+        buffer.append ( ", y = " );
+        appendInt ( buffer, state.ypos );
+        buffer.append ( ", facing " );
+        buffer.append ( directionName ( state.direction ) );
+    }
+    else
+    {
+        buffer.append ( " is not on the table" );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+WorkerPool::WorkerPool()
+  : m_generation ( 0 ),
+    m_task ( 0 ),
+    m_context ( 0 ),
+    m_count ( 0 ),
+    m_next ( 0 ),
+    m_unfinished ( 0 )
+{
+    unsigned threads = thread::hardware_concurrency();
+    for ( unsigned inx = 1; inx < threads; ++inx )
+    {
+        m_threads.push_back ( new thread ( work, this ) );
+    }
+}
+
+// Initialised the thread-safe way, as threads besides the executor use it.
+WorkerPool * WorkerPool::singleton()
+{
+    static WorkerPool * pool = new WorkerPool;
+    return pool;
+}
+
+size_t WorkerPool::size() const
+{
+    return m_threads.size() + 1;
+}
+
+void WorkerPool::run ( size_t count, WorkerTask task, void * context )
+{
+    lock_guard< mutex > runLock ( m_runMutex );
+    if ( count == 1 || m_threads.empty() )
+    {
+        for ( size_t inx = 0; inx < count; ++inx )
+        {
+            task ( inx, context );
+        }
+        return;
+    }
+    {
+        lock_guard< mutex > lock ( m_mutex );
+        m_task = task;
+        m_context = context;
+        m_count = count;
+        m_next = 0;
+        m_unfinished = count;
+        ++m_generation;
+    }
+    m_started.notify_all();
+    runTasks();
+    unique_lock< mutex > lock ( m_mutex );
+    while ( m_unfinished != 0 )
+    {
+        m_finished.wait ( lock );
+    }
+}
+
+// Wait for a run to start, and help with it.
+void WorkerPool::work ( WorkerPool * pool )
+{
+    unsigned long generation = 0;
+    for ( ;; )
+    {
+        {
+            unique_lock< mutex > lock ( pool->m_mutex );
+            while ( pool->m_generation == generation )
+            {
+                pool->m_started.wait ( lock );
+            }
+            generation = pool->m_generation;
+        }
+        pool->runTasks();
+    }
+}
+
+// Take tasks until there are none left.
+void WorkerPool::runTasks()
+{
+    unique_lock< mutex > lock ( m_mutex );
+    while ( m_next < m_count )
+    {
+        size_t task = m_next++;
+        WorkerTask function = m_task;
+        void * context = m_context;
+        lock.unlock();
+        function ( task, context );
+        lock.lock();
+        if ( --m_unfinished == 0 )
+        {
+            m_finished.notify_all();
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+ReportWriter::ReportWriter()
+  : m_collecting ( false ),
+    m_continuous ( false ),
+    m_chunkSize ( 0 )
+{
+}
+
+ReportWriter * ReportWriter::singleton()
+{
+    static ReportWriter * writer = 0;
+    if ( writer == 0 )
+    {
+        writer = new ReportWriter;
+    }
+    return writer;
+}
+
+void ReportWriter::collect()
+{
+    m_collecting = true;
+}
+
+bool ReportWriter::collecting() const
+{
+    return m_collecting;
+}
+
+void ReportWriter::add ( const Robot * robot )
+{
+    Entry entry = { robot, 0 };
+    m_entries.push_back ( entry );
+}
+
+void ReportWriter::add ( const string & line )
+{
+    Entry entry = { 0, m_lines.size() };
+    m_entries.push_back ( entry );
+    m_lines.push_back ( line );
+}
+
+// Too few lines and it's not worth waking the workers for.
+void ReportWriter::flush()
+{
+    static const size_t minimumChunkSize = 1024;
+    m_collecting = false;
+    if ( m_entries.empty() )
+    {
+        return;
+    }
+    m_continuous = ContinuousWorld::singleton()->enabled();
+    size_t chunks = min ( WorkerPool::singleton()->size(),
+                          ( m_entries.size() + minimumChunkSize - 1 ) / minimumChunkSize );
+    m_chunkSize = ( m_entries.size() + chunks - 1 ) / chunks;
+    if ( m_buffers.size() < chunks )
+    {
+        m_buffers.resize ( chunks );
+    }
+    WorkerPool::singleton()->run ( chunks, format, this );
+    for ( size_t chunk = 0; chunk < chunks; ++chunk )
+    {
+        cout << m_buffers[chunk];
+    }
+    cout.flush();
+    m_entries.clear();
+    m_lines.clear();
+}
+
+void ReportWriter::format ( size_t chunk, void * context )
+{
+    ReportWriter * writer = static_cast< ReportWriter * > ( context );
+    string & buffer = writer->m_buffers[chunk];
+    buffer.clear();
+    RobotState state;
+    size_t end = min ( writer->m_entries.size(), ( chunk + 1 ) * writer->m_chunkSize );
+    for ( size_t inx = chunk * writer->m_chunkSize; inx < end; ++inx )
+    {
+        const Entry & entry = writer->m_entries[inx];
+        if ( entry.robot != 0 )
+        {
+            entry.robot->state ( state );
+            appendReport ( buffer, state, writer->m_continuous );
+        }
+        else
+        {
+            buffer.append ( writer->m_lines[entry.line] );
+        }
+        buffer.push_back ( '\n' );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Snapshot::Snapshot()
+  : m_version ( 0 ),
+    m_continuous ( false ),
+    m_pins ( 0 )
+{
+}
+
+unsigned long Snapshot::version() const
+{
+    return m_version;
+}
+
+bool Snapshot::continuous() const
+{
+    return m_continuous;
+}
+
+const vector< RobotState > & Snapshot::robots() const
+{
+    return m_robots;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Snapshots::Snapshots()
+  : m_current ( 0 ),
+    m_version ( 0 ),
+    m_stale ( true ),
+    m_floor ( 0 )
+{
+}
+
+Snapshots * Snapshots::singleton()
+{
+    static Snapshots * snapshots = 0;
+    if ( snapshots == 0 )
+    {
+        snapshots = new Snapshots;
+    }
+    return snapshots;
+}
+
+void Snapshots::publish()
+{
+    m_stale = true;
+    publish ( vector< unsigned >() );
+}
+
+void Snapshots::invalidate()
+{
+    m_stale = true;
+}
+
+// Fill in a spare Snapshot without holding the lock, since no reader can
+// see it until it's swapped in. A spare is behind by whatever has been
+// published since it was, which is replayed from m_changes; once those
+// would cost more than a fresh copy, the oldest are dropped and anything
+// that far behind gets a full copy instead.
+void Snapshots::publish ( const vector< unsigned > & changed )
+{
+    Snapshot * snapshot = 0;
+    {
+        lock_guard< mutex > lock ( m_mutex );
+        if ( ! m_spare.empty() )
+        {
+            snapshot = m_spare.back();
+            m_spare.pop_back();
+        }
+    }
+    if ( snapshot == 0 )
+    {
+        snapshot = new Snapshot;
+    }
+
+    unsigned long version = ++m_version;
+    if ( m_stale || snapshot->m_version < m_floor )
+    {
+        copyAll ( snapshot );
+        m_changes.clear();
+        m_floor = version;
+        m_stale = false;
+    }
+    else
+    {
+        vector< pair< unsigned long, unsigned > >::const_iterator iter =
+            upper_bound
+            (   m_changes.begin(),
+                m_changes.end(),
+                make_pair ( snapshot->m_version, UINT_MAX )
+            );
+        for ( ; iter != m_changes.end(); ++iter )
+        {
+            copy ( snapshot, iter->second );
+        }
+        for ( vector< unsigned >::const_iterator iter = changed.begin();
+              iter != changed.end(); ++iter
+            )
+        {
+            copy ( snapshot, *iter );
+            m_changes.push_back ( make_pair ( version, *iter ) );
+        }
+        size_t most = max ( m_slots.size(), size_t ( 1024 ) );
+        if ( m_changes.size() > most )
+        {
+            size_t drop = m_changes.size() - most / 2;
+            m_floor = m_changes[drop - 1].first;
+            m_changes.erase ( m_changes.begin(), m_changes.begin() + drop );
+        }
+    }
+    snapshot->m_continuous = ContinuousWorld::singleton()->enabled();
+    snapshot->m_version = version;
+
+    lock_guard< mutex > lock ( m_mutex );
+    Snapshot * previous = m_current;
+    m_current = snapshot;
+    if ( previous != 0 && previous->m_pins == 0 )
+    {
+        m_spare.push_back ( previous );
+    }
+}
+
+void Snapshots::copyAll ( Snapshot * snapshot )
+{
+    const vector< Robot* > & robots = RobotFactory::singleton()->robots();
+    m_slots.assign ( robots.size(), 0 );
+    size_t count = 0;
+    for ( vector< Robot* >::const_iterator iter = robots.begin();
+          iter != robots.end(); ++iter
+        )
+    {
+        if ( *iter != 0 )
+        {
+            if ( count == snapshot->m_robots.size() )
+            {
+                snapshot->m_robots.push_back ( RobotState() );
+            }
+            m_slots[iter - robots.begin()] = count;
+            (*iter)->state ( snapshot->m_robots[count++] );
+        }
+    }
+    snapshot->m_robots.resize ( count );
+}
+
+void Snapshots::copy ( Snapshot * snapshot, unsigned robotId )
+{
+    Robot * robot = RobotFactory::singleton()->robot ( robotId );
+    if ( robot != 0 && robotId < m_slots.size() )
+    {
+        robot->state ( snapshot->m_robots[m_slots[robotId]] );
+    }
+}
+
+const Snapshot * Snapshots::pin()
+{
+    lock_guard< mutex > lock ( m_mutex );
+    if ( m_current != 0 )
+    {
+        ++m_current->m_pins;
+    }
+    return m_current;
+}
+
+void Snapshots::unpin ( const Snapshot * snapshot )
+{
+    lock_guard< mutex > lock ( m_mutex );
+    Snapshot * pinned = const_cast< Snapshot * > ( snapshot );
+    if ( --pinned->m_pins == 0 && pinned != m_current )
+    {
+        m_spare.push_back ( pinned );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+ParallelParser::ParallelParser ( CommandStream & stream, bool checkArguments )
+  : m_stream ( stream ),
+    m_checkArguments ( checkArguments ),
+    m_lines ( 0 ),
+    m_used ( 0 ),
+    m_cut ( 0 ),
+    m_atEnd ( false ),
+    m_chunks ( WorkerPool::singleton()->size() ),
+    m_chunkCount ( 0 )
+{
+}
+
+// Read until there's a window's worth ending in a newline (or there's no
+// more to read), and share it out. Whatever's after the last newline is
+// kept for the next window.
+bool ParallelParser::parseWindow()
+{
+    m_used -= m_cut;
+    memmove ( m_buffer.data(), m_buffer.data() + m_cut, m_used );
+    m_cut = 0;
+    while ( m_cut == 0 && ! ( m_atEnd && m_used == 0 ) )
+    {
+        if ( ! m_atEnd )
+        {
+            m_buffer.resize ( m_used + windowSize );
+            size_t got = m_stream.read ( m_buffer.data() + m_used, windowSize );
+            m_used += got;
+            m_atEnd = ( got == 0 );
+        }
+        if ( m_atEnd )
+        {
+            m_cut = m_used;
+        }
+        else
+        {
+            for ( size_t inx = m_used; inx > 0; --inx )
+            {
+                if ( m_buffer[inx-1] == '\n' )
+                {
+                    m_cut = inx;
+                    break;
+                }
+            }
+        }
+    }
+    if ( m_cut == 0 )
+    {
+        return false;
+    }
+
+    // Chunks of about the same size, each moved on to just after a newline.
+    size_t start = 0;
+    m_chunkCount = 0;
+    for ( size_t chunk = 0; chunk < m_chunks.size() && start < m_cut; ++chunk )
+    {
+        size_t end = ( chunk + 1 == m_chunks.size() ) ?
+                     m_cut : max ( start, m_cut / m_chunks.size() * ( chunk + 1 ) );
+        while ( end < m_cut && ( end == 0 || m_buffer[end-1] != '\n' ) )
+        {
+            ++end;
+        }
+        m_chunks[chunk].start = start;
+        m_chunks[chunk].end = end;
+        ++m_chunkCount;
+        start = end;
+    }
+    WorkerPool::singleton()->run ( m_chunkCount, parse, this );
+
+    // Each chunk counted its lines from 1; now where it starts is known.
+    for ( size_t chunk = 0; chunk < m_chunkCount; ++chunk )
+    {
+        Chunk & work = m_chunks[chunk];
+        for ( size_t inx = 0; inx < work.size; ++inx )
+        {
+            work.commands[inx].line += m_lines;
+        }
+        m_lines += work.lines;
+    }
+    return true;
+}
+
+size_t ParallelParser::chunks() const
+{
+    return m_chunkCount;
+}
+
+size_t ParallelParser::size ( size_t chunk ) const
+{
+    return m_chunks[chunk].size;
+}
+
+const SymbolicCommand & ParallelParser::command ( size_t chunk, size_t inx ) const
+{
+    return m_chunks[chunk].commands[inx];
+}
+
+// Blank lines are skipped, and carriage returns before newlines dropped.
+void ParallelParser::parse ( size_t chunk, void * context )
+{
+    ParallelParser * parser = static_cast< ParallelParser * > ( context );
+    Chunk & work = parser->m_chunks[chunk];
+    const char * text = parser->m_buffer.data();
+    const char * end = text + work.end;
+    string line;
+    work.size = 0;
+    work.lines = 0;
+    for ( const char * start = text + work.start; start < end; )
+    {
+        ++work.lines;
+        const char * lineEnd = Scanner::find ( start, end, '\n' );
+        line.assign ( start, lineEnd );
+        start = ( lineEnd == end ) ? end : lineEnd + 1;
+        if ( ! line.empty() && line[line.length()-1] == '\r' )
+        {
+            line.resize ( line.length()-1 );
+        }
+        if ( line.empty() )
+        {
+            continue;
+        }
+        if ( work.size == work.commands.size() )
+        {
+            work.commands.push_back ( SymbolicCommand() );
+        }
+        SymbolicCommand & parsed = work.commands[work.size++];
+        CommandFactory::singleton()->parseCommand ( line, parsed );
+        parsed.line = work.lines;
+        if ( parser->m_checkArguments )
+        {
+            CommandFactory::singleton()->checkArguments ( parsed );
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Starting with the robots there are already.
+Checker::Checker()
+  : m_transactionOpen ( false )
+{
+    const vector< Robot* > & robots ( RobotFactory::singleton()->robots() );
+    for ( vector< Robot* >::const_iterator iter = robots.begin();
+          iter != robots.end(); ++iter
+        )
+    {
+        if ( *iter != 0 )
+        {
+            m_robots.insert ( (*iter)->name() );
+        }
+    }
+}
+
+size_t Checker::check ( CommandStream & stream, const string & source )
+{
+    size_t errors = 0;
+    ParallelParser parser ( stream, true );
+    while ( parser.parseWindow() )
+    {
+        for ( size_t chunk = 0; chunk < parser.chunks(); ++chunk )
+        {
+            for ( size_t inx = 0; inx < parser.size ( chunk ); ++inx )
+            {
+                const SymbolicCommand & parsed = parser.command ( chunk, inx );
+                try
+                {
+                    if ( ! checkCommand ( parsed ) )
+                    {
+                        return errors;
+                    }
+                }
+                catch ( const exception & error )
+                {
+                    cerr << source << ":" << parsed.line << ": " << error.what() << endl;
+                    ++errors;
+                }
+            }
+        }
+    }
+    return errors;
+}
+
+// In the order Interpreter::execute and the rest would find out.
+bool Checker::checkCommand ( const SymbolicCommand & parsed )
+{
+    if ( ! parsed.error.empty() )
+    {
+        throw exception ( parsed.error.c_str() );
+    }
+    if ( parsed.targeted &&
+         ! CommandFactory::isSelector ( parsed.target ) &&
+         m_robots.count ( parsed.target ) == 0 &&
+         m_groups.count ( parsed.target ) == 0
+       )
+    {
+        throw exception ( ( "Invalid command: " + lowerCaseString ( parsed.target + ":" ) ).c_str() );
+    }
+    if ( ! parsed.validVerb )
+    {
+        throw exception ( ( "Invalid command: " + parsed.verb ).c_str() );
+    }
+    if ( ! parsed.argumentError.empty() )
+    {
+        throw exception ( parsed.argumentError.c_str() );
+    }
+
+    const string & verb ( parsed.verb );
+    if ( verb == "create" )
+    {
+        string robotName;
+        istringstream parser ( parsed.qualifiers );
+        parser >> robotName;
+        if ( m_robots.count ( robotName ) != 0 )
+        {
+            throw exception ( ( "Robot " + robotName + " already exists" ).c_str() );
+        }
+        if ( m_groups.count ( robotName ) != 0 )
+        {
+            throw exception ( ( "There is already a group called " + robotName ).c_str() );
+        }
+        if ( CommandFactory::isSelector ( robotName ) )
+        {
+            throw exception ( ( "Robot name " + robotName + " cannot contain * or ?" ).c_str() );
+        }
+        m_robots.insert ( robotName );
+    }
+    else if ( verb == "room" )
+    {
+        Tokeniser tokeniser ( parsed.qualifiers, ", " );
+        string name ( tokeniser.nextToken() );
+        string token ( lowerCaseString ( tokeniser.nextToken() ) );
+        if ( name.empty() )
+        {
+            throw exception ( "room needs a room name" );
+        }
+        if ( token != "portal" && token != "place" )
+        {
+            if ( ! m_rooms.insert ( name ).second )
+            {
+                throw exception ( ( "Room " + name + " already exists" ).c_str() );
+            }
+        }
+        else if ( m_rooms.count ( name ) == 0 )
+        {
+            throw exception ( ( "No such room " + name ).c_str() );
+        }
+        else if ( token == "place" )
+        {
+            string robotName ( tokeniser.nextToken() );
+            if ( m_robots.count ( robotName ) == 0 )
+            {
+                throw exception ( ( "No such robot " + robotName ).c_str() );
+            }
+        }
+        else
+        {
+            tokeniser.nextToken();
+            tokeniser.nextToken();
+            string toName ( tokeniser.nextToken() );
+            if ( m_rooms.count ( toName ) == 0 )
+            {
+                throw exception ( ( "No such room " + toName ).c_str() );
+            }
+        }
+    }
+    else if ( verb == "trace" )
+    {
+        string robotName ( Tokeniser ( parsed.qualifiers, ", " ).nextToken() );
+        if ( m_robots.count ( robotName ) == 0 )
+        {
+            throw exception ( ( "No such robot " + robotName ).c_str() );
+        }
+    }
+    else if ( verb == "destroy" )
+    {
+        string robotName;
+        istringstream parser ( parsed.qualifiers );
+        parser >> robotName;
+        if ( m_robots.count ( robotName ) == 0 )
+        {
+            throw exception ( ( "No such robot " + robotName ).c_str() );
+        }
+        if ( m_transactionOpen )
+        {
+            throw exception ( "Robots cannot be destroyed during a transaction" );
+        }
+        m_robots.erase ( robotName );
+    }
+    else if ( verb == "group" || verb == "ungroup" )
+    {
+        Tokeniser tokeniser ( parsed.qualifiers, ", " );
+        string groupName ( tokeniser.nextToken() );
+        string robotName ( tokeniser.nextToken() );
+        if ( verb == "group" )
+        {
+            if ( m_groups.count ( groupName ) == 0 && m_robots.count ( groupName ) != 0 )
+            {
+                throw exception ( ( "There is already a robot called " + groupName ).c_str() );
+            }
+            m_groups.insert ( groupName );
+        }
+        else if ( m_groups.count ( groupName ) == 0 )
+        {
+            throw exception ( ( "No such group " + groupName ).c_str() );
+        }
+        else if ( robotName.empty() )
+        {
+            m_groups.erase ( groupName );
+        }
+        for ( ; ! robotName.empty(); robotName = tokeniser.nextToken() )
+        {
+            if ( m_robots.count ( robotName ) == 0 )
+            {
+                throw exception ( ( "Unknown robot " + robotName ).c_str() );
+            }
+        }
+    }
+    else if ( verb == "begin" )
+    {
+        if ( m_transactionOpen )
+        {
+            throw exception ( "A transaction is already open" );
+        }
+        m_transactionOpen = true;
+    }
+    else if ( verb == "commit" || verb == "abort" )
+    {
+        if ( ! m_transactionOpen )
+        {
+            throw exception ( "No transaction is open" );
+        }
+        m_transactionOpen = false;
+    }
+    else if ( verb == "quit" )
+    {
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+AsyncOutput::AsyncOutput ( size_t memoryCap, bool dropWhenFull )
+  : m_dropWhenFull ( dropWhenFull ),
+    m_maxBlocks ( max ( size_t ( 2 ), memoryCap / sizeof ( Block ) ) ),
+    m_blocks ( 1 ),
+    m_current ( new Block ),
+    m_full ( m_maxBlocks ),
+    m_free ( m_maxBlocks ),
+    m_dropped ( 0 ),
+    m_stopping ( false ),
+    m_coutBuffer ( *this, stdout ),
+    m_cerrBuffer ( *this, stderr ),
+    m_oldCoutBuffer ( 0 ),
+    m_oldCerrBuffer ( 0 ),
+    m_writer ( 0 )
+{
+    m_current->target = stdout;
+    m_current->size = 0;
+    cout.flush();
+    m_writer = new thread ( drain, this );
+    m_oldCoutBuffer = cout.rdbuf ( &m_coutBuffer );
+    m_oldCerrBuffer = cerr.rdbuf ( &m_cerrBuffer );
+}
+
+AsyncOutput::~AsyncOutput()
+{
+    cout.rdbuf ( m_oldCoutBuffer );
+    cerr.rdbuf ( m_oldCerrBuffer );
+    m_dropWhenFull = false;     // the last of it at least
+    handOver ( true );
+    m_stopping = true;
+    m_wake.notify_one();
+    m_writer->join();
+    delete m_writer;
+    delete m_current;
+    for ( Block * block = m_free.pop(); block != 0; block = m_free.pop() )
+    {
+        delete block;
+    }
+    if ( m_dropped != 0 )
+    {
+        cerr << "Dropped " << m_dropped << " bytes of output" << endl;
+    }
+}
+
+unsigned long long AsyncOutput::dropped() const
+{
+    return m_dropped;
+}
+
+void AsyncOutput::write ( FILE * target, const char * data, size_t size )
+{
+    if ( m_current->target != target )
+    {
+        handOver ( true );
+        m_current->target = target;
+    }
+    while ( size != 0 )
+    {
+        if ( m_current->size == blockSize )
+        {
+            handOver ( true );
+        }
+        size_t part = min ( size, blockSize - m_current->size );
+        memcpy ( m_current->data + m_current->size, data, part );
+        m_current->size += part;
+        data += part;
+        size -= part;
+    }
+}
+
+// Pass the current block to the writer and start another, if there's one
+// free or room for one. If not, wait for one or throw the current block's
+// contents away. Unless always, only if the writer has caught up.
+void AsyncOutput::handOver ( bool always )
+{
+    if ( m_current->size == 0 || ( ! always && ! m_full.empty() ) )
+    {
+        return;
+    }
+    Block * next = m_free.pop();
+    if ( next == 0 && m_blocks < m_maxBlocks )
+    {
+        next = new Block;
+        ++m_blocks;
+    }
+    if ( next == 0 && m_dropWhenFull )
+    {
+        m_dropped += m_current->size;
+        m_current->size = 0;
+        return;
+    }
+    while ( next == 0 )
+    {
+        this_thread::yield();
+        next = m_free.pop();
+    }
+    next->target = m_current->target;
+    next->size = 0;
+    m_full.push ( m_current );
+    m_wake.notify_one();
+    m_current = next;
+}
+
+// The writer thread. When there's nothing to do it sleeps, but not for long,
+// as a wake-up can be missed (the queues being lock-free).
+void AsyncOutput::drain ( AsyncOutput * output )
+{
+    for ( ;; )
+    {
+        Block * block = output->m_full.pop();
+        if ( block == 0 )
+        {
+            if ( output->m_stopping )
+            {
+                return;
+            }
+            unique_lock< mutex > lock ( output->m_wakeMutex );
+            output->m_wake.wait_for ( lock, chrono::milliseconds ( 1 ) );
+            continue;
+        }
+        // Flushed each time, as blocks for stdout and stderr have to come
+        // out in turn.
+        fwrite ( block->data, 1, block->size, block->target );
+        fflush ( block->target );
+        output->m_free.push ( block );
+    }
+}
+
+AsyncOutput::BlockQueue::BlockQueue ( size_t capacity )
+  : m_capacity ( capacity + 1 ),
+    m_slots ( new Block* [ capacity + 1 ] ),
+    m_head ( 0 ),
+    m_tail ( 0 )
+{
+}
+
+AsyncOutput::BlockQueue::~BlockQueue()
+{
+    delete [] m_slots;
+}
+
+bool AsyncOutput::BlockQueue::push ( Block * block )
+{
+    size_t tail = m_tail.load ( memory_order_relaxed );
+    size_t next = ( tail + 1 ) % m_capacity;
+    if ( next == m_head.load ( memory_order_acquire ) )
+    {
+        return false;
+    }
+    m_slots[tail] = block;
+    m_tail.store ( next, memory_order_release );
+    return true;
+}
+
+AsyncOutput::Block * AsyncOutput::BlockQueue::pop()
+{
+    size_t head = m_head.load ( memory_order_relaxed );
+    if ( head == m_tail.load ( memory_order_acquire ) )
+    {
+        return 0;
+    }
+    Block * block = m_slots[head];
+    m_head.store ( ( head + 1 ) % m_capacity, memory_order_release );
+    return block;
+}
+
+bool AsyncOutput::BlockQueue::empty() const
+{
+    return m_head.load ( memory_order_acquire ) == m_tail.load ( memory_order_acquire );
+}
+
+AsyncOutput::Buffer::Buffer ( AsyncOutput & output, FILE * target )
+  : m_output ( output ),
+    m_target ( target )
+{
+}
+
+int AsyncOutput::Buffer::overflow ( int ch )
+{
+    if ( ch != EOF )
+    {
+        char single = char ( ch );
+        m_output.write ( m_target, &single, 1 );
+    }
+    return ch == EOF ? 0 : ch;
+}
+
+streamsize AsyncOutput::Buffer::xsputn ( const char * data, streamsize size )
+{
+    m_output.write ( m_target, data, size_t ( size ) );
+    return size;
+}
+
+int AsyncOutput::Buffer::sync()
+{
+    m_output.handOver ( false );
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Queries::Queries()
+{
+}
+
+Queries * Queries::singleton()
+{
+    static Queries * queries = 0;
+    if ( queries == 0 )
+    {
+        queries = new Queries;
+    }
+    return queries;
+}
+
+// The file is opened here, so that failing to is reported in turn, and then
+// written by a thread of its own from a Snapshot of the robots as they are.
+void Queries::exportTo ( const string & fileName )
+{
+    ofstream * stream = new ofstream ( fileName.c_str() );
+    if ( ! *stream )
+    {
+        delete stream;
+        throw exception ( ( "Cannot open " + fileName + " for export" ).c_str() );
+    }
+    reap ( false );
+    Snapshots::singleton()->publish();
+    Export * query = new Export;
+    query->written.store ( false );
+    query->writer = new thread ( write, query, stream, Snapshots::singleton()->pin() );
+    m_exports.push_back ( query );
+}
+
+void Queries::write
+(   Export * query,
+    ostream * stream,
+    const Snapshot * snapshot
+)
+{
+    const vector< RobotState > & robots = snapshot->robots();
+    for ( vector< RobotState >::const_iterator iter = robots.begin();
+          iter != robots.end(); ++iter
+        )
+    {
+        reportState ( *stream, *iter, snapshot->continuous() );
+        *stream << '\n';
+    }
+    delete stream;
+    Snapshots::singleton()->unpin ( snapshot );
+    query->written.store ( true );
+}
+
+void Queries::finish()
+{
+    reap ( true );
+}
+
+// Only the ones already written, unless all, so as not to wait here.
+void Queries::reap ( bool all )
+{
+    vector< Export* >::iterator kept = m_exports.begin();
+    for ( vector< Export* >::iterator iter = m_exports.begin();
+          iter != m_exports.end(); ++iter
+        )
+    {
+        if ( all || (*iter)->written.load() )
+        {
+            (*iter)->writer->join();
+            delete (*iter)->writer;
+            delete *iter;
+        }
+        else
+        {
+            *kept++ = *iter;
+        }
+    }
+    m_exports.erase ( kept, m_exports.end() );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Transaction::Transaction()
+  : m_open ( false )
+{
+}
+
+Transaction * Transaction::singleton()
+{
+    static Transaction * transaction = 0;
+    if ( transaction == 0 )
+    {
+        transaction = new Transaction;
+    }
+    return transaction;
+}
+
+bool Transaction::open() const
+{
+    return m_open;
+}
+
+// The commands which change where robots are or which way they face.
+bool Transaction::holdsBack ( const string & commandName )
+{
+    return commandName == "place" || commandName == "move" ||
+           commandName == "left" || commandName == "right" ||
+           commandName == "remove";
+}
+
+void Transaction::begin()
+{
+    if ( m_open )
+    {
+        throw exception ( "A transaction is already open" );
+    }
+    m_open = true;
+}
+
+void Transaction::hold ( const Command & command )
+{
+    if ( command.timed() )
+    {
+        throw exception ( "Timestamped commands cannot be part of a transaction" );
+    }
+    if ( command.name() == "place" )
+    {
+        // Check it now, rather than fail the lot later.
+        int xpos;
+        int ypos;
+        Direction direction;
+        Robot::parsePlacement ( command.qualifiers(), xpos, ypos, direction );
+    }
+    vector< Robot* > robots;
+    RobotFactory::singleton()->targets ( command, robots );
+    for ( vector< Robot* >::const_iterator iter = robots.begin();
+          iter != robots.end(); ++iter
+        )
+    {
+        string room ( Rooms::singleton()->roomOf ( ( *iter )->id() ) );
+        if ( ! room.empty() )
+        {
+            throw exception ( ( "Robot " + ( *iter )->name() + " is in room " + room +
+                                ", which transactions don't cover" ).c_str() );
+        }
+    }
+    m_commands.push_back ( new Command ( command ) );
+}
+
+void Transaction::abort()
+{
+    if ( ! m_open )
+    {
+        throw exception ( "No transaction is open" );
+    }
+    for ( vector< Command* >::iterator iter = m_commands.begin();
+          iter != m_commands.end(); ++iter
+        )
+    {
+        delete *iter;
+    }
+    m_commands.clear();
+    m_proposals.clear();
+    m_open = false;
+}
+
+void Transaction::commit()
+{
+    if ( ! m_open )
+    {
+        throw exception ( "No transaction is open" );
+    }
+
+    // Play the commands through to see where everyone ends up.
+    map< Robot*, size_t > proposed;
+    for ( vector< Command* >::iterator iter = m_commands.begin();
+          iter != m_commands.end(); ++iter
+        )
+    {
+        vector< Robot* > robots;
+        RobotFactory::singleton()->targets ( **iter, robots );
+        for ( vector< Robot* >::iterator robotIter = robots.begin();
+              robotIter != robots.end(); ++robotIter
+            )
+        {
+            propose ( *robotIter, **iter, proposed );
+        }
+    }
+
+    // Check the final positions in one pass. A cell is fine if no other
+    // robot in the transaction ends up there and whoever is there now (if
+    // anyone) is in the transaction, and so moving out or already checked.
+    Occupancy * occupancy = Occupancy::singleton();
+    map< pair< int, int >, Robot* > taken;
+    const Proposal * failed = 0;
+    for ( vector< Proposal >::const_iterator iter = m_proposals.begin();
+          iter != m_proposals.end() && failed == 0; ++iter
+        )
+    {
+        if ( ! iter->onTable )
+        {
+            continue;
+        }
+        pair< int, int > cell ( iter->xpos, iter->ypos );
+        Robot * occupant = occupancy->occupant ( iter->xpos, iter->ypos, iter->robot );
+        if ( ! taken.insert ( make_pair ( cell, iter->robot ) ).second ||
+             ( occupant != 0 && proposed.find ( occupant ) == proposed.end() ) ||
+             ! Constraint::acceptable
+                   ( iter->robot, iter->xpos, iter->ypos, iter->direction, true, occupancy )
+           )
+        {
+            failed = &*iter;
+        }
+    }
+
+    if ( failed != 0 )
+    {
+        cout << "Ignoring transaction: robot " << failed->robot->name()
+             << " cannot go to x = " << failed->xpos << ", y = " << failed->ypos << endl;
+    }
+    else
+    {
+        // Everyone out, then everyone in, so that nobody trips over anyone
+        // else's old cell.
+        for ( vector< Proposal >::const_iterator iter = m_proposals.begin();
+              iter != m_proposals.end(); ++iter
+            )
+        {
+            iter->robot->relocate ( iter->robot->xpos(), iter->robot->ypos(),
+                                    iter->robot->direction(), false, true );
+        }
+        for ( vector< Proposal >::const_iterator iter = m_proposals.begin();
+              iter != m_proposals.end(); ++iter
+            )
+        {
+            iter->robot->halt();
+            iter->robot->relocate ( iter->xpos, iter->ypos, iter->direction, iter->onTable );
+        }
+    }
+    abort();
+}
+
+// What the command would do to the robot, given what the transaction has
+// done to it so far.
+void Transaction::propose
+(   Robot * robot,
+    const Command & command,
+    map< Robot*, size_t > & proposed
+)
+{
+    map< Robot*, size_t >::iterator found = proposed.find ( robot );
+    if ( found == proposed.end() )
+    {
+        Proposal proposal =
+            { robot, robot->xpos(), robot->ypos(), robot->direction(), robot->onTable() };
+        m_proposals.push_back ( proposal );
+        found = proposed.insert ( make_pair ( robot, m_proposals.size() - 1 ) ).first;
+    }
+    Proposal & proposal = m_proposals[found->second];
+
+    const string & commandName ( command.name() );
+    if ( commandName == "place" )
+    {
+        Robot::parsePlacement ( command.qualifiers(), proposal.xpos, proposal.ypos, proposal.direction );
+        proposal.onTable = true;
+    }
+    else if ( commandName == "remove" )
+    {
+        proposal.onTable = false;
+        proposal.direction = Invalid;
+    }
+    else if ( ! proposal.onTable )
+    {
+        // As ever, nothing doing.
+    }
+    else if ( commandName == "move" )
+    {
+        Robot::step ( proposal.direction, proposal.xpos, proposal.ypos );
+    }
+    else if ( commandName == "left" )
+    {
+        proposal.direction = Robot::turnLeft ( proposal.direction );
+    }
+    else if ( commandName == "right" )
+    {
+        proposal.direction = Robot::turnRight ( proposal.direction );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Interpreter::Interpreter ( CommandStream & commandStream, bool parallelParse )
+  : m_commandStream ( commandStream ),
+    m_parallelParse ( parallelParse )
+{
+}
+
+void Interpreter::run()
+{
+    if ( m_parallelParse )
+    {
+        runParsedInParallel();
+    }
+    else
+    {
+        string commandString;
+        while ( m_commandStream.getCommand ( commandString ) )
+        {
+            if ( ! perform ( commandString ) )
+            {
+                break;
+            }
+        }
+    }
+    finish();
+    Replication::singleton()->log ( string() );
+}
+
+bool Interpreter::perform ( const string & commandString, bool client )
+{
+    bool replicated = false;
+    try
+    {
+        Command * command = CommandFactory::singleton()->createCommand ( commandString );
+        if ( client && ! Server::allowed ( *command ) )
+        {
+            string name ( command->name() );
+            delete command;
+            throw exception ( ( name + " is for the console only" ).c_str() );
+        }
+        replicated = Replication::singleton()->replicated ( *command );
+        bool more = carryOut ( command );
+        if ( replicated )
+        {
+            Replication::singleton()->log ( commandString );
+        }
+        return more;
+    }
+    catch ( ... )
+    {
+        if ( replicated )
+        {
+            Replication::singleton()->log ( commandString );
+        }
+        reportException ( commandString );
+    }
+    return true;
+}
+
+void Interpreter::finish()
+{
+    Timeline::singleton()->runAll();
+    Fleet::singleton()->settle();
+    if ( Transaction::singleton()->open() )
+    {
+        cout << "Abandoning uncommitted transaction" << endl;
+        Transaction::singleton()->abort();
+    }
+    Queries::singleton()->finish();
+}
+
+// As run(), but the parsing's done in parallel a window at a time, leaving
+// only the names to be looked up as each command comes to be carried out.
+void Interpreter::runParsedInParallel()
+{
+    ParallelParser parser ( m_commandStream );
+    while ( parser.parseWindow() )
+    {
+        for ( size_t chunk = 0; chunk < parser.chunks(); ++chunk )
+        {
+            for ( size_t inx = 0; inx < parser.size ( chunk ); ++inx )
+            {
+                const SymbolicCommand & parsed = parser.command ( chunk, inx );
+                bool replicated = false;
+                try
+                {
+                    Command * command = CommandFactory::singleton()->resolveCommand ( parsed );
+                    replicated = Replication::singleton()->replicated ( *command );
+                    bool more = carryOut ( command );
+                    if ( replicated )
+                    {
+                        Replication::singleton()->log ( parsed.text );
+                    }
+                    if ( ! more )
+                    {
+                        return;
+                    }
+                }
+                catch ( ... )
+                {
+                    if ( replicated )
+                    {
+                        Replication::singleton()->log ( parsed.text );
+                    }
+                    reportException ( parsed.text );
+                }
+            }
+        }
+    }
+}
+
+bool Interpreter::carryOut ( Command * command )
+{
+    if ( command->timed() )
+    {
+        if ( command->name() == "quit" || command->name() == "run" )
+        {
+            delete command;
+            throw exception ( "quit and run cannot be timestamped" );
+        }
+        Timeline::singleton()->runUntil ( command->time(), false );
+        Timeline::singleton()->schedule ( command );
+        return true;
+    }
+    scoped_ptr<Command> freeCommand ( command );
+    return execute ( *command );
+}
+
+bool Interpreter::execute ( const Command & command )
+{
+    Snapshots::singleton()->invalidate();
+    if ( command.name() != "fleet" )
+    {
+        Fleet::singleton()->settle();
+    }
+    // Now this switching is ugly...
+    if ( command.name() == "create" )
+    {
+        string newObjectName;
+        istringstream parser ( command.qualifiers() );
+        parser >> newObjectName;
+        RobotFactory::singleton()->createRobot ( newObjectName );
+    }
+    else if ( command.name() == "destroy" )
+    {
+        string robotName;
+        istringstream parser ( command.qualifiers() );
+        parser >> robotName;
+        RobotFactory::singleton()->destroyRobot ( robotName );
+    }
+    else if ( command.name() == "tick" )
+    {
+        string countToken ( Tokeniser ( command.qualifiers(), ", " ).nextToken() );
+        int ticks = countToken.empty() ? 1 : atoi ( countToken.c_str() );
+        Scheduler::singleton()->tick ( ticks > 0 ? ticks : 0 );
+    }
+    else if ( command.name() == "run" )
+    {
+        string timeToken ( Tokeniser ( command.qualifiers(), ", " ).nextToken() );
+        if ( timeToken.empty() )
+        {
+            Timeline::singleton()->runAll();
+        }
+        else
+        {
+            Timeline::singleton()->runUntil ( strtoul ( timeToken.c_str(), 0, 10 ), true );
+        }
+    }
+    else if ( command.name() == "group" || command.name() == "ungroup" )
+    {
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        string groupName ( tokeniser.nextToken() );
+        if ( groupName.empty() )
+        {
+            throw exception ( ( command.name() + " needs a group name" ).c_str() );
+        }
+        string robotName ( tokeniser.nextToken() );
+        if ( command.name() == "ungroup" && robotName.empty() )
+        {
+            GroupFactory::singleton()->destroyGroup ( groupName );
+            return true;
+        }
+        Group * group = ( command.name() == "group" ) ?
+                        GroupFactory::singleton()->group ( groupName ) :
+                        GroupFactory::singleton()->find ( groupName );
+        if ( group == 0 )
+        {
+            throw exception ( ( "No such group " + groupName ).c_str() );
+        }
+        for ( ; ! robotName.empty(); robotName = tokeniser.nextToken() )
+        {
+            Robot * robot = Robot::find ( robotName );
+            if ( robot == 0 )
+            {
+                cout << "Ignoring unknown robot " << robotName << endl;
+            }
+            else if ( command.name() == "group" )
+            {
+                group->add ( robot->id() );
+            }
+            else
+            {
+                group->remove ( robot->id() );
+            }
+        }
+    }
+    else if ( command.name() == "begin" )
+    {
+        Transaction::singleton()->begin();
+    }
+    else if ( command.name() == "commit" )
+    {
+        Transaction::singleton()->commit();
+    }
+    else if ( command.name() == "abort" )
+    {
+        Transaction::singleton()->abort();
+    }
+    else if ( Transaction::singleton()->open() &&
+              Transaction::holdsBack ( command.name() )
+            )
+    {
+        Transaction::singleton()->hold ( command );
+    }
+    else if ( command.name() == "continuous" )
+    {
+        string modeToken ( lowerCaseString ( Tokeniser ( command.qualifiers(), ", " ).nextToken() ) );
+        if ( modeToken != "on" && modeToken != "off" )
+        {
+            throw exception ( ( "continuous expects on or off, not " + modeToken ).c_str() );
+        }
+        ContinuousWorld::singleton()->enable ( modeToken == "on" );
+    }
+    else if ( command.name() == "trace" )
+    {
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        string robotName ( tokeniser.nextToken() );
+        Robot * robot = Robot::find ( robotName );
+        if ( robot == 0 )
+        {
+            throw exception ( ( "No such robot " + robotName ).c_str() );
+        }
+        string fromToken ( tokeniser.nextToken() );
+        string toToken ( tokeniser.nextToken() );
+        size_t from = strtoul ( fromToken.c_str(), 0, 10 );
+        size_t to = toToken.empty() ? robot->trajectory().steps() : strtoul ( toToken.c_str(), 0, 10 );
+        cout << "Robot " << robotName << " has taken " << robot->trajectory().steps() << " steps" << endl;
+        robot->trajectory().write ( cout, from, to );
+    }
+    else if ( command.name() == "contention" )
+    {
+        string countToken ( Tokeniser ( command.qualifiers(), ", " ).nextToken() );
+        int count = countToken.empty() ? 10 : atoi ( countToken.c_str() );
+        Contention::singleton()->report ( cout, count > 0 ? count : 0 );
+    }
+    else if ( command.name() == "constraints" )
+    {
+        ConstraintFactory::singleton()->report ( cout );
+    }
+    else if ( command.name() == "room" )
+    {
+        Rooms::singleton()->room ( command.qualifiers() );
+    }
+    else if ( command.name() == "rooms" )
+    {
+        Rooms::singleton()->rooms ( command.qualifiers() );
+    }
+    else if ( command.name() == "fleet" )
+    {
+        Fleet::singleton()->command ( command.qualifiers() );
+    }
+    else if ( command.name() == "session" )
+    {
+        Server::singleton()->session ( command.qualifiers() );
+    }
+    else if ( command.name() == "lanes" )
+    {
+        Server::singleton()->report ( cout );
+    }
+    else if ( command.name() == "zone" )
+    {
+        Zones::singleton()->command ( command.qualifiers() );
+    }
+    else if ( command.name() == "heatmap" )
+    {
+        Tokeniser tokeniser ( command.qualifiers(), ", " );
+        string modeToken ( lowerCaseString ( tokeniser.nextToken() ) );
+        if ( modeToken == "on" || modeToken == "off" )
+        {
+            Heatmap::singleton()->enable ( modeToken == "on" );
+        }
+        else if ( modeToken != "export" && modeToken != "top" && modeToken != "rejected" )
+        {
+            throw exception ( ( "heatmap expects on, off, export, top or rejected, not " + modeToken ).c_str() );
+        }
+        else if ( ! Heatmap::singleton()->enabled() )
+        {
+            throw exception ( "No heatmap is being kept" );
+        }
+        else if ( modeToken == "export" )
+        {
+            string fileName ( tokeniser.nextToken() );
+            if ( fileName.empty() )
+            {
+                throw exception ( "heatmap export needs a file name" );
+            }
+            Heatmap::singleton()->exportTo ( fileName );
+        }
+        else
+        {
+            string countToken ( tokeniser.nextToken() );
+            int count = countToken.empty() ? 10 : atoi ( countToken.c_str() );
+            Heatmap::singleton()->top ( cout, count > 0 ? count : 0, modeToken == "rejected" );
+        }
+    }
+    else if ( command.name() == "export" )
+    {
+        string fileName ( Tokeniser ( command.qualifiers(), ", " ).nextToken() );
+        if ( fileName.empty() )
+        {
+            throw exception ( "export needs a file name" );
+        }
+        Queries::singleton()->exportTo ( fileName );
+    }
+    else if ( command.name() == "help" )
+    {
+        help();
+    }
+    else if ( command.name() == "quit" )
+    {
+        return false;
+    }
+    else
+    {
+        Broadcaster::singleton()->broadcast ( command );
+    }
+    return true;
+}
+
+// Call from within a catch block: says what went wrong.
+void Interpreter::reportException ( const string & commandString )
+{
+    try
+    {
+        throw;
+    }
+    catch ( const string & error )
+    {
+        cerr << "Exception: " << error << endl;
+    }
+    catch ( const char * error )
+    {
+        cerr << "Exception: " << error << endl;
+    }
+    catch ( const InvalidCommandException & error )
+    {
+        cerr << "Invalid command: " << error.what() << endl;
+        help();
+    }
+    catch ( const InvalidDirectionException & error )
+    {
+        cerr << "Invalid direction " << error.directionString() << " for " << error.what() << endl;
+    }
+    catch ( const exception & error )
+    {
+        cerr << "Caught exception: " << error.what() << endl;
+    }
+    catch ( ... )
+    {
+        cerr << "Failed to create or run command \"" << commandString << "\"" << endl;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Broadcaster * Broadcaster::singleton()
+{
+    static Broadcaster * broadcaster = 0;
+    if ( broadcaster == 0 )
+    {
+        broadcaster = new Broadcaster;
+    }
+    return broadcaster;
+}
+
+// For completeness, ought to have remove as well.
+void Broadcaster::createCommandListener
+(   GameObject * object,
+    GameObjectResponder responder
+)
+{
+    CommandListener * listener = new CommandListener ( object, responder );
+    m_commandListeners.push_back ( listener );
+    m_listenersByObject[object] = listener;
+}
+
+void Broadcaster::removeCommandListener ( GameObject * object )
+{
+    map< GameObject*, CommandListener* >::iterator found = m_listenersByObject.find ( object );
+    if ( found == m_listenersByObject.end() )
+    {
+        return;
+    }
+    m_commandListeners.erase
+    (   find ( m_commandListeners.begin(), m_commandListeners.end(), found->second ) );
+    delete found->second;
+    m_listenersByObject.erase ( found );
+}
+
+void Broadcaster::inform ( GameObject * object, const Command & command )
+{
+    map< GameObject*, CommandListener* >::iterator iter = m_listenersByObject.find ( object );
+    if ( iter != m_listenersByObject.end() )
+    {
+        iter->second->inform ( command );
+    }
+}
+
+// Reports are collected up and written out together; see ReportWriter.
+void Broadcaster::broadcast ( const Command & command )
+{
+    if ( command.name() != "report" || ReportWriter::singleton()->collecting() )
+    {
+        deliver ( command );
+        return;
+    }
+    ReportWriter::singleton()->collect();
+    try
+    {
+        deliver ( command );
+    }
+    catch ( ... )
+    {
+        ReportWriter::singleton()->flush();
+        throw;
+    }
+    ReportWriter::singleton()->flush();
+}
+
+void Broadcaster::deliver ( const Command & command )
+{
+    // Broadcast to all listeners or just the one that the Command specifies,
+    // in which case go straight there rather than past everyone else.
+    GameObject * gameObject = command.gameObject();
+    if ( gameObject != 0 )
+    {
+        inform ( gameObject, command );
+        return;
+    }
+
+    // Or just the robots in a group, or whose names match a pattern.
+    if ( command.group() != 0 || ! command.selector().empty() )
+    {
+        vector< Robot* > robots;
+        RobotFactory::singleton()->targets ( command, robots );
+        for ( vector< Robot* >::iterator iter = robots.begin();
+              iter != robots.end(); ++iter
+            )
+        {
+            inform ( *iter, command );
+        }
+        return;
+    }
+    for ( vector< CommandListener* >::iterator iter = m_commandListeners.begin();
+          iter != m_commandListeners.end(); ++iter )
+    {
+        (*iter)->inform ( command );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Constraint::Constraint
+(   GameObject * object,
+    ConstraintDecider decider,
+    unsigned cost,
+    size_t sequence
+)
+  : m_object ( object ), m_decider ( decider ),
+    m_cost ( cost ), m_sequence ( sequence ),
+    m_bounded ( false ), m_xmin ( 0 ), m_ymin ( 0 ), m_xmax ( 0 ), m_ymax ( 0 ),
+    m_calls ( 0 ), m_rejections ( 0 )
+{
+}
+
+void Constraint::setExtent ( int xmin, int ymin, int xmax, int ymax )
+{
+    m_bounded = true;
+    m_xmin = xmin;
+    m_ymin = ymin;
+    m_xmax = xmax;
+    m_ymax = ymax;
+}
+
+bool Constraint::covers ( int xpos, int ypos ) const
+{
+    return ! m_bounded ||
+           ( m_xmin <= xpos && xpos < m_xmax && m_ymin <= ypos && ypos < m_ymax );
+}
+
+bool Constraint::acceptable
+(   GameObject * object,
+    int xpos,
+    int ypos,
+    Direction direction,
+    bool onTable,
+    GameObject * ignoring,
+    GameObject ** rejecter
+)
+{
+    if ( rejecter != 0 )
+    {
+        *rejecter = 0;
+    }
+
+    // Check sane direction.
+    if ( ! validDirection ( direction ) )
+    {
+        return false;
+    }
+
+    // Check against all the registered Constraints (bar any to be ignored,
+    // and any which can't mind this cell).
+    ConstraintFactory * factory = ConstraintFactory::singleton();
+    factory->checked();
+    const vector< Constraint* > & constraints = factory->constraints();
+    for ( vector< Constraint* >::const_iterator iter = constraints.begin();
+          iter != constraints.end(); ++iter
+        )
+    {
+        Constraint * constraint = *iter;
+        GameObject * constrainerObject = constraint->m_object;
+        ConstraintDecider decider = constraint->m_decider;
+        if ( constrainerObject == ignoring || ! constraint->covers ( xpos, ypos ) )
+        {
+            continue;
+        }
+        constraint->m_calls.store ( constraint->m_calls.load ( memory_order_relaxed ) + 1,
+                                    memory_order_relaxed );
+        if ( ! (constrainerObject->*decider) ( object, xpos, ypos, direction, onTable ) )
+        {
+            constraint->m_rejections.store ( constraint->m_rejections.load ( memory_order_relaxed ) + 1,
+                                             memory_order_relaxed );
+            if ( rejecter != 0 )
+            {
+                *rejecter = constrainerObject;
+            }
+            return false;
+        }
+    }
+
+    // Looks good, then.
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+ConstraintFactory::ConstraintFactory()
+  : m_checks ( 0 )
+{
+}
+
+ConstraintFactory * ConstraintFactory::singleton()
+{
+    static ConstraintFactory * factory = 0;
+    if ( factory == 0 )
+    {
+        factory = new ConstraintFactory;
+    }
+    return factory;
+}
+
+Constraint * ConstraintFactory::createConstraint
+(   GameObject * object,
+    ConstraintDecider decider,
+    unsigned cost
+)
+{
+    Constraint * constraint = new Constraint ( object, decider, cost, m_constraints.size() );
+    m_constraints.push_back ( constraint );
+    return constraint;
+}
+
+const vector< Constraint* > & ConstraintFactory::constraints() const
+{
+    return m_constraints;
+}
+
+// Other threads may be going through the Constraints in concurrent mode, so
+// the order stays as it is then.
+void ConstraintFactory::checked()
+{
+    unsigned long long checks = m_checks.load ( memory_order_relaxed ) + 1;
+    m_checks.store ( checks, memory_order_relaxed );
+    if ( checks % reorderInterval == 0 && ! Occupancy::singleton()->concurrent() )
+    {
+        reorder();
+    }
+}
+
+// Expected cost per rejection, taking one more rejection and two more calls
+// than seen so that a Constraint which has never said no still ranks.
+bool ConstraintFactory::cheaper ( const Constraint * first, const Constraint * second )
+{
+    double firstCost = first->m_cost * ( first->m_calls.load ( memory_order_relaxed ) + 2.0 ) /
+                       ( first->m_rejections.load ( memory_order_relaxed ) + 1.0 );
+    double secondCost = second->m_cost * ( second->m_calls.load ( memory_order_relaxed ) + 2.0 ) /
+                        ( second->m_rejections.load ( memory_order_relaxed ) + 1.0 );
+    if ( firstCost != secondCost )
+    {
+        return firstCost < secondCost;
+    }
+    return first->m_sequence < second->m_sequence;
+}
+
+void ConstraintFactory::reorder()
+{
+    sort ( m_constraints.begin(), m_constraints.end(), cheaper );
+}
+
+void ConstraintFactory::report ( ostream & stream ) const
+{
+    for ( vector< Constraint* >::const_iterator iter = m_constraints.begin();
+          iter != m_constraints.end(); ++iter
+        )
+    {
+        const Constraint * constraint = *iter;
+        stream << constraint->m_object->name() << ": cost " << constraint->m_cost
+               << ", asked " << constraint->m_calls.load ( memory_order_relaxed )
+               << ", said no " << constraint->m_rejections.load ( memory_order_relaxed );
+        if ( constraint->m_bounded )
+        {
+            stream << ", only in [ ( " << constraint->m_xmin << ", " << constraint->m_ymin
+                   << " ), ( " << constraint->m_xmax << ", " << constraint->m_ymax << " ) ]";
+        }
+        stream << endl;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Every token's start and end are found in one go. There can't be more
+// than one token for every two characters, give or take one.
+Tokeniser::Tokeniser ( const string & stringToParse, const string & separators )
+  : m_stringToParse ( stringToParse ),
+    m_offsets ( stringToParse.length() + 2 ),
+    m_tokens ( 0 ),
+    m_nextToken ( 0 )
+{
+    m_tokens = Scanner::tokens ( m_stringToParse.data(), m_stringToParse.length(),
+                                 separators.c_str(), &m_offsets[0], m_offsets.size() / 2 );
+}
+
+string Tokeniser::nextToken()
+{
+    if ( m_nextToken == m_tokens )
+    {
+        return "";  // to signal EOS
+    }
+    size_t start = m_offsets[2*m_nextToken];
+    size_t end = m_offsets[2*m_nextToken+1];
+    ++m_nextToken;
+    return m_stringToParse.substr ( start, end-start );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Engine * Engine::singleton()
+{
+    static Engine * engine = 0;
+    if ( engine == 0 )
+    {
+        engine = new Engine;
+    }
+    return engine;
+}
+
+// good_robot's main sets up its own table; anyone else gets the same one.
+Engine::Engine()
+  : m_owned ( 0 ),
+    m_ownedCount ( 0 )
+{
+    if ( Table::table() == 0 )
+    {
+        Table::setTable ( 0, 0, 10, 10 );
+    }
+    Snapshots::singleton()->publish();
+}
+
+unsigned Engine::createRobot ( const string & robotName )
+{
+    if ( concurrent() )
+    {
+        throw exception ( "Cannot create robots in concurrent mode" );
+    }
+    Snapshots::singleton()->invalidate();
+    unsigned id = RobotFactory::singleton()->createRobot ( robotName )->id();
+    Replication::singleton()->log ( "create " + robotName );
+    return id;
+}
+
+bool Engine::robotId ( const string & robotName, unsigned & id ) const
+{
+    Robot * robot = RobotFactory::singleton()->find ( robotName );
+    if ( robot == 0 )
+    {
+        return false;
+    }
+    id = robot->id();
+    return true;
+}
+
+size_t Engine::submit ( const Op * ops, size_t count, OpResult * results )
+{
+    size_t done = 0;
+    if ( ! concurrent() )
+    {
+        // Shared between threads otherwise, so left alone.
+        m_changed.clear();
+    }
+    for ( size_t inx = 0; inx < count; ++inx )
+    {
+        OpResult & result = results[inx];
+        Robot * robot = RobotFactory::singleton()->robot ( ops[inx].robot );
+        if ( robot != 0 && concurrent() )
+        {
+            take ( robot->id() );
+        }
+        result.status = ( robot == 0 ) ? OpNoSuchRobot : perform ( robot, ops[inx] );
+        if ( result.status != OpNoSuchRobot && result.status != OpInvalid &&
+             ops[inx].code != OpReport && Replication::singleton()->leading()
+           )
+        {
+            replicate ( robot, ops[inx] );
+        }
+        if ( result.status == OpDone )
+        {
+            ++done;
+            if ( ops[inx].code != OpReport && ! concurrent() )
+            {
+                m_changed.push_back ( robot->id() );
+            }
+        }
+        if ( robot != 0 )
+        {
+            result.xpos = robot->xpos();
+            result.ypos = robot->ypos();
+            result.direction = robot->direction();
+            result.onTable = robot->onTable();
+            if ( concurrent() )
+            {
+                give ( robot->id() );
+            }
+        }
+        else
+        {
+            result.xpos = 0;
+            result.ypos = 0;
+            result.direction = Invalid;
+            result.onTable = false;
+        }
+    }
+    if ( ! concurrent() )
+    {
+        Snapshots::singleton()->publish ( m_changed );
+    }
+    return done;
+}
+
+// Those turned back go too, for the follower's heatmap and contention to
+// match.
+void Engine::replicate ( Robot * robot, const Op & op )
+{
+    ostringstream line;
+    line << robot->name() << ": ";
+    switch ( op.code )
+    {
+        case OpPlace:
+            line << "place " << op.xpos << ' ' << op.ypos << ' ' << directionName ( op.direction );
+            break;
+        case OpMove:
+            line << "move";
+            break;
+        case OpLeft:
+            line << "left";
+            break;
+        case OpRight:
+            line << "right";
+            break;
+        case OpRemove:
+            line << "remove";
+            break;
+        default:
+            return;
+    }
+    Replication::singleton()->log ( line.str() );
+}
+
+OpStatus Engine::perform ( Robot * robot, const Op & op )
+{
+    switch ( op.code )
+    {
+        case OpPlace:
+            if ( ! validDirection ( op.direction ) )
+            {
+                return OpInvalid;
+            }
+            return shift ( robot, op.xpos, op.ypos, op.direction );
+        case OpMove:
+            if ( ! robot->onTable() )
+            {
+                return OpNotOnTable;
+            }
+            else
+            {
+                int xpos = robot->xpos();
+                int ypos = robot->ypos();
+                Robot::step ( robot->direction(), xpos, ypos );
+                GameObject * rejecter;
+                OpStatus status = shift ( robot, xpos, ypos, robot->direction(), &rejecter );
+                if ( status == OpRejected )
+                {
+                    if ( Heatmap::singleton()->enabled() )
+                    {
+                        Heatmap::singleton()->reject ( xpos, ypos );
+                    }
+                    Contention::singleton()->record ( robot, xpos, ypos, rejecter );
+                }
+                return status;
+            }
+        case OpLeft:
+        case OpRight:
+            if ( ! robot->onTable() )
+            {
+                return OpNotOnTable;
+            }
+            op.code == OpLeft ? robot->left() : robot->right();
+            return OpDone;
+        case OpReport:
+            // The OpResult is the report.
+            return robot->onTable() ? OpDone : OpNotOnTable;
+        case OpRemove:
+            robot->remove();
+            return OpDone;
+    }
+    return OpInvalid;
+}
+
+// Claim the destination cell first and only then let go of the one the
+// robot is leaving (which relocating does), so that two robots making for
+// the same cell can't both end up there however their threads interleave.
+// Losing the race for a cell is put down to the Occupancy, like finding
+// someone already there.
+OpStatus Engine::shift
+(   Robot * robot,
+    int xpos,
+    int ypos,
+    Direction direction,
+    GameObject ** rejecter
+)
+{
+    if ( ! Constraint::acceptable ( robot, xpos, ypos, direction, true, 0, rejecter ) )
+    {
+        return OpRejected;
+    }
+    if ( ! Occupancy::singleton()->claim ( xpos, ypos, robot ) )
+    {
+        if ( rejecter != 0 )
+        {
+            *rejecter = Occupancy::singleton();
+        }
+        return OpRejected;
+    }
+    robot->relocate ( xpos, ypos, direction, true );
+    return OpDone;
+}
+
+void Engine::setConcurrent ( bool concurrent )
+{
+    if ( concurrent == this->concurrent() )
+    {
+        return;
+    }
+    if ( concurrent )
+    {
+        if ( ContinuousWorld::singleton()->enabled() )
+        {
+            throw exception ( "Cannot go concurrent in continuous mode" );
+        }
+        if ( Heatmap::singleton()->enabled() )
+        {
+            throw exception ( "Cannot go concurrent with a heatmap" );
+        }
+        if ( Zones::singleton()->counting() )
+        {
+            throw exception ( "Cannot go concurrent with capacity zones" );
+        }
+        if ( Replication::singleton()->leading() )
+        {
+            throw exception ( "Cannot go concurrent while replicating" );
+        }
+        m_ownedCount = RobotFactory::singleton()->robots().size();
+        m_owned = new atomic< bool > [ m_ownedCount ];
+        for ( size_t inx = 0; inx < m_ownedCount; ++inx )
+        {
+            m_owned[inx].store ( false, memory_order_relaxed );
+        }
+    }
+    else
+    {
+        delete [] m_owned;
+        m_owned = 0;
+        m_ownedCount = 0;
+    }
+    Occupancy::singleton()->setConcurrent ( concurrent );
+    if ( ! concurrent )
+    {
+        Snapshots::singleton()->publish();
+    }
+}
+
+const Snapshot * Engine::pin()
+{
+    return Snapshots::singleton()->pin();
+}
+
+void Engine::unpin ( const Snapshot * snapshot )
+{
+    Snapshots::singleton()->unpin ( snapshot );
+}
+
+bool Engine::concurrent() const
+{
+    return m_owned != 0;
+}
+
+// Wait for whoever has the robot to be done with it.
+void Engine::take ( unsigned robotId )
+{
+    while ( m_owned[robotId].exchange ( true, memory_order_acquire ) )
+    {
+        this_thread::yield();
+    }
+}
+
+void Engine::give ( unsigned robotId )
+{
+    m_owned[robotId].store ( false, memory_order_release );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Direction utilities.
+
+bool validDirection ( Direction direction )
+{
+    return direction == North || direction == West ||
+           direction == South || direction == East;
+}
+
+string directionAsString ( Direction direction )
+{
+    return directionName ( direction );
+}
+
+const char * directionName ( Direction direction )
+{
+    return ( direction == North ) ? "North" :
+           ( direction == West )  ? "West" :
+           ( direction == South ) ? "South" :
+           ( direction == East )  ? "East" :
+                                    "Invalid";
+}
+
+Direction directionFromString ( const string & str )
+{
+    string lcString ( lowerCaseString ( str ) );
+    return ( lcString == "n" || lcString == "north" ) ? North :
+           ( lcString == "w" || lcString == "west" )  ? West :
+           ( lcString == "s" || lcString == "south" ) ? South :
+           ( lcString == "e" || lcString == "east" )  ? East :
+                                                        Invalid;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Some helpers.
+
+// Should have map of name-to-function really.
+void help()
+{
+    cerr << "Valid commands are:" << endl;
+    const vector<string> & validCommands = CommandFactory::singleton()->validCommands();
+    for ( vector<string>::const_iterator iter = validCommands.begin();
+          iter != validCommands.end(); ++iter
+        )
+    {
+        cerr << *iter << endl;
+    }
+}
+
+// string.tolower by steam. Ugh.
+string lowerCaseString ( const string & str )
+{
+    string lcStr ( str );
+    if ( ! lcStr.empty() )
+    {
+        Scanner::lowerCase ( &lcStr[0], lcStr.length() );
+    }
+    return lcStr;
+}
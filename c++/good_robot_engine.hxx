@@ -0,0 +1,1903 @@
+#ifndef GOOD_ROBOT_ENGINE_HXX
+#define GOOD_ROBOT_ENGINE_HXX
+
+// The robot engine: everything but main, so that other programs can drive
+// the robots without going through good_robot's command-line front end.
+// See good_robot.cxx for the overall description.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum Direction { Invalid, North, East, South, West };
+typedef unsigned long long SimTime;     // milliseconds
+bool validDirection ( Direction direction );
+string directionAsString ( Direction direction );
+const char * directionName ( Direction direction );     // no string built
+Direction directionFromString ( const string & str );
+void help();
+string lowerCaseString ( const string & str );
+
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+// Scanning bytes a vector register's worth at a time: with AVX2 if the
+// processor has it (as found out at run time), else SSE2, or else, away from
+// x86, a byte at a time.
+
+class Scanner
+{
+    public:
+        // The first of the byte from start on, or end.
+        static const char * find ( const char * start, const char * end, char byte );
+        // The start and end offsets of each run of bytes not among the
+        // separators (of which more than eight are slow), up to maxTokens of
+        // them. Returns how many.
+        static size_t tokens
+        (   const char * data,
+            size_t size,
+            const char * separators,
+            size_t * offsets,
+            size_t maxTokens
+        );
+        // ASCII only, as tolower in the C locale.
+        static void lowerCase ( char * data, size_t size );
+        enum Level { Bytewise, SSE2, AVX2 };
+        static Level level();
+    private:
+        static Level detect();
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class CompressedInput;
+
+// A named file is read a block at a time (and can be compressed; see
+// CompressedInput). stdin is read a line at a time, so as not to wait for
+// more than a line from a terminal, and can't be compressed.
+class CommandStream
+{
+    public:
+        CommandStream ( const char * fileName );
+        CommandStream ( FILE * stream );
+        ~CommandStream();
+        bool getCommand ( string & command );
+        // Raw text instead of lines; what there is up to the given size, or
+        // 0 at the end.
+        size_t read ( char * buffer, size_t size );
+    private:
+        bool nextBlock();
+        bool getBlockCommand ( string & command );
+        FILE * m_stream;
+        bool m_blockwise;
+        CompressedInput * m_compressed;
+        vector< char > m_readBuffer;
+        const char * m_block;
+        size_t m_blockSize;
+        size_t m_blockPosition;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class GameObject;   // forward declarations
+class Group;
+class Constraint;
+struct RobotState;
+
+class Command
+{
+    public:
+        string name() const;
+        string qualifiers() const;
+        GameObject * gameObject() const;
+        const Group * group() const;
+        const string & selector() const;
+        bool timed() const;
+        SimTime time() const;
+        bool deferred() const;
+    private:
+        Command
+        (   const string & name,
+            const string & qualifers,
+            GameObject * gameObject = 0
+        );
+        string m_name;
+        string m_qualifiers;
+        GameObject * m_gameObject;
+        const Group * m_group;
+        string m_selector;  // robot name pattern
+        bool m_timed;
+        SimTime m_time;
+        bool m_deferred;    // already put off by its Robot, so just do it
+    friend class CommandFactory;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// A command line parsed as far as it can be without looking any names up,
+// which can be done on any thread. The names are looked up afterwards, in
+// order, by CommandFactory::resolveCommand, so that a robot created on one
+// line can be named on the next.
+
+struct SymbolicCommand
+{
+    string text;
+    string error;           // if it can't be a command at all, why not
+    bool timed;
+    SimTime time;
+    bool targeted;
+    string target;          // before the colon
+    string verb;            // lower case
+    bool validVerb;
+    string qualifiers;
+    size_t line;            // in the input, if it came from a ParallelParser
+    string argumentError;   // what's wrong with the qualifiers, if checked
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class CommandFactory
+{
+    public:
+        static CommandFactory * singleton();
+        void checkValidCommand ( const string & command ) const;
+        const vector<string> & validCommands() const;
+        void setValidCommands ( const vector<string> & commands );
+        static bool isSelector ( const string & name );
+        Command * createCommand ( const string & commandString ) const;
+        // createCommand in two halves.
+        void parseCommand ( const string & commandString, SymbolicCommand & parsed ) const;
+        Command * resolveCommand ( const SymbolicCommand & parsed ) const;
+        // What can be told of the qualifiers without carrying the command
+        // out, into parsed.argumentError.
+        void checkArguments ( SymbolicCommand & parsed ) const;
+        Command * createDeferredCommand
+        (   const Command & command,
+            GameObject * gameObject,
+            SimTime time
+        ) const;
+    private:
+        vector<string> m_validCommands;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// This is what a GameObject registers with the Broadcaster in order to
+// receive Commands.
+
+typedef void (GameObject::*GameObjectResponder) ( const Command & command );
+
+//////////////////////////////////////////////////////////////////////////////
+
+class CommandListener
+{
+    public:
+        CommandListener ( GameObject * object, GameObjectResponder responder );
+        virtual ~CommandListener() {}
+        GameObject * object() const;
+        virtual void inform ( const Command & command );
+    private:
+        GameObject * m_object;
+        GameObjectResponder m_responder;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class GameObject
+{
+    public:
+        virtual void respond ( const Command & command ) = 0;
+        virtual bool constraintDecider
+        (   GameObject * object,
+            int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable
+        );
+        virtual string name();
+        virtual int xpos();
+        virtual int ypos();
+        virtual Direction direction();
+        virtual bool onTable();
+        virtual int speed();        // cells per second, 0 for instantaneous
+    protected:
+        GameObject ( const string & name );
+        string m_name;
+        int m_xpos;
+        int m_ypos;
+        Direction m_direction;
+        bool m_onTable;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// This is what a GameObject registers with the corresponding Constraint in
+// order for the Constraint to give a verdict.
+
+typedef bool (GameObject::*ConstraintDecider)
+    ( GameObject * object, int xpos, int ypos, Direction direction, bool onTable );
+
+//////////////////////////////////////////////////////////////////////////////
+// Everywhere a robot has been, as a step at a time: 2 bits for a move
+// forward, a turn left or right, or a jump (placing, removing, coasting,
+// anything else), four steps to a byte. Where a jump lands, and where the
+// robot is every so many steps, is kept alongside as a keyframe, so that
+// replaying a stretch starts from the keyframe before it rather than from
+// the beginning. Step 0 is the robot as created, off the table.
+
+class Trajectory
+{
+    public:
+        Trajectory();
+        // Where the robot is now; nothing is recorded if that's no change.
+        void record ( int xpos, int ypos, Direction direction, bool onTable );
+        size_t steps() const;
+        // Where the robot was after each step from from to to, a line each.
+        void write ( ostream & stream, size_t from, size_t to ) const;
+    private:
+        enum Code { Forward, Left, Right, Jump };
+        enum { keyframeInterval = 1024 };
+        struct Keyframe
+        {
+            size_t step;        // the state after this many steps
+            int xpos;
+            int ypos;
+            Direction direction;
+            bool onTable;
+        };
+        Code code ( size_t step ) const;
+        static bool before ( size_t step, const Keyframe & keyframe );
+        vector< unsigned char > m_codes;
+        size_t m_steps;
+        vector< Keyframe > m_keyframes;     // in order of step
+        Keyframe m_current;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class Robot : public GameObject
+{
+    public:
+        void respond ( const Command & command );
+        void place ( int xpos, int ypos, Direction direction );
+        bool tryPlace ( int xpos, int ypos, Direction direction );
+        bool move();
+        bool tryMove();
+        void left();
+        void right();
+        void report();
+        void remove();
+        void setSpeed ( int cellsPerSecond );
+        int speed();
+        void setVelocity ( double xvelocity, double yvelocity );
+        double fxpos() const;
+        double fypos() const;
+        double xvelocity() const;
+        double yvelocity() const;
+        bool moving() const;
+        void coast ( double seconds );
+        void halt();
+        void settle();
+        // Momentarily is for being lifted off the table only to be put
+        // back at once, which isn't worth recording in the Trajectory, nor
+        // in the Heatmap unless the robot is put back somewhere else.
+        void relocate
+        (   int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable,
+            bool momentarily = false
+        );
+        void state ( RobotState & state ) const;
+        const Trajectory & trajectory() const;
+        unsigned id() const;
+        bool destroyed() const;
+        static Robot * find ( const string & robotName );
+        static void step ( Direction direction, int & xpos, int & ypos );
+        static Direction turnLeft ( Direction direction );
+        static Direction turnRight ( Direction direction );
+        static void parsePlacement
+        (   const string & qualifiers,
+            int & xpos,
+            int & ypos,
+            Direction & direction
+        );
+
+    private:
+        Robot ( const string & name, unsigned id );
+        bool deferTimed ( const Command & command );
+        unsigned m_id;
+        bool m_destroyed;
+        bool m_lifted;          // momentarily, from m_xpos, m_ypos
+        int m_speed;
+        SimTime m_busyUntil;
+        double m_fxpos;         // } continuous mode only,
+        double m_fypos;         // } but m_fxpos and m_fypos
+        double m_xvelocity;     // } always track m_xpos and
+        double m_yvelocity;     // } m_ypos
+        Trajectory m_trajectory;
+    friend class RobotFactory;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Keys are kept in a tree of nodes whose edges carry whole runs of
+// characters rather than one each, so a pattern such as "dock3-*" walks
+// straight down to the "dock3-" subtree and takes everything under it, and
+// any other pattern only explores the branches which can still match.
+
+class RadixTree
+{
+    public:
+        RadixTree();
+        ~RadixTree();
+        bool insert ( const string & key, unsigned value );    // false if present
+        bool erase ( const string & key );                      // false if absent
+        bool find ( const string & key, unsigned & value ) const;
+        // Append the values of all keys matching a pattern of literal
+        // characters, * (any run) and ? (any one character).
+        void match ( const string & pattern, vector< unsigned > & values ) const;
+    private:
+        struct Node
+        {
+            string label;           // the characters on the edge into here
+            bool terminal;
+            unsigned value;
+            vector< Node* > children;   // in order of first character
+        };
+        static Node * newNode ( const string & label );
+        static void destroy ( Node * node );
+        static Node * child ( const Node * node, char first, size_t * position = 0 );
+        static void collect ( const Node * node, vector< unsigned > & values );
+        static void matchFrom
+        (   const Node * node,
+            size_t offset,
+            const string & pattern,
+            size_t patternPosition,
+            vector< unsigned > & values
+        );
+        Node * m_root;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Robots are indexed by id (in order of creation) and by name. Destroyed
+// robots leave a gap in the ids and are retired rather than deleted, as
+// timestamped commands might still refer to them; they get nowhere, as the
+// Broadcaster has forgotten them.
+
+class RobotFactory
+{
+    public:
+        static RobotFactory * singleton();
+        Robot * createRobot ( const string & robotName );
+        void destroyRobot ( const string & robotName );
+        Robot * find ( const string & robotName ) const;
+        void match ( const string & pattern, vector< unsigned > & ids ) const;
+        // The Robots a Command is for.
+        void targets ( const Command & command, vector< Robot* > & robots ) const;
+        const vector< Robot* > & robots() const;
+        Robot * robot ( unsigned id ) const;
+    private:
+        RadixTree m_names;
+        vector< Robot* > m_robotsById;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Members are kept as a dense array of robot ids, so acting on a group only
+// goes anywhere near its own robots. Taking a member out moves the last one
+// into its place, so the order is only the order of joining until someone
+// leaves.
+
+class Group
+{
+    public:
+        const string & name() const;
+        const vector< unsigned > & members() const;
+        bool add ( unsigned robotId );
+        bool remove ( unsigned robotId );
+        void clear();
+    private:
+        Group ( const string & name );
+        string m_name;
+        vector< unsigned > m_members;
+        map< unsigned, size_t > m_positions;    // robot id to index in m_members
+    friend class GroupFactory;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class GroupFactory
+{
+    public:
+        static GroupFactory * singleton();
+        Group * group ( const string & groupName );
+        void destroyGroup ( const string & groupName );
+        Group * find ( const string & groupName ) const;
+        void forget ( unsigned robotId );
+    private:
+        map< string, Group* > m_groups;
+        vector< Group* > m_retired;     // as timestamped commands might refer to them
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Behaviours are little coroutines in the protothread style: the body of
+// resume() goes between BEHAVIOUR_BEGIN and BEHAVIOUR_END and gives up the
+// rest of the tick with BEHAVIOUR_YIELD, carrying on from there on the next
+// tick. The resume point is a case label, so anything which has to survive a
+// yield must be a member rather than a local.
+
+#define BEHAVIOUR_BEGIN switch ( m_resumePoint ) { case 0:
+#define BEHAVIOUR_YIELD \
+    do { m_resumePoint = __LINE__; return true; case __LINE__:; } while ( 0 )
+#define BEHAVIOUR_END } m_resumePoint = -1; return false
+
+class Behaviour
+{
+    public:
+        virtual ~Behaviour();
+        // Run until the next yield; false once the Behaviour has finished.
+        virtual bool resume() = 0;
+        Robot * robot() const;
+        void cancel();
+        bool cancelled() const;
+        static void * operator new ( size_t size );
+        static void operator delete ( void * ptr, size_t size );
+    protected:
+        Behaviour ( Robot * robot );
+        Robot * m_robot;
+        int m_resumePoint;
+    private:
+        bool m_cancelled;
+};
+
+// Move until blocked, then turn right. Forever, or until taken off the table.
+class WanderBehaviour : public Behaviour
+{
+    public:
+        WanderBehaviour ( Robot * robot );
+        bool resume();
+};
+
+// Move the given number of steps, one per tick, giving up if blocked.
+class ForwardBehaviour : public Behaviour
+{
+    public:
+        ForwardBehaviour ( Robot * robot, int steps );
+        bool resume();
+    private:
+        int m_remaining;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Behaviours come and go far too often to have a heap allocation each, so
+// their frames are carved out of big chunks and recycled via a free list.
+
+class FramePool
+{
+    public:
+        FramePool ( size_t slotSize, size_t slotsPerChunk );
+        ~FramePool();
+        void * allocate();
+        void release ( void * slot );
+        size_t slotSize() const;
+        static FramePool * behaviourPool();
+    private:
+        size_t m_slotSize;
+        size_t m_slotsPerChunk;
+        vector< char* > m_chunks;
+        void * m_freeList;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// At most one Behaviour per Robot. Each tick resumes the live Behaviours in
+// one pass over a contiguous array, in the order they were started, and
+// squeezes out the ones which have finished as it goes.
+
+class Scheduler
+{
+    public:
+        static Scheduler * singleton();
+        void start ( Behaviour * behaviour );
+        void stop ( Robot * robot );
+        void tick ( unsigned ticks );
+        size_t size() const;
+    private:
+        vector< Behaviour* > m_ready;
+        map< Robot*, Behaviour* > m_byRobot;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Timestamped Commands wait here for their time. Level 0 has a slot per
+// millisecond for the next 256ms, level 1 a slot per 256ms for the next 64K
+// and so on; anything further off than four levels reach sits in an overflow
+// map. Entries trickle down a level as the clock reaches their slot, and
+// occupancy bitmaps let the clock jump straight over empty slots, so the
+// cost goes with the number of Commands rather than the time they span.
+
+class TimingWheel
+{
+    public:
+        TimingWheel();
+        void schedule ( Command * command );
+        // Take the earliest batch due no later than the limit, if any.
+        bool nextBatch ( SimTime limit, SimTime & time, vector< Command* > & batch );
+        bool empty() const;
+        SimTime now() const;
+    private:
+        enum { LevelBits = 8, Slots = 1 << LevelBits, Levels = 4, Words = Slots / 64 };
+        void insert ( Command * command );
+        void cascade ( int level, int slot );
+        int findOccupied ( int level, int fromSlot ) const;
+        vector< Command* > m_slots[Levels][Slots];
+        unsigned long long m_occupied[Levels][Words];
+        multimap< SimTime, Command* > m_overflow;
+        SimTime m_now;
+        size_t m_count;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class Timeline
+{
+    public:
+        static Timeline * singleton();
+        SimTime now() const;
+        void schedule ( Command * command );
+        // Fire everything due before (or, if inclusive, at) the given time.
+        void runUntil ( SimTime time, bool inclusive );
+        void runAll();
+    private:
+        Timeline();
+        void fire ( SimTime limit );
+        TimingWheel m_wheel;
+        SimTime m_now;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Continuous mode. Whenever the Timeline's clock moves on, robots coast along
+// at their velocities to the new time, except that the first collision (or
+// run-in with the table edge) on the way stops the robots involved and the
+// rest carry on from there. Candidate pairs come from sweep-and-prune: the
+// robots are kept sorted by the start of the x-extent they sweep out, which
+// hardly changes from one step to the next, so an insertion sort keeps it up
+// to date cheaply and only robots whose extents overlap get looked at
+// closely.
+
+class ContinuousWorld
+{
+    public:
+        static ContinuousWorld * singleton();
+        void enable ( bool on );
+        bool enabled() const;
+        void advance ( SimTime time );
+    private:
+        ContinuousWorld();
+        struct Sweep
+        {
+            Robot * robot;
+            double xmin;
+            double xmax;
+            double ymin;
+            double ymax;
+        };
+        void sweepOut ( double seconds );
+        double firstImpact ( double seconds, vector< Robot* > & stopping );
+        static double impactTime ( Robot * first, Robot * second, double seconds );
+        double edgeTime ( Robot * robot, double seconds ) const;
+        vector< Sweep > m_sweeps;
+        size_t m_knownRobots;
+        SimTime m_time;
+        bool m_enabled;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Just to constrain objects to remain within the table limits.
+
+class Table : public GameObject
+{
+    public:
+        static void setTable ( int xmin, int ymin, int xmax, int ymax );
+        static Table * table();
+        void respond ( const Command & command );
+        void report();
+        bool constraintDecider
+        (   GameObject * object,
+            int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable
+        );
+        int xmin();
+        int ymin();
+        int xmax();
+        int ymax();
+    private:
+        Table ( int xmin, int ymin, int xmax, int ymax );
+        static Table * m_table;
+        int m_xmin;
+        int m_ymin;
+        int m_xmax;
+        int m_ymax;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The table as an array of atomic words, one per cell, each holding the id
+// (plus one) of the robot in the cell or 0. Taking a cell is a
+// compare-and-swap from 0, so when two threads go for the same cell exactly
+// one of them gets it.
+
+class CellGrid
+{
+    public:
+        CellGrid ( int xmin, int ymin, int xmax, int ymax );
+        ~CellGrid();
+        bool claim ( int xpos, int ypos, unsigned robotId );
+        void release ( int xpos, int ypos, unsigned robotId );
+        unsigned occupant ( int xpos, int ypos ) const;
+    private:
+        CellGrid ( const CellGrid & );
+        CellGrid & operator = ( const CellGrid & );
+        bool contains ( int xpos, int ypos ) const;
+        atomic< unsigned > & cell ( int xpos, int ypos ) const;
+        int m_xmin;
+        int m_ymin;
+        int m_xmax;
+        int m_ymax;
+        atomic< unsigned > * m_cells;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Which robot is in which cell, kept up to date by Robot::relocate, so that
+// checking a cell is a lookup rather than asking every robot in turn. (It's
+// a multimap because in continuous mode two robots can be nearest to the
+// same cell.)
+
+class Occupancy : public GameObject
+{
+    public:
+        static Occupancy * singleton();
+        void respond ( const Command & command );
+        bool constraintDecider
+        (   GameObject * object,
+            int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable
+        );
+        void add ( Robot * robot );
+        void remove ( Robot * robot );
+        // Anyone in the cell other than the given robot, or 0.
+        Robot * occupant ( int xpos, int ypos, const GameObject * other ) const;
+        // In concurrent mode the index is a CellGrid instead. A robot has to
+        // claim the cell it's going to before it goes (claiming always
+        // succeeds otherwise, the index being kept up by relocating).
+        void setConcurrent ( bool concurrent );
+        bool concurrent() const;
+        bool claim ( int xpos, int ypos, Robot * robot );
+        void release ( int xpos, int ypos, Robot * robot );
+    private:
+        Occupancy();
+        typedef multimap< pair< int, int >, Robot* > CellMap;
+        CellMap m_cells;
+        CellGrid * m_grid;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Geofences: rectangles (half-open, like the table) which robots may only
+// move into at no more than a given speed, or not facing a given way, or no
+// more than so many at a time. They're all one Constraint, which only looks
+// at the zones holding the cell in question. The rows are cut into bands at
+// every zone's top and bottom edges, so that the same zones cross each row
+// of a band, and each band keeps those zones' x ranges sorted by left edge,
+// alongside the furthest any of them so far reaches right: the zones holding
+// a cell are found by a binary search and a walk back which stops as soon as
+// nothing further back can reach the cell. A capacity zone counts the robots
+// in it as they come and go, through Robot::relocate. No capacity zones in
+// concurrent mode, the counts being plain words.
+
+class Zones : public GameObject
+{
+    public:
+        enum Kind { SpeedLimit, NoHeading, Capacity };
+        static Zones * singleton();
+        void respond ( const Command & command );
+        bool constraintDecider
+        (   GameObject * object,
+            int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable
+        );
+        // Carry out a zone command (see README.md).
+        void command ( const string & qualifiers );
+        // Just the parsing of one, throwing as command would.
+        static void parse
+        (   const string & qualifiers,
+            string & name,
+            string & kindName,
+            int & xmin,
+            int & ymin,
+            int & xmax,
+            int & ymax,
+            int & limit
+        );
+        // A robot arriving in or leaving its cell.
+        void enter ( Robot * robot );
+        void leave ( Robot * robot );
+        bool counting() const;
+    private:
+        Zones();
+        struct Zone
+        {
+            string name;
+            Kind kind;
+            int xmin;
+            int ymin;
+            int xmax;
+            int ymax;
+            int limit;      // speed, Direction or number of robots
+            int count;      // robots in it (capacity zones only)
+            bool holds ( int xpos, int ypos ) const;
+        };
+        struct Span
+        {
+            int xmin;
+            int xmax;
+            Zone * zone;
+        };
+        struct Band
+        {
+            vector< Span > spans;   // in order of xmin
+            vector< int > reach;    // furthest xmax of spans up to each
+        };
+        static bool leftOf ( const Span & first, const Span & second );
+        static bool startsAfter ( int xpos, const Span & span );
+        const Band * band ( int ypos ) const;
+        void add ( Zone * zone );
+        void remove ( const string & name );
+        void list() const;
+        void rebuild();
+        void count ( Robot * robot, int change );
+        typedef map< string, Zone* > ZoneMap;
+        ZoneMap m_zones;
+        vector< int > m_edges;      // band n is rows m_edges[n] to m_edges[n+1]
+        vector< Band > m_bands;
+        size_t m_capacityZones;
+        Constraint * m_constraint;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Named rooms apart from the table, each with its own bounds and its own
+// index of who's where, and portal cells which carry a robot that moves
+// onto one into another room. Robots in rooms wander (forward until
+// blocked, then turn right). A run of steps gives each room a thread of its
+// own, started with the first run and kept for the next, which is all that
+// touches the room, bar its inbound queue: a robot going through a portal
+// is put on the queue of the room it's going to, which takes it off at the
+// start of the next step, in order of robot, and places it as soon as the
+// cell it comes out in is free. A room only starts a step once the rooms
+// with portals into it have finished the one before, so that what arrives
+// when never depends on which thread got there first, and once the rooms
+// its portals lead to have emptied the queue it's about to add to; the
+// queues alternate by step, so that's no more than a step behind. Rooms
+// with no portals between them don't wait for each other at all. A robot in
+// a room is off the table, and a Constraint keeps it off until it's out of
+// the rooms.
+//
+// Between runs, a robot in a room can be told to move, turn and report as
+// usual, the room being its table: bounded by the room's limits, with the
+// room's own index of who's where in place of the Occupancy, and its
+// portals taking it on to the inbound queue of the room at the far end, to
+// come out in the next run's first step. The table's Constraints don't
+// reach into rooms. Placing it puts it back on the table, if it can go there, and
+// removing it takes it out of the rooms altogether.
+
+class Rooms : public GameObject
+{
+    public:
+        static Rooms * singleton();
+        void respond ( const Command & command );
+        bool constraintDecider
+        (   GameObject * object,
+            int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable
+        );
+        // Carry out a room or rooms command (see README.md).
+        void room ( const string & qualifiers );
+        void rooms ( const string & qualifiers );
+        // Take a robot out of whichever room it's in.
+        void evict ( unsigned id );
+        // The room a robot is in, if any, else empty.
+        string roomOf ( unsigned id ) const;
+        // Carry out a command for a robot in a room; false if it isn't in
+        // one, or the command is one for the Robot itself.
+        bool command ( Robot * robot, const Command & command );
+    private:
+        Rooms();
+        struct Resident
+        {
+            unsigned id;
+            int xpos;
+            int ypos;
+            Direction direction;
+        };
+        struct Portal
+        {
+            size_t room;
+            int xpos;
+            int ypos;
+        };
+        typedef map< pair< int, int >, unsigned > CellMap;
+        typedef map< pair< int, int >, Portal > PortalMap;
+        struct Room
+        {
+            string name;
+            int xmin;
+            int ymin;
+            int xmax;
+            int ymax;
+            map< unsigned, Resident > residents;    // by robot id
+            CellMap cells;
+            PortalMap portals;
+            vector< Resident > waiting;     // come through, cell not yet free
+            mutex inboundMutex;
+            vector< Resident > inbound[2];  // by whether sent in an odd step
+            // Steps begun (inbound queue emptied) and finished, under
+            // m_stepMutex, and the rooms whose counts hold this one up.
+            unsigned long started;
+            unsigned long finished;
+            set< Room* > feeders;           // with portals into this one
+            set< Room* > destinations;      // this one's portals lead to
+            condition_variable advanced;    // by a feeder or destination
+            thread * worker;                // 0 until the first run
+            bool holds ( int xpos, int ypos ) const;
+        };
+        static bool byRobot ( const Resident & first, const Resident & second );
+        static void say ( const string & line );
+        void move ( Room * room, Resident & resident );
+        static void own ( Room * room );
+        bool ready ( const Room * room ) const;
+        void arrive ( Room * room, unsigned long step );
+        void step ( Room * room, unsigned long step );
+        Room * find ( const string & name ) const;
+        void list() const;
+        void settle ( unsigned id, int room );
+        vector< Room* > m_rooms;    // in order of creation
+        unsigned long m_steps;
+        vector< int > m_roomOf;     // by robot id, -1 for none
+        set< GameObject* > m_away;  // the robots in rooms
+        Constraint * m_constraint;
+        mutex m_stepMutex;
+        condition_variable m_stepped;   // a room's finished a step
+        unsigned long m_target;     // steps to have finished by the run's end
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// How often robots have gone into each cell, and how often they've been
+// turned back trying to move into it. The counts are saturating, 16 bits
+// for visits and 8 for rejected moves, in square tiles which are only made
+// for parts of the floor anyone goes near, so a big table with a few busy
+// aisles costs little. Off by default; not to be had in concurrent mode, the
+// counts being plain words.
+
+class Heatmap
+{
+    public:
+        static Heatmap * singleton();
+        void enable ( bool on );     // off forgets the counts
+        bool enabled() const;
+        void visit ( int xpos, int ypos );
+        void reject ( int xpos, int ypos );
+        // All the tiles in binary; see README.md for the layout.
+        void exportTo ( const string & fileName ) const;
+        // Write the count busiest cells, by visits or by rejected moves.
+        void top ( ostream & stream, size_t count, bool byRejections ) const;
+    private:
+        Heatmap();
+        enum { tileBits = 6, tileSide = 1 << tileBits, tileCells = tileSide * tileSide };
+        struct Tile
+        {
+            unsigned short visits[tileCells];      // row by row
+            unsigned char rejections[tileCells];
+        };
+        typedef map< pair< int, int >, Tile* > TileMap;
+        static int tileOf ( int pos );
+        Tile * tile ( int xpos, int ypos, size_t & index );
+        void clear();
+        TileMap m_tiles;
+        pair< int, int > m_lastKey;     // } the tile used last, which is
+        Tile * m_lastTile;              // } very likely the one wanted next
+        bool m_enabled;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Approximate counts of a great many keys in a fixed space: depth rows of
+// atomic counters, a key adding one to a counter in each row (chosen by a
+// hash of its own) and its count being the least of those, which can only
+// be too high, and then only by what other keys sharing all its counters
+// add. Counting takes no lock. Beside the counters is a heap of the keys
+// counted most, which a key is only checked against (under a mutex) when
+// its count reaches a power of two or a multiple of 64, so that a busy key
+// doesn't take the mutex on every count.
+
+class CountMinSketch
+{
+    public:
+        CountMinSketch();
+        ~CountMinSketch();
+        void add ( unsigned long long key );
+        // The keys counted most, most first, up to count of them.
+        void top ( size_t count, vector< pair< unsigned long long, unsigned > > & keys ) const;
+    private:
+        CountMinSketch ( const CountMinSketch & );
+        CountMinSketch & operator = ( const CountMinSketch & );
+        enum { depth = 4, widthBits = 12, width = 1 << widthBits, tracked = 32 };
+        static size_t column ( unsigned long long key, size_t row );
+        unsigned estimate ( unsigned long long key ) const;
+        atomic< unsigned > * m_counters;    // row by row
+        mutable mutex m_heapMutex;
+        vector< pair< unsigned, unsigned long long > > m_heap;  // least on top
+        atomic< unsigned > m_threshold;     // what it takes to get in the heap
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Why moves are turned back, for finding traffic jams: the table edge, a
+// robot in the way, or anything else. Which cells robots are turned back
+// from, and which robots hold up which, are counted in CountMinSketches,
+// so robots moving on any number of threads can all be counted at once.
+
+class Contention
+{
+    public:
+        static Contention * singleton();
+        // A move into the cell turned back by the given Constraint object.
+        void record ( Robot * robot, int xpos, int ypos, GameObject * rejecter );
+        // Totals, then the count busiest cells and pairs of robots.
+        void report ( ostream & stream, size_t count ) const;
+    private:
+        Contention();
+        CountMinSketch m_cells;
+        CountMinSketch m_pairs;     // robot held up, robot in the way
+        atomic< unsigned long > m_edge;
+        atomic< unsigned long > m_robots;
+        atomic< unsigned long > m_other;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// One end of a TCP connection to another good_robot process: the one holding
+// the next strip of the table, in distributed mode, or a leader or follower
+// in replication. A message is a count and then that many 32-bit numbers,
+// little-endian, or that many bytes of text.
+
+class SocketLink
+{
+    public:
+        // The peer is what to call the other end in errors.
+        SocketLink ( const string & peer );
+        ~SocketLink();
+        // Listen, then take the first connection, so that the other end can
+        // connect whenever it's ready.
+        void listen ( int port );
+        void accept();
+        // Tries again for a while if the other end isn't listening yet.
+        void connect ( const string & host, int port );
+        void send ( const vector< int > & words );
+        void receive ( vector< int > & words );
+        void send ( const string & text );
+        void receive ( string & text );
+    private:
+        void sendBytes ( const char * bytes, size_t count );
+        void receiveBytes ( char * bytes, size_t count );
+        size_t receiveCount();
+        string m_peer;
+        long long m_listener;   // } a SOCKET or a file descriptor,
+        long long m_socket;     // } -1 for none
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Steps of the whole fleet at once: every robot on the table tries to go
+// forward, into the cell in front if it's on the table, was empty at the
+// start of the step and no robot with a lower id is after it too, and
+// otherwise turns right. As each robot's step only depends on where
+// everyone was two rows either side of it, the table can be split into
+// strips of rows, each held by a process of its own (all reading the same
+// input, so everything else is the same everywhere). Each process steps
+// the robots in its strip, and after every step sends the process either
+// side the robots crossing into its strip and those in the two rows next
+// to it, which it keeps as ghosts. The strips stay as they are from one
+// fleet command to the next, and only when some other command comes along
+// does each process send every other the robots of its own which the steps
+// have changed, so that everyone's robots are where they've got to. A
+// process on its own holds the whole table.
+//
+// Every move is put to the Constraints, bar the Occupancy, the steps
+// keeping robots apart themselves; as the Robots stay where they were until
+// the strips are settled, capacity zones, which count who's where, can't
+// be had with fleet steps. Nor can a transaction, which couldn't undo them.
+
+class Fleet
+{
+    public:
+        static Fleet * singleton();
+        // Hold the given strip of count; peers are host:port, in order of
+        // strip, this process listening on the port of its own.
+        void distribute ( size_t strip, size_t count, const vector< string > & peers );
+        // Carry out a fleet command (see README.md).
+        void command ( const string & qualifiers );
+        void step ( unsigned long count );
+        // Put the robots where the steps so far have taken them, before
+        // anything else looks at them. Each process has to do so at the
+        // same point in the input.
+        void settle();
+    private:
+        Fleet();
+        struct Mover
+        {
+            unsigned id;
+            int xpos;
+            int ypos;
+            Direction direction;
+        };
+        static void pack ( const vector< Mover > & movers, vector< int > & words );
+        static size_t unpack ( const vector< int > & words, size_t from, vector< Mover > & movers );
+        static void border ( const vector< Mover > & movers, int low, int high, vector< Mover > & found );
+        // A step of the robots held, leaving those which cross to another
+        // strip in below and above.
+        void stepOnce
+        (   vector< Mover > & held,
+            const vector< Mover > & ghosts,
+            int low,
+            int high,
+            vector< Mover > & below,
+            vector< Mover > & above
+        ) const;
+        void gather ( vector< Mover > & movers );
+        size_t m_strip;
+        size_t m_count;
+        SocketLink * m_below;    // } to the strips either side, if there
+        SocketLink * m_above;    // } are any
+        bool m_stepping;         // the rest are only for while stepping
+        int m_low;
+        int m_high;
+        vector< Mover > m_held;
+        vector< Mover > m_ghosts;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Hot standby. The leader sends a follower process the text of every
+// command it carries out, once parsed and looked up (as one which throws
+// part way through may still have changed something), and the follower
+// carries them out in turn on a replica of the world, with its output
+// thrown away. Commands which change nothing, such as report and export,
+// aren't sent. The Engine's Ops go as the commands which would do the same,
+// and it won't go concurrent while leading, as the order in which Ops from
+// different threads took effect can't be told. Lines go in batches, from a
+// thread of their own, when a batch is full or a few milliseconds after its
+// first line, so that the executor only waits on the socket if the follower
+// falls far behind. The end of each input goes as an empty line, for the
+// follower to finish it as the Interpreter does, and the end of everything
+// as an empty batch. However the leader stops, the follower takes over then
+// and there, carrying on with its own input.
+
+class Replication
+{
+    public:
+        static Replication * singleton();
+        // Send to the follower listening at host:port.
+        void lead ( const string & address, size_t batchSize );
+        // Listen on the port, and follow the leader which connects until it
+        // stops.
+        void follow ( int port );
+        bool leading() const;
+        bool replicated ( const Command & command ) const;
+        // A replicated command carried out, or the end of an input if empty.
+        void log ( const string & commandString );
+        // Sends what's left and tells the follower that's all.
+        void finish();
+    private:
+        Replication();
+        // The sender thread.
+        static void send ( Replication * replication );
+        enum { flushDelay = 20 };       // ms
+        enum { backlogBatches = 64 };   // before the leader waits
+        SocketLink * m_link;
+        size_t m_batchSize;
+        thread * m_sender;
+        mutex m_mutex;
+        condition_variable m_changed;
+        string m_batch;         // lines not sent yet
+        size_t m_lines;
+        bool m_finishing;
+        bool m_lost;            // the follower's gone, so stop sending
+        bool m_lossReported;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Server mode: clients connect over TCP and send command lines, getting back
+// what each command writes, and the input files (or stdin) are a session of
+// their own, the console, writing to cout as ever. Each session is in a
+// lane, interactive or bulk, and has a queue of its own, which a thread per
+// session fills as lines arrive; the executor takes a line at a time from
+// the lanes with sessions waiting, by smooth weighted round robin, and from
+// the sessions in a lane in turn. So an operator's report only waits for
+// the bulk command in hand, however much bulk input is queued. Sessions
+// start in the bulk lane (the console in the interactive one), and only the
+// console can move them into the interactive one, with the session command
+// and their ids; a client can only move itself to bulk. The lanes command gives each
+// lane's queue and how long its lines waited. The server stops when the
+// console's input does.
+//
+// Queues are limited, in lines and bytes, per session and in all. A session
+// at either limit isn't read from again until its queue is down to half
+// (and the total too, unless it has nothing queued), so its client's sends
+// back up rather than the server's memory growing. A session with nothing
+// queued is always let in, so one client can't shut out the rest by
+// filling the total. How long each session has been held up is counted.
+//
+// There's no authentication, so the server listens on the loopback address
+// unless told otherwise, and clients only get the commands which move,
+// report on or look into robots; anything that writes files or changes the
+// world as a whole (table, destroy, export, heatmap, transactions and the
+// like) is for the console alone.
+
+class Server
+{
+    public:
+        enum Lane { Interactive, Bulk, Lanes };
+        static Server * singleton();
+        void setWeights ( unsigned interactive, unsigned bulk );
+        // How much can be queued, for each session and in all.
+        void setSessionBudget ( size_t lines, size_t bytes );
+        void setServerBudget ( size_t lines, size_t bytes );
+        // Listening on the host's address, "0.0.0.0" being any.
+        void serve
+        (   const string & host,
+            int port,
+            const vector< string > & fileNames
+        );
+        bool serving() const;
+        // Whether a client may give the command.
+        static bool allowed ( const Command & command );
+        // Carry out a session or lanes command (see README.md).
+        void session ( const string & qualifiers );
+        void report ( ostream & stream ) const;
+    private:
+        Server();
+        struct Budget
+        {
+            size_t lines;
+            size_t bytes;
+        };
+        struct Line
+        {
+            string text;
+            unsigned long long queued;      // microseconds, steady clock
+            bool endOfInput;                // of a console input file
+        };
+        struct Session
+        {
+            unsigned id;
+            string peer;
+            long long socket;               // -1 for the console
+            Lane lane;
+            deque< Line > lines;
+            size_t bytes;                   // of the lines queued
+            unsigned long long run;
+            bool throttled;                 // not being read from for now
+            unsigned long long throttledSince;
+            unsigned long long throttledFor;        // microseconds, before
+            condition_variable roomMade;            // throttledSince
+            bool listed;                    // in its lane's ready queue
+            bool ended;                     // no more input to come
+            bool closing;                   // nothing more to carry out
+            bool readerDone;
+            bool writerDone;
+            string outbox;                  // replies not sent yet
+            condition_variable outboxChanged;
+            thread * reader;
+            thread * writer;
+        };
+        enum { waitBuckets = 40 };
+        struct LaneState
+        {
+            unsigned weight;
+            long long current;              // for the round robin
+            deque< Session* > ready;        // sessions with lines queued
+            size_t sessions;
+            size_t queued;
+            size_t peakQueued;
+            unsigned long long run;
+            unsigned long long waits[waitBuckets];  // by bit length of the
+            unsigned long long longestWait;         // wait in microseconds
+        };
+        static void accept ( Server * server );
+        static void read ( Server * server, Session * session );
+        static void readConsole ( Server * server, Session * session, vector< string > fileNames );
+        static void write ( Server * server, Session * session );
+        static const char * laneName ( Lane lane );
+        Session * open ( const string & peer, long long socket, Lane lane );
+        void queue ( Session * session, const vector< Line > & lines );
+        // Whether a session can have more lines queued, or, if throttled,
+        // whether there's room enough to start reading again.
+        bool admitted ( const Session * session, bool resuming ) const;
+        void dequeued ( Session * session, size_t lines, size_t bytes );
+        void endInput ( Session * session );
+        void list ( Session * session );
+        Session * next ( Line & line );
+        void carryOut ( Session * session, const Line & line );
+        void close ( Session * session );
+        void finished ( Session * session );
+        void reap ( unique_lock< mutex > & lock );
+        mutable mutex m_mutex;
+        condition_variable m_work;
+        LaneState m_lanes[Lanes];
+        Budget m_sessionBudget;
+        Budget m_serverBudget;
+        Budget m_queued;            // in all
+        size_t m_throttled;         // sessions
+        vector< Session* > m_sessions;
+        Session * m_console;
+        string m_consoleError;      // such as an input file missing
+        Session * m_current;        // whose line is being carried out
+        unsigned m_nextId;
+        size_t m_finished;          // sessions whose threads are done
+        long long m_listener;
+        thread * m_acceptor;
+        bool m_serving;
+        bool m_stopping;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Robot commands held back between begin and commit. Commit works out where
+// they would leave everyone, checks all of that in one go against the
+// Occupancy (allowing for cells vacated and taken within the transaction)
+// and the other Constraints, and then makes it so, all or nothing.
+
+class Transaction
+{
+    public:
+        static Transaction * singleton();
+        bool open() const;
+        static bool holdsBack ( const string & commandName );
+        void begin();
+        void hold ( const Command & command );
+        void commit();
+        void abort();
+    private:
+        Transaction();
+        struct Proposal
+        {
+            Robot * robot;
+            int xpos;
+            int ypos;
+            Direction direction;
+            bool onTable;
+        };
+        void propose ( Robot * robot, const Command & command, map< Robot*, size_t > & proposed );
+        bool m_open;
+        vector< Command* > m_commands;
+        vector< Proposal > m_proposals;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// A robot as it was when a Snapshot was taken.
+
+struct RobotState
+{
+    unsigned id;
+    string name;
+    bool onTable;
+    int xpos;
+    int ypos;
+    Direction direction;
+    double fxpos;           // }
+    double fypos;           // } continuous mode
+    double xvelocity;       // }
+    double yvelocity;       // }
+};
+
+// The line Robot::report gives for a robot in the given state, without a
+// newline.
+void reportState ( ostream & stream, const RobotState & state, bool continuous );
+void appendReport ( string & buffer, const RobotState & state, bool continuous );
+
+//////////////////////////////////////////////////////////////////////////////
+// Versioned reads. The executor publishes a Snapshot of all the robots when
+// someone wants one: the interpreter for an export, the Engine after each
+// batch. A reader pins the latest one and can take as long as it likes over
+// it while the executor carries on and publishes newer ones. Once a Snapshot
+// has been superseded and its last reader has unpinned it, it's reclaimed
+// (and kept for reuse, rather than allocating afresh). A reclaimed Snapshot
+// is caught up by copying in only the robots changed since it was published,
+// so a batch of a few Ops doesn't cost a copy of every robot; anything
+// changed other than by the Engine's batches makes the next one a full copy.
+
+class Snapshot
+{
+    public:
+        unsigned long version() const;
+        bool continuous() const;
+        // All but destroyed robots, by id.
+        const vector< RobotState > & robots() const;
+    private:
+        Snapshot();
+        unsigned long m_version;
+        bool m_continuous;
+        vector< RobotState > m_robots;
+        unsigned m_pins;
+    friend class Snapshots;
+};
+
+class Snapshots
+{
+    public:
+        static Snapshots * singleton();
+        // For the executor only. The first copies every robot; the second
+        // only those with the given ids (besides catching up), which must
+        // be all that have changed since the last publish unless
+        // invalidate has been called since.
+        void publish();
+        void publish ( const vector< unsigned > & changed );
+        void invalidate();
+        // For anyone. pin gives 0 if nothing has been published yet.
+        const Snapshot * pin();
+        void unpin ( const Snapshot * snapshot );
+    private:
+        Snapshots();
+        void copyAll ( Snapshot * snapshot );
+        void copy ( Snapshot * snapshot, unsigned robotId );
+        mutex m_mutex;      // guards only the hand-over, not the reading
+        Snapshot * m_current;
+        vector< Snapshot* > m_spare;
+        unsigned long m_version;
+        // The rest is the executor's alone.
+        bool m_stale;                   // next publish must copy everything
+        vector< size_t > m_slots;       // per robot id, where it goes
+        // Robots changed by each publish since the last full copy, oldest
+        // first. A Snapshot older than m_floor can't be caught up from them.
+        vector< pair< unsigned long, unsigned > > m_changes;
+        unsigned long m_floor;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// A fixed set of worker threads for splitting work up. run() hands out tasks
+// 0 to count-1 among the workers and the calling thread, and returns once
+// they're all done.
+
+typedef void (*WorkerTask) ( size_t task, void * context );
+
+class WorkerPool
+{
+    public:
+        static WorkerPool * singleton();
+        size_t size() const;    // counting the calling thread
+        void run ( size_t count, WorkerTask task, void * context );
+    private:
+        WorkerPool();
+        static void work ( WorkerPool * pool );
+        void runTasks();
+        mutex m_runMutex;   // one run at a time
+        mutex m_mutex;
+        condition_variable m_started;
+        condition_variable m_finished;
+        vector< thread* > m_threads;
+        unsigned long m_generation;
+        WorkerTask m_task;
+        void * m_context;
+        size_t m_count;
+        size_t m_next;
+        size_t m_unfinished;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Input in the LZ4 frame format, as the lz4 command-line tool writes it by
+// default (independent blocks), decoded here rather than with the LZ4
+// library. A reader thread of its own reads the blocks a batch at a time and
+// has each batch decoded on the WorkerPool, one block per task, while the
+// batch before is being parsed. Checksums are skipped, not checked.
+
+class CompressedInput
+{
+    public:
+        // Reads the start of the stream, and puts it back unless it's LZ4.
+        static bool recognise ( FILE * stream );
+        CompressedInput ( FILE * stream );      // just past the recognised start
+        ~CompressedInput();
+        // The next block's text, or false at the end. Good until the next call.
+        bool nextBlock ( const char * & data, size_t & size );
+    private:
+        CompressedInput ( const CompressedInput & );
+        CompressedInput & operator = ( const CompressedInput & );
+        struct Batch
+        {
+            Batch();
+            size_t size;                    // blocks
+            size_t maxBlockSize;
+            vector< string > compressed;
+            vector< char > stored;          // not compressed after all
+            vector< vector< char > > decoded;
+            vector< size_t > decodedSize;
+            vector< char > corrupt;
+            bool ready;                     // for parsing
+            bool last;
+            string error;
+        };
+        static void read ( CompressedInput * input );
+        void fill ( Batch & batch, size_t blocks );
+        string readDescriptor();
+        bool readWord ( unsigned long & word );
+        bool skip ( size_t bytes );
+        static void decode ( size_t block, void * context );
+        static bool decodeBlock
+        (   const string & compressed,
+            vector< char > & decoded,
+            size_t & decodedSize
+        );
+        enum { batches = 2 };
+        FILE * m_stream;
+        size_t m_maxBlockSize;
+        bool m_blockChecksums;
+        bool m_contentChecksum;
+        bool m_stopping;
+        Batch m_batches[batches];
+        size_t m_parsing;           // batch index
+        size_t m_nextBlock;         // within it
+        mutex m_mutex;
+        condition_variable m_changed;
+        thread * m_reader;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The report lines for a whole broadcast at once. While it's collecting,
+// Robot::report and Table::report add to it instead of writing to cout.
+// When the broadcast is over the robots' lines are formatted in chunks, one
+// buffer each, shared out across the WorkerPool, and the buffers written out
+// in the order the lines were added.
+
+class ReportWriter
+{
+    public:
+        static ReportWriter * singleton();
+        void collect();
+        bool collecting() const;
+        void add ( const Robot * robot );
+        void add ( const string & line );
+        void flush();
+    private:
+        ReportWriter();
+        static void format ( size_t chunk, void * context );
+        struct Entry
+        {
+            const Robot * robot;    // or 0 for
+            size_t line;            // this one of m_lines
+        };
+        bool m_collecting;
+        bool m_continuous;
+        vector< Entry > m_entries;
+        vector< string > m_lines;
+        vector< string > m_buffers;     // one per chunk, kept for reuse
+        size_t m_chunkSize;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Parses a CommandStream a window of text at a time. Each window, ending at
+// the end of a line, is cut at line ends into a chunk per worker, and the
+// chunks are parsed side by side into SymbolicCommands. Unlike
+// CommandStream::getCommand, it doesn't mind how long lines are.
+
+class ParallelParser
+{
+    public:
+        // Checking arguments too, if asked.
+        ParallelParser ( CommandStream & stream, bool checkArguments = false );
+        // Parse the next window; false at the end.
+        bool parseWindow();
+        // Its commands, chunk by chunk, in order.
+        size_t chunks() const;
+        size_t size ( size_t chunk ) const;
+        const SymbolicCommand & command ( size_t chunk, size_t inx ) const;
+    private:
+        ParallelParser ( const ParallelParser & );
+        ParallelParser & operator = ( const ParallelParser & );
+        struct Chunk
+        {
+            size_t start;
+            size_t end;
+            vector< SymbolicCommand > commands;     // kept for reuse, so
+            size_t size;                            // only this many count
+            size_t lines;                           // blank ones included
+        };
+        static void parse ( size_t chunk, void * context );
+        enum { windowSize = 16 * 1024 * 1024 };
+        CommandStream & m_stream;
+        bool m_checkArguments;
+        size_t m_lines;             // before this window
+        vector< char > m_buffer;
+        size_t m_used;              // } in m_buffer
+        size_t m_cut;               // }
+        bool m_atEnd;
+        vector< Chunk > m_chunks;
+        size_t m_chunkCount;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// For --check: input is parsed (and arguments checked) by a ParallelParser,
+// and then the names are looked up in order, but nothing is carried out.
+// Instead the robot and group names are kept track of here, as create,
+// destroy, group and ungroup would leave them, along with whether there's a
+// transaction open. Timestamped commands are taken in the order they're
+// read rather than that of their times.
+
+class Checker
+{
+    public:
+        Checker();
+        // Report each error in the input, as "<source>:<line>: <what>", as
+        // if it came after the inputs checked before. Returns how many.
+        size_t check ( CommandStream & stream, const string & source );
+    private:
+        // Throws if the command's no good; false for quit.
+        bool checkCommand ( const SymbolicCommand & parsed );
+        set< string > m_robots;
+        set< string > m_groups;
+        set< string > m_rooms;
+        bool m_transactionOpen;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Output written by a thread of its own, so the executor needn't wait on a
+// slow pipe. While there's an AsyncOutput, cout and cerr write into fixed
+// size blocks, and full blocks go to the writer thread over a lock-free
+// queue and come back over another one once written. (Switching between
+// cout and cerr hands over the block so far, so the two stay in order.) A
+// flush only hands over a block if the writer has nothing else to do; until
+// then lines pile up in the block, which is what keeps the writing efficient.
+// The blocks in use are limited to the memory cap given: at the cap the
+// executor either waits for the writer or throws output away, counting it.
+// Only one thread is to write at a time.
+
+class AsyncOutput
+{
+    public:
+        AsyncOutput ( size_t memoryCap, bool dropWhenFull );
+        ~AsyncOutput();     // writes out everything and puts cout, cerr back
+        unsigned long long dropped() const;     // bytes
+    private:
+        AsyncOutput ( const AsyncOutput & );
+        AsyncOutput & operator = ( const AsyncOutput & );
+
+        enum { blockSize = 64 * 1024 };
+        struct Block
+        {
+            FILE * target;
+            size_t size;
+            char data[blockSize];
+        };
+
+        // Single producer, single consumer.
+        class BlockQueue
+        {
+            public:
+                BlockQueue ( size_t capacity );
+                ~BlockQueue();
+                bool push ( Block * block );
+                Block * pop();
+                bool empty() const;
+            private:
+                BlockQueue ( const BlockQueue & );
+                BlockQueue & operator = ( const BlockQueue & );
+                size_t m_capacity;
+                Block ** m_slots;
+                atomic< size_t > m_head;    // next to pop
+                atomic< size_t > m_tail;    // next to push
+        };
+
+        class Buffer : public streambuf
+        {
+            public:
+                Buffer ( AsyncOutput & output, FILE * target );
+            protected:
+                int overflow ( int ch );
+                streamsize xsputn ( const char * data, streamsize size );
+                int sync();
+            private:
+                AsyncOutput & m_output;
+                FILE * m_target;
+        };
+
+        void write ( FILE * target, const char * data, size_t size );
+        void handOver ( bool always );
+        static void drain ( AsyncOutput * output );
+
+        bool m_dropWhenFull;
+        size_t m_maxBlocks;
+        size_t m_blocks;
+        Block * m_current;
+        BlockQueue m_full;
+        BlockQueue m_free;
+        unsigned long long m_dropped;
+        atomic< bool > m_stopping;
+        mutex m_wakeMutex;
+        condition_variable m_wake;
+        Buffer m_coutBuffer;
+        Buffer m_cerrBuffer;
+        streambuf * m_oldCoutBuffer;
+        streambuf * m_oldCerrBuffer;
+        thread * m_writer;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Query threads, each writing out a pinned Snapshot, left to get on with it.
+// Those that have finished are waited for when the next export starts, and
+// the rest when the input runs out.
+
+class Queries
+{
+    public:
+        static Queries * singleton();
+        void exportTo ( const string & fileName );
+        void finish();
+    private:
+        Queries();
+        struct Export
+        {
+            thread * writer;
+            atomic< bool > written;
+        };
+        static void write
+        (   Export * query,
+            ostream * stream,
+            const Snapshot * snapshot
+        );
+        void reap ( bool all );
+        vector< Export* > m_exports;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class Interpreter
+{
+    public:
+        Interpreter ( CommandStream & commandStream, bool parallelParse = false );
+        void run();
+        // Carry out a command line, saying what's wrong with it if anything;
+        // false for quit. A client of the Server's is refused what the
+        // Server doesn't allow it.
+        static bool perform ( const string & commandString, bool client = false );
+        // Now or, if it's timed, later. Takes the Command over. False for
+        // quit.
+        static bool carryOut ( Command * command );
+        // Carry out a Command; false for quit.
+        static bool execute ( const Command & command );
+        // What's left to do at the end of an input.
+        static void finish();
+        static void reportException ( const string & commandString );
+    private:
+        void runParsedInParallel();
+        CommandStream & m_commandStream;
+        bool m_parallelParse;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Interpreter(s) submit(s) stuff on to singleton Broadcaster which broadcasts
+// to all Listeners. That's not going to scale well for enormous games, is it?
+
+class Broadcaster
+{
+    public:
+        static Broadcaster * singleton();
+        void createCommandListener
+        (   GameObject * object,
+            GameObjectResponder responder
+        );
+        void removeCommandListener ( GameObject * object );
+        void broadcast ( const Command & command );
+    private:
+        void deliver ( const Command & command );
+        void inform ( GameObject * object, const Command & command );
+        static Broadcaster * m_broadcaster;
+        vector< CommandListener* > m_commandListeners;
+        map< GameObject*, CommandListener* > m_listenersByObject;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class Constraint
+{
+    public:
+        static bool acceptable
+        (   GameObject * object,
+            int xpos,
+            int ypos,
+            Direction direction,
+            bool onTable,
+            GameObject * ignoring = 0,
+            GameObject ** rejecter = 0     // who said no (0 for a bad direction)
+        );
+        // A Constraint which can only ever object to moves into some
+        // rectangle (with the maxima, as for the table, just outside it)
+        // isn't asked about moves anywhere else.
+        void setExtent ( int xmin, int ymin, int xmax, int ymax );
+    private:
+        Constraint
+        (   GameObject * object,
+            ConstraintDecider decider,
+            unsigned cost,
+            size_t sequence
+        );
+        bool covers ( int xpos, int ypos ) const;
+        GameObject * m_object;
+        ConstraintDecider m_decider;
+        unsigned m_cost;
+        size_t m_sequence;          // in order of creation
+        bool m_bounded;
+        int m_xmin;
+        int m_ymin;
+        int m_xmax;
+        int m_ymax;
+        // Bumped without read-modify-write, so in concurrent mode a count
+        // can be missed now and again but nothing locks the bus.
+        atomic< unsigned long long > m_calls;
+        atomic< unsigned long long > m_rejections;
+    friend class ConstraintFactory;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Constraints are asked in an order of their own, which every so many
+// checks (other than in concurrent mode) is worked out afresh from how
+// often each has been asked and has said no, and the cost of asking it
+// declared when it was made: those with the least cost per rejection go
+// first, so that a move which is going to be turned back is turned back as
+// cheaply as can be. Ties go in order of creation, so the order only
+// depends on what's been checked, never on where things are in memory.
+
+class ConstraintFactory
+{
+    public:
+        static ConstraintFactory * singleton();
+        // Cost is in whatever units, as long as they're the same for all.
+        Constraint * createConstraint
+        (   GameObject * object,
+            ConstraintDecider decider,
+            unsigned cost = 1
+        );
+        const vector< Constraint* > & constraints() const;
+        // Count a check, reordering when it's time to.
+        void checked();
+        // Each Constraint, in order, and its figures.
+        void report ( ostream & stream ) const;
+    private:
+        enum { reorderInterval = 1024 };
+        ConstraintFactory();
+        void reorder();
+        static bool cheaper ( const Constraint * first, const Constraint * second );
+        vector< Constraint* > m_constraints;
+        atomic< unsigned long long > m_checks;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class Tokeniser
+{
+    public:
+        Tokeniser ( const string & stringToParse, const string & separators );
+        string nextToken();
+    private:
+        string m_stringToParse;
+        vector< size_t > m_offsets;     // of all the tokens, found up front
+        size_t m_tokens;
+        size_t m_nextToken;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+class InvalidCommandException : public exception
+{
+    public:
+        InvalidCommandException ( const string & message )
+          : exception ( message.c_str() ) {}
+};
+
+class InvalidDirectionException : public exception
+{
+    public:
+        InvalidDirectionException
+        (   const string & directionString,
+            const string & message
+        ) : exception ( message.c_str() ), m_directionString ( directionString ) {}
+        const string & directionString() const { return m_directionString; }
+    private:
+        string m_directionString;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The typed way in, for programs which drive the robots themselves and would
+// otherwise have to write commands out as text only for them to be parsed
+// straight back in. Robots are named by id (see RobotFactory). A batch of Ops
+// is done in order, each Op's outcome going into the OpResult at the same
+// index of a buffer the caller provides, so nothing is allocated per Op and
+// nothing is written to cout: a rejected Op is just marked as such.
+// Transactions and timed commands are for the command language only; Ops
+// take effect at once.
+//
+// In concurrent mode several threads can submit at once. Each Op takes its
+// robot for itself for as long as it lasts, so Ops on one robot happen one
+// at a time, and moves claim cells in Occupancy's CellGrid, so Ops on
+// different robots go ahead side by side without a lock. Only the table
+// edges and other robots constrain them. The table and the set of robots
+// must stay as they are until concurrent mode is turned off again, and not
+// in continuous mode.
+
+enum OpCode { OpPlace, OpMove, OpLeft, OpRight, OpReport, OpRemove };
+
+struct Op
+{
+    OpCode code;
+    unsigned robot;
+    int xpos;               // }
+    int ypos;               // } OpPlace only
+    Direction direction;    // }
+};
+
+enum OpStatus
+{
+    OpDone,
+    OpRejected,             // by a Constraint
+    OpNotOnTable,
+    OpNoSuchRobot,
+    OpInvalid               // unknown code or direction
+};
+
+struct OpResult
+{
+    OpStatus status;
+    int xpos;               // }
+    int ypos;               // } where the robot is afterwards
+    Direction direction;    // }
+    bool onTable;           // }
+};
+
+class Engine
+{
+    public:
+        static Engine * singleton();
+        unsigned createRobot ( const string & robotName );
+        bool robotId ( const string & robotName, unsigned & id ) const;
+        // Returns how many of the Ops were done.
+        size_t submit ( const Op * ops, size_t count, OpResult * results );
+        void setConcurrent ( bool concurrent );
+        bool concurrent() const;
+        // The robots as of the latest batch (submitted other than
+        // concurrently), for reading from any thread. Unpin when done.
+        const Snapshot * pin();
+        void unpin ( const Snapshot * snapshot );
+    private:
+        Engine();
+        OpStatus perform ( Robot * robot, const Op & op );
+        OpStatus shift
+        (   Robot * robot,
+            int xpos,
+            int ypos,
+            Direction direction,
+            GameObject ** rejecter = 0
+        );
+        void take ( unsigned robotId );
+        void give ( unsigned robotId );
+        static void replicate ( Robot * robot, const Op & op );
+        atomic< bool > * m_owned;   // per robot id, concurrent mode only
+        size_t m_ownedCount;
+        vector< unsigned > m_changed;   // by the batch being submitted
+};
+
+#endif // GOOD_ROBOT_ENGINE_HXX
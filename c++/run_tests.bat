@@ -5,9 +5,40 @@ REM I use unxutils.
 
 setlocal enabledelayedexpansion
 
+REM The test programs drive good_robot_engine.cxx directly, so build them
+REM first. Set CXX for a compiler other than c++.
+if "%CXX%"=="" set CXX=c++
+%CXX% -o test_engine test_engine.cxx good_robot_engine.cxx
+%CXX% -o test_client test_client.cxx
+
 call :testIt test_input1.txt test_output1.txt
 call :testIt missing_test_input2.txt test_output2.txt
 call :testItFromStdin  test_input1.txt test_output1.txt
+call :testItWithAsyncOutput test_input1.txt test_output1.txt
+call :testIt test_input1.lz4 test_output1.txt
+call :testItWithParallelParse test_input1.txt test_output1.txt
+call :testIt test_input3.txt test_output3.txt
+call :testIt test_input4.txt test_output4.txt
+call :testIt test_input5.txt test_output5.txt
+call :testIt test_input6.txt test_output6.txt
+call :testIt test_input7.txt test_output7.txt
+call :testIt test_input8.txt test_output8.txt
+call :testIt test_input9.txt test_output9.txt
+call :testItWithCheck test_input10.txt test_output10.txt
+call :testIt test_input11.txt test_output11.txt
+call :testIt test_input12.txt test_output12.txt
+call :testIt test_input13.txt test_output13.txt
+call :testIt test_input14.txt test_output14.txt
+call :testIt test_input15.txt test_output15.txt
+call :testIt test_input16.txt test_output16.txt
+call :testIt test_input17.txt test_output17.txt
+call :testItDistributed test_input17.txt test_output17.txt
+call :testItReplicated test_input15.txt test_input18.txt test_output18.txt
+call :testItServing test_input19.txt test_output19.txt
+call :testItThrottled test_input15.txt test_output15.txt
+call :testProgram test_engine test_output20.txt
+call :testItWithClients test_output21.txt
+call :testItWithClientsThrottled test_output21.txt
 goto :eof
 
 :testIt
@@ -39,3 +70,163 @@ if %diffCount% gtr 0 (
     echo OK: stdin test %in% succeeded
 )
 goto :eof
+
+:testItWithAsyncOutput
+set in=%1
+set out=%2
+( good_robot --async-output %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: async output test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: async output test %in% succeeded
+)
+goto :eof
+
+:testItWithParallelParse
+set in=%1
+set out=%2
+( good_robot --parallel-parse %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: parallel parse test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: parallel parse test %in% succeeded
+)
+goto :eof
+:testItWithCheck
+set in=%1
+set out=%2
+( good_robot --check %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: check test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: check test %in% succeeded
+)
+goto :eof
+
+:testItDistributed
+set in=%1
+set out=%2
+REM The second strip's process runs alongside, its output (the same) unused.
+start /b "" good_robot --strip=1/2 --peers=localhost:47801,localhost:47802 %in% > nul 2>&1
+( good_robot --strip=0/2 --peers=localhost:47801,localhost:47802 %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: distributed test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: distributed test %in% succeeded
+)
+goto :eof
+
+:testItReplicated
+set leaderIn=%1
+set in=%2
+set out=%3
+REM The leader runs alongside, its output (that of %leaderIn% alone) unused,
+REM and the follower takes over with %in% once the leader's finished.
+start /b "" good_robot --replicate-to=localhost:47803 %leaderIn% > nul 2>&1
+( good_robot --follow=47803 %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: replicated test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: replicated test %in% succeeded
+)
+goto :eof
+
+:testItServing
+set in=%1
+set out=%2
+REM No clients connect, so it's just the console.
+( good_robot --serve=47806 %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: server test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: server test %in% succeeded
+)
+goto :eof
+
+:testItThrottled
+set in=%1
+set out=%2
+REM Budgets so small that the console is held up every line or so, which
+REM mustn't change what it does.
+( good_robot --serve=47807 --session-budget=1,16 --server-budget=2,32 %in% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: throttled server test %in% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: throttled server test %in% succeeded
+)
+goto :eof
+
+:testProgram
+set program=%1
+set out=%2
+( %program% 2>&1 ) > out.txt
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: program test %program% failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: program test %program% succeeded
+)
+goto :eof
+
+:testItWithClients
+set out=%1
+REM test_client is the console, through the pipe, as well as connecting as
+REM clients, and only what it finds is compared.
+test_client 47808 2> out.txt | good_robot --serve=47808 > nul 2>&1
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: client test failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: client test succeeded
+)
+goto :eof
+
+:testItWithClientsThrottled
+set out=%1
+REM Budgets small enough that the flooding client is held up time and again,
+REM which mustn't change what the clients find.
+test_client 47809 2> out.txt | good_robot --serve=47809 --session-budget=100,4096 --server-budget=150,8192 > nul 2>&1
+REM diff -q counts different line-endings. We don't care about those, so
+REM use diff ... | wc -l
+for /f %%t in ( 'diff out.txt %out% ^| wc -l' ) do set /a diffCount=%%t
+if %diffCount% gtr 0 (
+    echo ERROR: throttled client test failed:
+    diff -c out.txt %out%
+) else (
+    echo OK: throttled client test succeeded
+)
+goto :eof
@@ -0,0 +1,401 @@
+/*
+
+Connects to good_robot in server mode as several clients at once, while being
+its console too, for run_tests to compare what it finds with test_output21.txt:
+
+    % c++ -o test_client test_client.cxx
+    % test_client 47808 2> out.txt | good_robot --serve=47808 > /dev/null
+
+Its standard output is the server's console input, and it writes what it finds
+to standard error, a line or so for each test that doesn't depend on timing.
+The server stops when it's done, as the console's input ends.
+
+    client 2:   the commands a client isn't allowed, including moving itself
+                into the interactive lane, and a few it is, with their replies.
+
+    client 3:   floods the bulk lane with far more lines than its session is
+                allowed to queue, which must all be carried out in the end,
+                with never more than its budget queued at once, the server
+                having stopped reading from it rather than drop it.
+
+    client 4:   moved into the interactive lane by the console, and then sends
+                a burst of lines while client 3 is still flooding, among which
+                no more than one bulk line is carried out (the lanes' weights
+                being 16 to 1).
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment ( lib, "ws2_32.lib" )
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+void closeSocket ( SocketHandle handle )
+{
+    closesocket ( handle );
+}
+const int sendingSide = SD_SEND;
+void startSockets()
+{
+    WSADATA data;
+    if ( WSAStartup ( MAKEWORD ( 2, 2 ), &data ) != 0 )
+    {
+        throw exception ( "Cannot start Windows Sockets" );
+    }
+}
+#else
+typedef int SocketHandle;
+void closeSocket ( SocketHandle handle )
+{
+    close ( handle );
+}
+const int sendingSide = SHUT_WR;
+void startSockets()
+{
+}
+#endif
+
+const unsigned floodLines = 200000;
+const unsigned burstReports = 8;
+
+// A connection to the server, a line at a time each way.
+class Client
+{
+    public:
+        Client ( int port );
+        ~Client();
+        void send ( const string & text );
+        // No more to send; the server still replies to what's been sent.
+        void finish();
+        // False at the end of the replies.
+        bool receive ( string & line );
+        // Replies up to and including the first starting with prefix.
+        vector< string > receiveUntil ( const string & prefix );
+    private:
+        SocketHandle m_socket;
+        string m_buffer;
+};
+
+Client::Client ( int port )
+{
+    addrinfo hints;
+    memset ( &hints, 0, sizeof hints );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    stringstream portStream;
+    portStream << port;
+    addrinfo * found = 0;
+    if ( getaddrinfo ( "127.0.0.1", portStream.str().c_str(), &hints, &found ) != 0 )
+    {
+        throw exception ( "Cannot find 127.0.0.1" );
+    }
+
+    // For up to half a minute, as the server may not be listening yet.
+    bool connected = false;
+    for ( int attempt = 0; attempt < 300 && ! connected; ++attempt )
+    {
+        m_socket = socket ( found->ai_family, found->ai_socktype, found->ai_protocol );
+        connected = ::connect ( m_socket, found->ai_addr, static_cast< int > ( found->ai_addrlen ) ) == 0;
+        if ( ! connected )
+        {
+            closeSocket ( m_socket );
+            this_thread::sleep_for ( chrono::milliseconds ( 100 ) );
+        }
+    }
+    freeaddrinfo ( found );
+    if ( ! connected )
+    {
+        throw exception ( ( "Cannot connect to port " + portStream.str() ).c_str() );
+    }
+}
+
+Client::~Client()
+{
+    closeSocket ( m_socket );
+}
+
+void Client::send ( const string & text )
+{
+    for ( size_t sent = 0; sent < text.size(); )
+    {
+        int chunk = ::send ( m_socket, text.data() + sent, static_cast< int > ( text.size() - sent ), 0 );
+        if ( chunk <= 0 )
+        {
+            throw exception ( "Lost the connection sending" );
+        }
+        sent += chunk;
+    }
+}
+
+void Client::finish()
+{
+    shutdown ( m_socket, sendingSide );
+}
+
+bool Client::receive ( string & line )
+{
+    for ( ;; )
+    {
+        size_t end = m_buffer.find ( '\n' );
+        if ( end != string::npos )
+        {
+            line = m_buffer.substr ( 0, end );
+            m_buffer.erase ( 0, end + 1 );
+            return true;
+        }
+        char bytes[4096];
+        int received = recv ( m_socket, bytes, sizeof bytes, 0 );
+        if ( received <= 0 )
+        {
+            return false;
+        }
+        m_buffer.append ( bytes, received );
+    }
+}
+
+vector< string > Client::receiveUntil ( const string & prefix )
+{
+    vector< string > lines;
+    string line;
+    while ( receive ( line ) )
+    {
+        lines.push_back ( line );
+        if ( line.compare ( 0, prefix.size(), prefix ) == 0 )
+        {
+            return lines;
+        }
+    }
+    throw exception ( ( "Connection closed waiting for " + prefix ).c_str() );
+}
+
+// What the console says goes to the server as soon as it's said.
+void console ( const string & line )
+{
+    cout << line << endl;
+}
+
+// From lanes: the line starting with the prefix, if any, else empty.
+string lanesLine ( const vector< string > & lines, const string & prefix )
+{
+    for ( size_t inx = 0; inx < lines.size(); ++inx )
+    {
+        if ( lines[inx].compare ( 0, prefix.size(), prefix ) == 0 )
+        {
+            return lines[inx];
+        }
+    }
+    return string();
+}
+
+// The number just before or just after the first of the words in the line.
+unsigned long numberBefore ( const string & line, const string & words )
+{
+    size_t at = line.find ( words );
+    if ( at == string::npos || at == 0 )
+    {
+        throw exception ( ( "No number before \"" + words + "\" in " + line ).c_str() );
+    }
+    return strtoul ( line.c_str() + line.find_last_of ( ' ', at - 1 ) + 1, 0, 10 );
+}
+
+unsigned long numberAfter ( const string & line, const string & words )
+{
+    size_t at = line.find ( words );
+    if ( at == string::npos )
+    {
+        throw exception ( ( "No number after \"" + words + "\" in " + line ).c_str() );
+    }
+    return strtoul ( line.c_str() + at + words.size(), 0, 10 );
+}
+
+bool isInteractive ( const vector< string > & lines, unsigned id )
+{
+    stringstream prefix;
+    prefix << "Session " << id << " ";
+    return lanesLine ( lines, prefix.str() ).find ( "): interactive," ) != string::npos;
+}
+
+// Is the server holding the flood (session 3) up, not reading from it?
+bool heldUp ( const vector< string > & lines )
+{
+    return lanesLine ( lines, "Session 3 " ).find ( " run, held up for " ) != string::npos;
+}
+
+// Has the flood (session 3) got more queued than its budget?
+bool overBudget ( const vector< string > & lines )
+{
+    string line ( lanesLine ( lines, "Session 3 " ) );
+    return ! line.empty() && numberBefore ( line, " lines of " ) > numberAfter ( line, " lines of " );
+}
+
+void testRestricted ( int port )
+{
+    Client client ( port );
+    client.send ( "table 0 0 9 9\n"
+                  "heatmap on\n"
+                  "export client_export.txt\n"
+                  "session interactive\n"
+                  "session 1 bulk\n"
+                  "Robbie: place 1 1 north\n"
+                  "Robbie: move\n"
+                  "Robbie: report\n"
+                  "session bulk\n"
+                  "quit\n" );
+    client.finish();
+    cerr << "client 2:" << endl;
+    string line;
+    while ( client.receive ( line ) )
+    {
+        cerr << "    " << line << endl;
+    }
+}
+
+struct Flood
+{
+    Client * client;
+    string lastReply;
+    atomic< bool > done;
+};
+
+void flood ( Flood * flood )
+{
+    string lines;
+    for ( unsigned inx = 0; inx < floodLines; ++inx )
+    {
+        lines += "Flood: left\n";
+    }
+    lines += "Flood: report\n";
+    flood->client->send ( lines );
+    flood->client->finish();
+    string line;
+    while ( flood->client->receive ( line ) )
+    {
+        flood->lastReply = line;
+    }
+    flood->done = true;
+}
+
+void testLanes ( int port )
+{
+    // Each connects once the one before has been answered, so that the
+    // session ids go in order.
+    Client bulk ( port );
+    bulk.send ( "create Flood\nFlood: place 4 4 north\nFlood: report\n" );
+    bulk.receiveUntil ( "Robot Flood" );
+    Flood flooding;
+    flooding.client = &bulk;
+    flooding.done = false;
+    thread flooder ( flood, &flooding );
+
+    Client interactive ( port );
+    const string poll ( "lanes\nRobbie: report\n" );
+    interactive.send ( poll );
+    vector< string > lanes ( interactive.receiveUntil ( "Robot Robbie" ) );
+    console ( "session 4 interactive" );
+
+    // Watching the flood's queue until the console's moved this one and
+    // the server's holding the flood up, its queue full, so that there's
+    // plenty of bulk waiting for the burst to get ahead of.
+    bool withinBudget = true;
+    while ( ! ( isInteractive ( lanes, 4 ) && heldUp ( lanes ) ) && ! flooding.done )
+    {
+        withinBudget = withinBudget && ! overBudget ( lanes );
+        interactive.send ( poll );
+        lanes = interactive.receiveUntil ( "Robot Robbie" );
+    }
+    cerr << "client 4: " << ( isInteractive ( lanes, 4 ) ? "moved" : "NOT moved" )
+         << " into the interactive lane by the console" << endl;
+    cerr << "client 3: " << ( heldUp ( lanes ) ? "held up" : "NOT held up" )
+         << " with its queue full" << endl;
+
+    // A burst, bracketed by lanes to see how far the flood got meanwhile.
+    string burst ( "lanes\n" );
+    for ( unsigned inx = 0; inx < burstReports; ++inx )
+    {
+        burst += "Robbie: report\n";
+    }
+    burst += "lanes\nRobbie: report\n";
+    interactive.send ( burst );
+    vector< string > replies ( interactive.receiveUntil ( "Robot Robbie" ) );
+    for ( unsigned inx = 0; inx < burstReports; ++inx )
+    {
+        vector< string > more ( interactive.receiveUntil ( "Robot Robbie" ) );
+        replies.insert ( replies.end(), more.begin(), more.end() );
+    }
+    size_t second = 0;
+    for ( size_t inx = 1; inx < replies.size(); ++inx )
+    {
+        if ( replies[inx].compare ( 0, 5, "Lane " ) == 0 && replies[inx - 1].compare ( 0, 5, "Lane " ) != 0 )
+        {
+            second = inx;
+        }
+    }
+    vector< string > first ( replies.begin(), replies.begin() + second );
+    vector< string > last ( replies.begin() + second, replies.end() );
+    withinBudget = withinBudget && ! overBudget ( first ) && ! overBudget ( last );
+    string before ( lanesLine ( first, "Session 3 " ) );
+    string after ( lanesLine ( last, "Session 3 " ) );
+    if ( second == 0 || before.empty() || after.empty() )
+    {
+        cerr << "client 4: client 3 had finished before the burst" << endl;
+    }
+    else
+    {
+        cerr << "client 4: "
+             << ( numberBefore ( after, " run," ) - numberBefore ( before, " run," ) <= 1 ? "at most one" : "more than one" )
+             << " bulk line carried out among its " << burstReports + 2 << " interactive ones" << endl;
+    }
+
+    flooder.join();
+    cerr << "client 3: " << flooding.lastReply << endl;
+    cerr << "client 3: " << ( withinBudget ? "never more" : "MORE" ) << " than its budget queued" << endl;
+}
+
+}
+
+extern int main ( int argc, char ** argv )
+{
+    try
+    {
+        if ( argc != 2 )
+        {
+            throw exception ( "Usage: test_client <port>" );
+        }
+        int port = atoi ( argv[1] );
+        startSockets();
+        testRestricted ( port );
+        testLanes ( port );
+    }
+    catch ( exception & e )
+    {
+        cerr << "Caught exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+
+Drives good_robot_engine.cxx through the Engine class alone, the way another
+program would, for run_tests to compare what it prints with test_output20.txt.
+
+    % c++ -o test_engine test_engine.cxx good_robot_engine.cxx
+
+Each test prints a line or so that doesn't depend on timing, so that a
+failure shows up as a difference.
+
+    batch:      one batch of Ops on a robot of its own, each with its
+                OpResult, between them everything an Op can come to.
+
+    snapshot:   a Snapshot pinned before more batches, which must still
+                show the robots as they were, while a fresh pin shows them
+                as they are.
+
+    concurrent: two threads in concurrent mode, one re-placing Robbie on his
+                own cell again and again and the other trying to place Sally
+                there. Robbie must never give his cell up, even for a moment.
+*/
+
+#include <iostream>
+
+#include "good_robot_engine.hxx"
+
+//////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+const unsigned concurrentRounds = 1000000;
+
+const char * statusName ( OpStatus status )
+{
+    switch ( status )
+    {
+        case OpDone:            return "done";
+        case OpRejected:        return "rejected";
+        case OpNotOnTable:      return "not on table";
+        case OpNoSuchRobot:     return "no such robot";
+        case OpInvalid:         return "invalid";
+    }
+    return "?";
+}
+
+void printResult ( const OpResult & result )
+{
+    cout << "    " << statusName ( result.status );
+    if ( result.onTable )
+    {
+        cout << ", at " << result.xpos << ',' << result.ypos << ','
+             << directionName ( result.direction );
+    }
+    cout << endl;
+}
+
+void testBatch()
+{
+    Engine * engine = Engine::singleton();
+    unsigned tracy = engine->createRobot ( "Tracy" );
+    unsigned nobody = tracy + 100;
+    Op ops[] =
+    {
+        { OpMove, tracy },                      // not placed yet
+        { OpPlace, tracy, 0, 0, North },
+        { OpMove, tracy },
+        { OpRight, tracy },
+        { OpMove, tracy },
+        { OpLeft, tracy },
+        { OpReport, tracy },
+        { OpPlace, tracy, 10, 10, East },       // off the 10 by 10 table
+        { OpPlace, tracy, 9, 9, Invalid },
+        { OpMove, nobody },
+        { OpPlace, tracy, 9, 9, East },
+        { OpMove, tracy },                      // over the edge
+        { OpRemove, tracy },
+        { OpReport, tracy }
+    };
+    const size_t count = sizeof ( ops ) / sizeof ( ops[0] );
+    OpResult results[count];
+    size_t done = engine->submit ( ops, count, results );
+    cout << "batch: " << done << " of " << count << " done" << endl;
+    for ( size_t inx = 0; inx < count; ++inx )
+    {
+        printResult ( results[inx] );
+    }
+}
+
+struct Contender
+{
+    unsigned robot;
+    unsigned rounds;
+    unsigned landed;        // on Robbie's cell, which mustn't happen
+};
+
+void replace ( Contender * contender )
+{
+    Op op = { OpPlace, contender->robot, 5, 5, North };
+    OpResult result;
+    for ( unsigned round = 0; round < contender->rounds; ++round )
+    {
+        Engine::singleton()->submit ( &op, 1, &result );
+    }
+}
+
+void intrude ( Contender * contender )
+{
+    Op ops[2] =
+    {
+        { OpPlace, contender->robot, 5, 5, North },
+        { OpPlace, contender->robot, 0, 0, North }
+    };
+    OpResult results[2];
+    for ( unsigned round = 0; round < contender->rounds; ++round )
+    {
+        Engine::singleton()->submit ( ops, 2, results );
+        if ( results[0].status == OpDone )
+        {
+            ++contender->landed;
+        }
+    }
+}
+
+bool sameRobots ( const vector< RobotState > & lhs, const vector< RobotState > & rhs )
+{
+    if ( lhs.size() != rhs.size() )
+    {
+        return false;
+    }
+    for ( size_t inx = 0; inx < lhs.size(); ++inx )
+    {
+        if ( lhs[inx].id != rhs[inx].id ||
+             lhs[inx].onTable != rhs[inx].onTable ||
+             lhs[inx].xpos != rhs[inx].xpos ||
+             lhs[inx].ypos != rhs[inx].ypos ||
+             lhs[inx].direction != rhs[inx].direction
+           )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void testSnapshot()
+{
+    Engine * engine = Engine::singleton();
+    unsigned pinny = engine->createRobot ( "Pinny" );
+    Op op = { OpPlace, pinny, 2, 2, East };
+    OpResult result;
+    engine->submit ( &op, 1, &result );
+
+    const Snapshot * pinned = engine->pin();
+    unsigned long version = pinned->version();
+    vector< RobotState > robots ( pinned->robots() );
+
+    op.code = OpMove;
+    for ( int batch = 0; batch < 5; ++batch )
+    {
+        engine->submit ( &op, 1, &result );
+    }
+
+    const Snapshot * latest = engine->pin();
+    cout << "snapshot: pinned one "
+         << ( pinned->version() == version && sameRobots ( pinned->robots(), robots )
+              ? "unchanged" : "CHANGED" )
+         << ", latest one " << ( latest->version() > version ? "newer" : "NOT NEWER" )
+         << endl;
+    for ( size_t inx = 0; inx < latest->robots().size(); ++inx )
+    {
+        const RobotState & state = latest->robots()[inx];
+        if ( state.id == pinny )
+        {
+            cout << "    ";
+            reportState ( cout, state, latest->continuous() );
+            cout << endl;
+        }
+    }
+    engine->unpin ( latest );
+    engine->unpin ( pinned );
+
+    op.code = OpRemove;
+    engine->submit ( &op, 1, &result );
+}
+
+void testConcurrent()
+{
+    Engine * engine = Engine::singleton();
+    Contender robbie = { engine->createRobot ( "Robbie" ), concurrentRounds, 0 };
+    Contender sally = { engine->createRobot ( "Sally" ), concurrentRounds, 0 };
+    Op op = { OpPlace, robbie.robot, 5, 5, North };
+    OpResult result;
+    engine->submit ( &op, 1, &result );
+
+    engine->setConcurrent ( true );
+    thread robbieThread ( replace, &robbie );
+    thread sallyThread ( intrude, &sally );
+    robbieThread.join();
+    sallyThread.join();
+    engine->setConcurrent ( false );
+
+    op.code = OpReport;
+    engine->submit ( &op, 1, &result );
+    cout << "concurrent: Sally landed on Robbie's cell " << sally.landed
+         << " times; Robbie is at " << result.xpos << ',' << result.ypos << endl;
+
+    // Off the table again, out of the next test's way.
+    Op removes[2] = { { OpRemove, robbie.robot }, { OpRemove, sally.robot } };
+    OpResult removed[2];
+    engine->submit ( removes, 2, removed );
+}
+
+}
+
+extern int main ( int argc, char ** argv )
+{
+    try
+    {
+        testBatch();
+        testSnapshot();
+        testConcurrent();
+    }
+    catch ( exception & e )
+    {
+        cout << "Caught exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}